@@ -0,0 +1,208 @@
+#ifndef ORB_SLAM3_ROS2__ATLAS_STORE_HPP_
+#define ORB_SLAM3_ROS2__ATLAS_STORE_HPP_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "orb_slam3_ros2/settings_file.hpp"
+
+namespace orb_slam3_ros2 {
+
+// What happens to the saved atlas of a run. `map` starts from scratch and
+// saves on shutdown, `resume` loads the saved atlas (if there is a valid one)
+// and keeps mapping into it, `localize` loads it and only tracks against it.
+enum class AtlasMode { Off, Map, Resume, Localize };
+
+inline bool parse_atlas_mode(const std::string &name, AtlasMode &mode)
+{
+  if (name == "off") {
+    mode = AtlasMode::Off;
+  } else if (name == "map") {
+    mode = AtlasMode::Map;
+  } else if (name == "resume") {
+    mode = AtlasMode::Resume;
+  } else if (name == "localize") {
+    mode = AtlasMode::Localize;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// An ORB_SLAM3 atlas saved as `<directory>/<name>.osa`, in ORB_SLAM3's own
+// binary archive (keyframes, map points and the keyframe database), plus a
+// fixed size manifest next to it. ORB_SLAM3 exits the process when an atlas
+// does not load, so the manifest is checked first: the version, the sensor
+// and the vocabulary the atlas was built with, and the size of the archive,
+// which catches a save that never finished.
+//
+// ORB_SLAM3 is pointed at the atlas through its System.LoadAtlasFromFile and
+// System.SaveAtlasToFile settings and writes it during Shutdown(). It saves
+// to a staging name, and commit() renames the result into place, so a crash
+// while saving leaves the previous atlas intact.
+class AtlasStore {
+public:
+  AtlasStore(const std::string &directory, const std::string &name)
+    : base_(std::filesystem::path(directory) / name)
+  {
+  }
+
+  std::string atlas_path() const { return base_.string() + ".osa"; }
+  std::string manifest_path() const { return base_.string() + ".manifest"; }
+  const std::string &error() const { return error_; }
+
+  // true if there is an atlas that was saved by this sensor and vocabulary
+  bool check(int sensor, const std::string &vocabulary_path)
+  {
+    Manifest manifest;
+    std::FILE *file = std::fopen(manifest_path().c_str(), "rb");
+    if (!file) {
+      error_ = "no manifest at " + manifest_path();
+      return false;
+    }
+    bool read = std::fread(&manifest, sizeof(manifest), 1, file) == 1;
+    std::fclose(file);
+    Manifest expected = make_manifest(sensor, 0, vocabulary_path);
+    std::error_code ec;
+    uint64_t atlas_size = std::filesystem::file_size(atlas_path(), ec);
+    if (!read || std::memcmp(manifest.magic, expected.magic,
+                             sizeof(manifest.magic)) != 0 ||
+        manifest.version != expected.version) {
+      error_ = "unrecognised manifest " + manifest_path();
+    } else if (manifest.sensor != sensor) {
+      error_ = "the atlas was saved with another sensor type";
+    } else if (manifest.vocabulary_size != expected.vocabulary_size ||
+               manifest.vocabulary_hash != expected.vocabulary_hash) {
+      error_ = "the atlas was saved with another vocabulary";
+    } else if (ec || atlas_size != manifest.atlas_size) {
+      error_ = "incomplete atlas " + atlas_path();
+    } else {
+      return true;
+    }
+    return false;
+  }
+
+  // Copies `settings_path` to `out_path` with the atlas settings replaced,
+  // so the atlas is loaded from and/or saved to this store.
+  bool write_settings(const std::string &settings_path,
+                      const std::string &out_path, bool load, bool save) const
+  {
+    std::ostringstream atlas;
+    atlas << "\n# atlas by orb_slam3_ros2\n";
+    if (load) {
+      atlas << "System.LoadAtlasFromFile: \"" << orb_slam3_name(base_)
+            << "\"\n";
+    }
+    if (save) {
+      atlas << "System.SaveAtlasToFile: \"" << orb_slam3_name(staging())
+            << "\"\n";
+    }
+    return rewrite_settings(
+      settings_path, out_path,
+      {"System.LoadAtlasFromFile", "System.SaveAtlasToFile"}, atlas.str());
+  }
+
+  // Moves the atlas ORB_SLAM3 saved during Shutdown() into place and writes
+  // its manifest.
+  bool commit(int sensor, const std::string &vocabulary_path)
+  {
+    std::string staged = staging().string() + ".osa";
+    std::error_code ec;
+    uint64_t atlas_size = std::filesystem::file_size(staged, ec);
+    if (ec) {
+      error_ = "ORB_SLAM3 did not save " + staged;
+      return false;
+    }
+    Manifest manifest = make_manifest(sensor, atlas_size, vocabulary_path);
+    std::string tmp_path = manifest_path() + ".tmp";
+    std::FILE *file = std::fopen(tmp_path.c_str(), "wb");
+    bool ok = file && std::fwrite(&manifest, sizeof(manifest), 1, file) == 1;
+    ok = file && std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(staged.c_str(), atlas_path().c_str()) != 0 ||
+        std::rename(tmp_path.c_str(), manifest_path().c_str()) != 0) {
+      std::remove(tmp_path.c_str());
+      error_ = "failed to write " + manifest_path();
+      return false;
+    }
+    return true;
+  }
+
+private:
+  struct Manifest {
+    char magic[8];
+    uint32_t version;
+    int32_t sensor;
+    uint64_t atlas_size;
+    uint64_t vocabulary_size;
+    uint64_t vocabulary_hash;
+    int64_t saved_at;
+    uint8_t reserved[16];
+  };
+  static_assert(sizeof(Manifest) == 64, "Manifest is stored verbatim");
+
+  static Manifest make_manifest(int sensor, uint64_t atlas_size,
+                                const std::string &vocabulary_path)
+  {
+    Manifest manifest;
+    std::memset(&manifest, 0, sizeof(manifest));
+    std::memcpy(manifest.magic, "ORBATL01", sizeof(manifest.magic));
+    manifest.version = 1;
+    manifest.sensor = sensor;
+    manifest.atlas_size = atlas_size;
+    fingerprint(vocabulary_path, manifest.vocabulary_size,
+                manifest.vocabulary_hash);
+    manifest.saved_at = std::time(nullptr);
+    return manifest;
+  }
+
+  // FNV-1a over the head and tail of the vocabulary, which tells the
+  // shipped vocabularies apart without reading all of it
+  static void fingerprint(const std::string &path, uint64_t &size,
+                          uint64_t &hash)
+  {
+    constexpr std::size_t kChunk = 64 * 1024;
+    size = 0;
+    hash = 14695981039346656037ull;
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+      return;
+    }
+    size = static_cast<uint64_t>(in.tellg());
+    std::vector<char> buffer(kChunk);
+    for (uint64_t offset : {uint64_t(0), size > kChunk ? size - kChunk : 0}) {
+      in.seekg(offset);
+      in.read(buffer.data(), buffer.size());
+      for (std::streamsize i = 0; i < in.gcount(); i++) {
+        hash = (hash ^ static_cast<uint8_t>(buffer[i])) * 1099511628211ull;
+      }
+      in.clear();
+    }
+  }
+
+  std::filesystem::path staging() const
+  {
+    return base_.string() + ".next";
+  }
+
+  // ORB_SLAM3 prepends "./" and appends ".osa" to the names it is given
+  static std::string orb_slam3_name(const std::filesystem::path &path)
+  {
+    return std::filesystem::relative(path, std::filesystem::current_path())
+      .string();
+  }
+
+  std::filesystem::path base_;
+  std::string error_;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__ATLAS_STORE_HPP_
@@ -0,0 +1,214 @@
+#ifndef ORB_SLAM3_ROS2__CAMERA_MODEL_HPP_
+#define ORB_SLAM3_ROS2__CAMERA_MODEL_HPP_
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <sensor_msgs/msg/camera_info.hpp>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "orb_slam3_ros2/settings_file.hpp"
+
+namespace orb_slam3_ros2 {
+
+// Camera1 of an ORB_SLAM3 settings file, parsed once. Both the current
+// (Camera1.*) and the pre 1.0 (Camera.*) key layouts are understood, for the
+// PinHole and KannalaBrandt8 models, and Rectified cameras (already
+// rectified stereo pairs) as pinholes without distortion.
+// init_rectification() precomputes the remap lookup tables, so rectifying a
+// frame is a single table lookup per pixel and the tracker can be handed an
+// undistorted pinhole camera.
+class CameraModel {
+public:
+  enum class Type { PinHole, KannalaBrandt8 };
+
+  bool load(const std::string &settings_path)
+  {
+    try {
+      cv::FileStorage settings(settings_path, cv::FileStorage::READ);
+      if (!settings.isOpened()) {
+        error_ = "cannot open " + settings_path;
+        return false;
+      }
+      prefix_ = settings["Camera1.fx"].empty() ? "Camera." : "Camera1.";
+
+      std::string type = settings["Camera.type"].empty()
+                           ? "PinHole"
+                           : std::string(settings["Camera.type"]);
+      std::vector<std::string> distortion_keys;
+      prerectified_ = type == "Rectified";
+      if (type == "PinHole") {
+        type_ = Type::PinHole;
+        distortion_keys = {"k1", "k2", "p1", "p2", "k3"};
+      } else if (prerectified_) {
+        type_ = Type::PinHole;
+      } else if (type == "KannalaBrandt8") {
+        type_ = Type::KannalaBrandt8;
+        distortion_keys = {"k1", "k2", "k3", "k4"};
+      } else {
+        error_ = "unsupported camera type " + type;
+        return false;
+      }
+
+      double fx, fy, cx, cy;
+      if (!read(settings, prefix_ + "fx", fx) ||
+          !read(settings, prefix_ + "fy", fy) ||
+          !read(settings, prefix_ + "cx", cx) ||
+          !read(settings, prefix_ + "cy", cy) ||
+          !read(settings, "Camera.width", width_) ||
+          !read(settings, "Camera.height", height_)) {
+        return false;
+      }
+      K_ = (cv::Mat_<double>(3, 3) << fx, 0, cx, 0, fy, cy, 0, 0, 1);
+
+      // a missing pinhole k3 is the usual four parameter model
+      D_ = cv::Mat::zeros(type_ == Type::KannalaBrandt8 ? 4 : 5, 1, CV_64F);
+      for (std::size_t i = 0; i < distortion_keys.size(); i++) {
+        cv::FileNode node = settings[prefix_ + distortion_keys[i]];
+        if (!node.empty()) {
+          D_.at<double>(i) = node.real();
+        }
+      }
+    } catch (const cv::Exception &e) {
+      error_ = e.what();
+      return false;
+    }
+    rectified_K_ = K_.clone();
+    map1_.release();
+    map2_.release();
+    return true;
+  }
+
+  const std::string &error() const { return error_; }
+  Type type() const { return type_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+  const cv::Mat &K() const { return K_; }
+  const cv::Mat &D() const { return D_; }
+  const cv::Mat &rectified_K() const { return rectified_K_; }
+
+  bool has_distortion() const { return cv::countNonZero(D_) > 0; }
+  bool rectifying() const { return !map1_.empty(); }
+
+  // Builds the lookup tables. `balance` trades the black border of a fully
+  // visible image (1) against cropping to valid pixels only (0); without
+  // distortion there is no border and the tables map every pixel to itself.
+  void init_rectification(double balance = 0.0)
+  {
+    cv::Size size(width_, height_);
+    cv::Mat identity = cv::Mat::eye(3, 3, CV_64F);
+    if (!has_distortion()) {
+      rectified_K_ = K_.clone();
+      cv::initUndistortRectifyMap(K_, D_, identity, rectified_K_, size,
+                                  CV_16SC2, map1_, map2_);
+    } else if (type_ == Type::KannalaBrandt8) {
+      cv::fisheye::estimateNewCameraMatrixForUndistortRectify(
+        K_, D_, size, identity, rectified_K_, balance);
+      cv::fisheye::initUndistortRectifyMap(K_, D_, identity, rectified_K_,
+                                           size, CV_16SC2, map1_, map2_);
+    } else {
+      rectified_K_ = cv::getOptimalNewCameraMatrix(K_, D_, size, balance);
+      cv::initUndistortRectifyMap(K_, D_, identity, rectified_K_, size,
+                                  CV_16SC2, map1_, map2_);
+    }
+  }
+
+  // false if the image does not have the calibrated size
+  bool rectify(const cv::Mat &src, cv::Mat &dst) const
+  {
+    if (src.cols != width_ || src.rows != height_) {
+      return false;
+    }
+    cv::remap(src, dst, map1_, map2_, cv::INTER_LINEAR,
+              cv::BORDER_CONSTANT);
+    return true;
+  }
+
+  // Describes either the raw or the rectified camera; the caller fills in
+  // the header of the image it belongs to.
+  sensor_msgs::msg::CameraInfo camera_info(bool rectified) const
+  {
+    sensor_msgs::msg::CameraInfo info;
+    info.width = width_;
+    info.height = height_;
+    if (rectified) {
+      info.distortion_model = "plumb_bob";
+      info.d.assign(5, 0.0);
+    } else {
+      info.distortion_model =
+        type_ == Type::KannalaBrandt8 ? "equidistant" : "plumb_bob";
+      info.d.assign(D_.begin<double>(), D_.end<double>());
+    }
+    const cv::Mat &K = rectified ? rectified_K_ : K_;
+    for (int i = 0; i < 9; i++) {
+      info.k[i] = K.at<double>(i / 3, i % 3);
+    }
+    info.r = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+    // P is the camera after rectification in either case
+    for (int i = 0; i < 12; i++) {
+      info.p[i] = i % 4 == 3 ? 0.0 : rectified_K_.at<double>(i / 4, i % 4);
+    }
+    return info;
+  }
+
+  // Copies `settings_path` to `out_path` with Camera1 replaced by the
+  // undistorted pinhole camera that rectify() produces. Everything else,
+  // including the IMU extrinsics, still holds since rectification does not
+  // rotate the camera. Rectified settings already describe that camera and
+  // are copied as they are.
+  bool write_rectified_settings(const std::string &settings_path,
+                                const std::string &out_path) const
+  {
+    if (prerectified_) {
+      return rewrite_settings(settings_path, out_path, {}, "");
+    }
+    std::ostringstream camera;
+    camera.precision(10);
+    camera << "\n# rectified by orb_slam3_ros2\n"
+           << "Camera.type: \"PinHole\"\n"
+           << prefix_ << "fx: " << rectified_K_.at<double>(0, 0) << "\n"
+           << prefix_ << "fy: " << rectified_K_.at<double>(1, 1) << "\n"
+           << prefix_ << "cx: " << rectified_K_.at<double>(0, 2) << "\n"
+           << prefix_ << "cy: " << rectified_K_.at<double>(1, 2) << "\n";
+    for (const char *key : {"k1", "k2", "p1", "p2"}) {
+      camera << prefix_ << key << ": 0.0\n";
+    }
+    return rewrite_settings(settings_path, out_path,
+                            {"Camera.type", prefix_ + "fx", prefix_ + "fy",
+                             prefix_ + "cx", prefix_ + "cy", prefix_ + "k",
+                             prefix_ + "p"},
+                            camera.str());
+  }
+
+private:
+  template <typename T>
+  bool read(const cv::FileStorage &settings, const std::string &key, T &value)
+  {
+    cv::FileNode node = settings[key];
+    if (node.empty()) {
+      error_ = "missing " + key;
+      return false;
+    }
+    node >> value;
+    return true;
+  }
+
+  std::string error_;
+  std::string prefix_ = "Camera1.";
+  Type type_ = Type::PinHole;
+  bool prerectified_ = false;
+  int width_ = 0;
+  int height_ = 0;
+  cv::Mat K_;
+  cv::Mat D_;
+  cv::Mat rectified_K_;
+  cv::Mat map1_;
+  cv::Mat map2_;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__CAMERA_MODEL_HPP_
@@ -0,0 +1,186 @@
+#ifndef ORB_SLAM3_ROS2__FRAME_RING_HPP_
+#define ORB_SLAM3_ROS2__FRAME_RING_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace orb_slam3_ros2 {
+
+// What the tracking thread does when frames arrive faster than it can track
+// them. DropOldest evicts the oldest queued frame to make room for a new one
+// and otherwise tracks frames in order. KeepLatest always jumps to the newest
+// queued frame and discards everything older.
+enum class DropPolicy { DropOldest, KeepLatest };
+
+inline bool parse_drop_policy(const std::string &name, DropPolicy &policy)
+{
+  if (name == "drop-oldest") {
+    policy = DropPolicy::DropOldest;
+    return true;
+  }
+  if (name == "keep-latest") {
+    policy = DropPolicy::KeepLatest;
+    return true;
+  }
+  return false;
+}
+
+inline const char *drop_policy_name(DropPolicy policy)
+{
+  return policy == DropPolicy::DropOldest ? "drop-oldest" : "keep-latest";
+}
+
+// Bounded lock-free ring between one producer (a subscription callback) and
+// one consumer (the tracking thread). The producer never blocks: when the
+// ring is full it evicts the oldest entry itself. Every cell carries a
+// sequence number (Vyukov's bounded queue) so an eviction can never touch a
+// cell the consumer is still moving out of.
+template <typename T>
+class FrameRing {
+public:
+  // capacity is rounded up to the next power of two, at most kMaxCapacity
+  explicit FrameRing(std::size_t capacity)
+  {
+    std::size_t size = 2;
+    while (size < capacity && size < kMaxCapacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    cells_ = std::make_unique<Cell[]>(size);
+    for (std::size_t i = 0; i < size; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  static constexpr std::size_t kMaxCapacity = std::size_t(1) << 20;
+
+  FrameRing(const FrameRing &) = delete;
+  FrameRing &operator=(const FrameRing &) = delete;
+
+  // producer side. Returns false if the item itself had to be dropped.
+  bool push(T item)
+  {
+    bool queued = try_enqueue(item);
+    if (!queued) {
+      T evicted;
+      if (try_dequeue(evicted)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+      queued = try_enqueue(item);
+    }
+
+    if (!queued) {
+      // the only free cell is still being read by the consumer
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    pushed_.fetch_add(1, std::memory_order_relaxed);
+    std::size_t depth = size();
+    if (depth > high_water_.load(std::memory_order_relaxed)) {
+      high_water_.store(depth, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // consumer side, oldest entry first
+  bool pop(T &item) { return try_dequeue(item); }
+
+  // consumer side, newest entry; everything older is counted as dropped
+  bool pop_latest(T &item)
+  {
+    if (!try_dequeue(item)) {
+      return false;
+    }
+    T newer;
+    while (try_dequeue(newer)) {
+      item = std::move(newer);
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  bool pop(T &item, DropPolicy policy)
+  {
+    return policy == DropPolicy::KeepLatest ? pop_latest(item) : pop(item);
+  }
+
+  std::size_t size() const
+  {
+    std::size_t head = head_.load(std::memory_order_acquire);
+    std::size_t tail = tail_.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+  bool empty() const { return size() == 0; }
+  std::size_t capacity() const { return mask_ + 1; }
+  uint64_t pushed() const { return pushed_.load(std::memory_order_relaxed); }
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  // deepest the ring has been since the last call
+  std::size_t take_high_water()
+  {
+    return high_water_.exchange(size(), std::memory_order_relaxed);
+  }
+
+private:
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  bool try_enqueue(T &item)
+  {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    Cell &cell = cells_[pos & mask_];
+    if (cell.sequence.load(std::memory_order_acquire) != pos) {
+      return false;
+    }
+    cell.value = std::move(item);
+    cell.sequence.store(pos + 1, std::memory_order_release);
+    tail_.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // called by the consumer and, when evicting, by the producer
+  bool try_dequeue(T &item)
+  {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[pos & mask_];
+      std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+      std::intptr_t diff =
+        static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          item = std::move(cell.value);
+          cell.value = T();
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  std::unique_ptr<Cell[]> cells_;
+  std::size_t mask_;
+
+  alignas(64) std::atomic<std::size_t> head_{0};
+  alignas(64) std::atomic<std::size_t> tail_{0};
+
+  alignas(64) std::atomic<uint64_t> pushed_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<std::size_t> high_water_{0};
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__FRAME_RING_HPP_
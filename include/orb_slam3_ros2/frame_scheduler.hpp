@@ -0,0 +1,154 @@
+#ifndef ORB_SLAM3_ROS2__FRAME_SCHEDULER_HPP_
+#define ORB_SLAM3_ROS2__FRAME_SCHEDULER_HPP_
+
+#include <diagnostic_msgs/msg/diagnostic_status.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "orb_slam3_ros2/frame_ring.hpp"
+#include "orb_slam3_ros2/stage_tracer.hpp"
+
+namespace orb_slam3_ros2 {
+
+struct FrameSchedulerParams {
+  // how long the newest queued frame may wait behind the ones ahead of it;
+  // 0 tracks every frame
+  double latency_budget_ms = 0.0;
+  // rotation since the last tracked frame, in radians, at which a frame is
+  // likely to become a keyframe and is tracked even when behind
+  double keyframe_rotation = 0.1;
+  // camera time, in seconds, after which a frame is tracked even when
+  // behind, so tracking never goes too long without an image
+  double max_skip_interval = 0.25;
+};
+
+// Decides, frame by frame, which queued frames the tracking thread skips
+// when it falls behind. A frame is tracked when the frames queued after it
+// can still be tracked within the latency budget at the recent tracking
+// cost. Otherwise it is skipped, unless the camera moved enough since the
+// last tracked frame that orbslam3 would likely make it a keyframe. The
+// caller keeps the imu samples of skipped frames and hands them over with
+// the next tracked frame, so no inertial data is lost.
+//
+// Only the tracking thread calls should_track() and add_latency(); the
+// counters can be read from anywhere.
+class FrameScheduler {
+public:
+  explicit FrameScheduler(const FrameSchedulerParams &params = {})
+    : params_(params)
+  {
+  }
+
+  bool enabled() const { return params_.latency_budget_ms > 0.0; }
+
+  // `backlog` is the number of frames queued after this one
+  bool should_track(std::size_t backlog, double since_tracked,
+                    double rotation)
+  {
+    double wait_ms = backlog * mean_latency_ms_;
+    if (!enabled() || wait_ms <= params_.latency_budget_ms) {
+      on_time_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    if (rotation >= params_.keyframe_rotation ||
+        since_tracked >= params_.max_skip_interval) {
+      kept_for_motion_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    skipped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // tracking latency of a frame, smoothed over the last few frames
+  void add_latency(double latency_ms)
+  {
+    mean_latency_ms_ = mean_latency_ms_ == 0.0
+                         ? latency_ms
+                         : 0.9 * mean_latency_ms_ + 0.1 * latency_ms;
+    mean_latency_.store(mean_latency_ms_, std::memory_order_relaxed);
+  }
+
+  // Angle turned through, in radians, over a run of imu samples with
+  // angular velocity `w` and stamp `t`.
+  template <typename Points>
+  static double rotation(const Points &points)
+  {
+    double angle = 0.0;
+    for (std::size_t i = 1; i < points.size(); i++) {
+      angle += points[i].w.norm() * (points[i].t - points[i - 1].t);
+    }
+    return angle;
+  }
+
+  uint64_t on_time() const { return on_time_.load(std::memory_order_relaxed); }
+  uint64_t kept_for_motion() const
+  {
+    return kept_for_motion_.load(std::memory_order_relaxed);
+  }
+  uint64_t skipped() const { return skipped_.load(std::memory_order_relaxed); }
+  double mean_latency_ms() const
+  {
+    return mean_latency_.load(std::memory_order_relaxed);
+  }
+
+private:
+  FrameSchedulerParams params_;
+  double mean_latency_ms_ = 0.0;
+  std::atomic<double> mean_latency_{0.0};
+  std::atomic<uint64_t> on_time_{0};
+  std::atomic<uint64_t> kept_for_motion_{0};
+  std::atomic<uint64_t> skipped_{0};
+};
+
+// The "<node>: tracking queue" status of both nodes: how full the frame
+// ring is and what became of the frames pushed into it. It warns while the
+// ring drops frames; `last_dropped` carries the drop count from one report
+// to the next. Node specific values are appended by the caller.
+template <typename T>
+diagnostic_msgs::msg::DiagnosticStatus
+tracking_queue_status(const std::string &node_name, FrameRing<T> &ring,
+                      DropPolicy policy, const FrameScheduler &scheduler,
+                      uint64_t frames_tracked, bool ready,
+                      uint64_t &last_dropped)
+{
+  diagnostic_msgs::msg::DiagnosticStatus status;
+  status.name = node_name + ": tracking queue";
+  status.hardware_id = "orb_slam3";
+
+  uint64_t dropped = ring.dropped();
+  status.level = dropped > last_dropped
+                   ? diagnostic_msgs::msg::DiagnosticStatus::WARN
+                   : diagnostic_msgs::msg::DiagnosticStatus::OK;
+  status.message = dropped > last_dropped
+                     ? "Dropping frames, tracking is behind the camera"
+                     : "Tracking keeps up with the camera";
+  last_dropped = dropped;
+  if (!ready) {
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+    status.message = "Loading ORB_SLAM3";
+  }
+
+  add_value(status, "drop_policy", drop_policy_name(policy));
+  add_value(status, "queue_capacity", std::to_string(ring.capacity()));
+  add_value(status, "queue_depth", std::to_string(ring.size()));
+  add_value(status, "queue_high_water",
+            std::to_string(ring.take_high_water()));
+  add_value(status, "frames_received", std::to_string(ring.pushed()));
+  add_value(status, "frames_tracked", std::to_string(frames_tracked));
+  add_value(status, "frames_dropped", std::to_string(dropped));
+  if (scheduler.enabled()) {
+    add_value(status, "frames_skipped", std::to_string(scheduler.skipped()));
+    add_value(status, "frames_kept_for_motion",
+              std::to_string(scheduler.kept_for_motion()));
+    add_value(status, "track_mean_ms",
+              std::to_string(scheduler.mean_latency_ms()));
+  }
+  return status;
+}
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__FRAME_SCHEDULER_HPP_
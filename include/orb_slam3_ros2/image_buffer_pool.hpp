@@ -0,0 +1,67 @@
+#ifndef ORB_SLAM3_ROS2__IMAGE_BUFFER_POOL_HPP_
+#define ORB_SLAM3_ROS2__IMAGE_BUFFER_POOL_HPP_
+
+#include <opencv2/core/core.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+// Fixed set of preallocated images of one size and type, handed out as
+// plain cv::Mat. A buffer is free again once every Mat sharing it is gone,
+// so consumers never release anything: a frame orbslam3 still references or
+// an image waiting in a writer queue is simply skipped. Converting or
+// resizing into an acquired buffer reuses its memory instead of allocating.
+// When every buffer is in use a fresh image is allocated and counted.
+class ImageBufferPool {
+public:
+  ImageBufferPool(std::size_t count, cv::Size size, int type)
+  {
+    buffers_.reserve(count);
+    for (std::size_t i = 0; i < count; i++) {
+      buffers_.emplace_back(size, type);
+    }
+  }
+
+  ImageBufferPool(const ImageBufferPool &) = delete;
+  ImageBufferPool &operator=(const ImageBufferPool &) = delete;
+
+  cv::Mat acquire()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::size_t n = 0; n < buffers_.size(); n++) {
+      next_ = (next_ + 1) % buffers_.size();
+      cv::Mat &buffer = buffers_[next_];
+      // the pool's own reference is the only one left
+      if (CV_XADD(&buffer.u->refcount, 0) == 1) {
+        hits_++;
+        return buffer;
+      }
+    }
+    misses_++;
+    return buffers_.empty() ? cv::Mat()
+                            : cv::Mat(buffers_[0].size(), buffers_[0].type());
+  }
+
+  cv::Size size() const
+  {
+    return buffers_.empty() ? cv::Size() : buffers_[0].size();
+  }
+
+  uint64_t hits() const { return hits_.load(); }
+  uint64_t misses() const { return misses_.load(); }
+
+private:
+  std::mutex mutex_;
+  std::vector<cv::Mat> buffers_;
+  std::size_t next_ = 0;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__IMAGE_BUFFER_POOL_HPP_
@@ -0,0 +1,120 @@
+#ifndef ORB_SLAM3_ROS2__IMAGE_WRITER_POOL_HPP_
+#define ORB_SLAM3_ROS2__IMAGE_WRITER_POOL_HPP_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "orb_slam3_ros2/stage_tracer.hpp"
+
+namespace orb_slam3_ros2 {
+
+// Encodes and writes images on a small pool of threads. submit() never
+// blocks: when the queue is full the image is dropped and counted instead.
+// Images must own their data, the pool keeps them until they are written.
+class ImageWriterPool {
+public:
+  ImageWriterPool(std::size_t threads, std::size_t queue_size)
+    : queue_size_(queue_size)
+  {
+    for (std::size_t i = 0; i < std::max<std::size_t>(1, threads); i++) {
+      threads_.emplace_back(&ImageWriterPool::run, this);
+    }
+  }
+
+  ~ImageWriterPool() { close(); }
+
+  ImageWriterPool(const ImageWriterPool &) = delete;
+  ImageWriterPool &operator=(const ImageWriterPool &) = delete;
+
+  // times every written image as `stage`; set before the first submit()
+  void set_tracer(StageTracer *tracer, std::size_t stage)
+  {
+    tracer_ = tracer;
+    tracer_stage_ = stage;
+  }
+
+  bool submit(std::string path, cv::Mat image)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_ || jobs_.size() >= queue_size_) {
+        dropped_++;
+        return false;
+      }
+      jobs_.emplace_back(std::move(path), std::move(image));
+    }
+    cv_.notify_one();
+    return true;
+  }
+
+  // writes everything still queued, then stops the threads
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread &thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+  uint64_t written() const { return written_.load(); }
+  uint64_t dropped() const { return dropped_.load(); }
+  uint64_t failed() const { return failed_.load(); }
+
+private:
+  void run()
+  {
+    while (true) {
+      std::pair<std::string, cv::Mat> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+
+      ScopedTrace trace(tracer_, tracer_stage_);
+      if (cv::imwrite(job.first, job.second)) {
+        written_++;
+      } else {
+        failed_++;
+      }
+    }
+  }
+
+  std::size_t queue_size_;
+  std::deque<std::pair<std::string, cv::Mat>> jobs_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  StageTracer *tracer_ = nullptr;
+  std::size_t tracer_stage_ = 0;
+
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> failed_{0};
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__IMAGE_WRITER_POOL_HPP_
@@ -0,0 +1,128 @@
+#ifndef ORB_SLAM3_ROS2__IMU_RING_BUFFER_HPP_
+#define ORB_SLAM3_ROS2__IMU_RING_BUFFER_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+// Fixed-capacity ring of IMU samples stored as separate arrays per axis,
+// ordered by stamp. All storage is allocated in the constructor, so pushing
+// and slicing never touch the heap. Not thread safe on its own; the owner
+// guards it with a mutex.
+class ImuRingBuffer {
+public:
+  explicit ImuRingBuffer(std::size_t capacity)
+    : stamps_(capacity), acc_x_(capacity), acc_y_(capacity),
+      acc_z_(capacity), gyr_x_(capacity), gyr_y_(capacity), gyr_z_(capacity)
+  {
+  }
+
+  // Samples must arrive with increasing stamps; anything else is rejected.
+  // When the ring is full the oldest sample is overwritten.
+  bool push(double stamp, float ax, float ay, float az, float gx, float gy,
+            float gz)
+  {
+    if (count_ > 0 && stamp <= stamps_[physical(count_ - 1)]) {
+      out_of_order_++;
+      return false;
+    }
+
+    if (count_ == capacity()) {
+      head_ = (head_ + 1) % capacity();
+      count_--;
+      overwritten_++;
+    }
+
+    std::size_t i = physical(count_);
+    stamps_[i] = stamp;
+    acc_x_[i] = ax;
+    acc_y_[i] = ay;
+    acc_z_[i] = az;
+    gyr_x_[i] = gx;
+    gyr_y_[i] = gy;
+    gyr_z_[i] = gz;
+    count_++;
+    return true;
+  }
+
+  // Hands every sample with stamp <= end to emit(t, ax, ay, az, gx, gy, gz),
+  // oldest first, then removes them. If a later sample is already buffered,
+  // one more sample interpolated at exactly `end` closes the interval.
+  // ORB_SLAM3 keeps the last measurement it is given as the start of the next
+  // interval, so that interpolated sample also serves as the next frame's
+  // start boundary. Samples newer than `end` stay for the next call.
+  template <typename EmitFn>
+  std::size_t slice(double end, EmitFn &&emit)
+  {
+    std::size_t last = upper_bound(end);
+    for (std::size_t k = 0; k < last; k++) {
+      std::size_t i = physical(k);
+      emit(stamps_[i], acc_x_[i], acc_y_[i], acc_z_[i], gyr_x_[i], gyr_y_[i],
+           gyr_z_[i]);
+    }
+
+    std::size_t emitted = last;
+    if (last > 0 && last < count_ && stamps_[physical(last - 1)] < end) {
+      std::size_t a = physical(last - 1);
+      std::size_t b = physical(last);
+      float f =
+        static_cast<float>((end - stamps_[a]) / (stamps_[b] - stamps_[a]));
+      emit(end, lerp(acc_x_, a, b, f), lerp(acc_y_, a, b, f),
+           lerp(acc_z_, a, b, f), lerp(gyr_x_, a, b, f),
+           lerp(gyr_y_, a, b, f), lerp(gyr_z_, a, b, f));
+      emitted++;
+    }
+
+    head_ = physical(last);
+    count_ -= last;
+    return emitted;
+  }
+
+  std::size_t size() const { return count_; }
+  std::size_t capacity() const { return stamps_.size(); }
+  uint64_t out_of_order() const { return out_of_order_; }
+  uint64_t overwritten() const { return overwritten_; }
+
+private:
+  std::size_t physical(std::size_t logical) const
+  {
+    return (head_ + logical) % capacity();
+  }
+
+  // number of buffered samples with stamp <= t
+  std::size_t upper_bound(double t) const
+  {
+    std::size_t lo = 0;
+    std::size_t hi = count_;
+    while (lo < hi) {
+      std::size_t mid = lo + (hi - lo) / 2;
+      if (stamps_[physical(mid)] <= t) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  static float lerp(const std::vector<float> &v, std::size_t a, std::size_t b,
+                    float f)
+  {
+    return v[a] + (v[b] - v[a]) * f;
+  }
+
+  std::vector<double> stamps_;
+  std::vector<float> acc_x_, acc_y_, acc_z_;
+  std::vector<float> gyr_x_, gyr_y_, gyr_z_;
+
+  std::size_t head_ = 0;
+  std::size_t count_ = 0;
+  uint64_t out_of_order_ = 0;
+  uint64_t overwritten_ = 0;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__IMU_RING_BUFFER_HPP_
@@ -0,0 +1,288 @@
+#ifndef ORB_SLAM3_ROS2__LIVE_MAP_CLOUD_HPP_
+#define ORB_SLAM3_ROS2__LIVE_MAP_CLOUD_HPP_
+
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <sensor_msgs/msg/point_field.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "orb_slam3_ros2/map_delta_feed.hpp"
+
+namespace orb_slam3_ros2 {
+
+// Point layout of the clouds built from map points: x, y, z as float32,
+// optionally followed by the observation count and the reference keyframe
+// id as uint32.
+class PointCloud2Layout {
+public:
+  explicit PointCloud2Layout(bool observations = false, bool keyframe = false)
+  {
+    add_field("x", sensor_msgs::msg::PointField::FLOAT32);
+    add_field("y", sensor_msgs::msg::PointField::FLOAT32);
+    add_field("z", sensor_msgs::msg::PointField::FLOAT32);
+    if (observations) {
+      observations_offset_ = point_step_;
+      add_field("observations", sensor_msgs::msg::PointField::UINT32);
+    }
+    if (keyframe) {
+      keyframe_offset_ = point_step_;
+      add_field("keyframe", sensor_msgs::msg::PointField::UINT32);
+    }
+  }
+
+  uint32_t point_step() const { return point_step_; }
+
+  // whether the points carry anything that Updated deltas change
+  bool has_metadata() const
+  {
+    return observations_offset_ != 0 || keyframe_offset_ != 0;
+  }
+
+  // Sets up the fields and sizes `msg` for `count` points. The data buffer is
+  // resized in place, so its capacity carries over between calls.
+  void apply(sensor_msgs::msg::PointCloud2 &msg, std::size_t count) const
+  {
+    msg.fields = fields_;
+    msg.is_bigendian = false;
+    msg.is_dense = true;
+    msg.point_step = point_step_;
+    resize(msg, count);
+  }
+
+  void resize(sensor_msgs::msg::PointCloud2 &msg, std::size_t count) const
+  {
+    msg.height = 1;
+    msg.width = count;
+    msg.row_step = count * point_step_;
+    msg.data.resize(msg.row_step);
+  }
+
+  void write(uint8_t *point, float x, float y, float z, uint32_t observations,
+             uint64_t keyframe) const
+  {
+    std::memcpy(point, &x, sizeof(float));
+    std::memcpy(point + 4, &y, sizeof(float));
+    std::memcpy(point + 8, &z, sizeof(float));
+    if (observations_offset_) {
+      std::memcpy(point + observations_offset_, &observations,
+                  sizeof(uint32_t));
+    }
+    if (keyframe_offset_) {
+      uint32_t id = static_cast<uint32_t>(keyframe);
+      std::memcpy(point + keyframe_offset_, &id, sizeof(uint32_t));
+    }
+  }
+
+private:
+  void add_field(const std::string &name, uint8_t datatype)
+  {
+    sensor_msgs::msg::PointField field;
+    field.name = name;
+    field.offset = point_step_;
+    field.datatype = datatype;
+    field.count = 1;
+    fields_.push_back(field);
+    point_step_ += 4;
+  }
+
+  std::vector<sensor_msgs::msg::PointField> fields_;
+  uint32_t point_step_ = 0;
+  uint32_t observations_offset_ = 0;
+  uint32_t keyframe_offset_ = 0;
+};
+
+// The live map as PointCloud2 points, updated in place from map point
+// deltas. The points are stored in fixed-size chunks shared copy-on-write,
+// like the tiles of TiledOccupancyGrid: snapshot() copies a pointer per
+// chunk, and a chunk is only copied when it changes while a snapshot still
+// holds it. msg() keeps one message laid out from the chunks and copies
+// into it only the chunks written since it was last called. Chunks are kept
+// when the cloud shrinks, so a cloud that hovers around a chunk boundary
+// does not allocate.
+class LiveMapCloud {
+public:
+  static constexpr std::size_t kChunkPoints = 4096;
+  using Chunk = std::vector<uint8_t>;
+
+  // the cloud at one point in time, its chunks never change
+  struct Snapshot {
+    PointCloud2Layout layout;
+    std::vector<std::shared_ptr<const Chunk>> chunks;
+    std::size_t size = 0;
+
+    void to_msg(sensor_msgs::msg::PointCloud2 &msg) const
+    {
+      layout.apply(msg, size);
+      for (std::size_t i = 0; i < chunks.size(); i++) {
+        copy_chunk(*chunks[i], i, msg);
+      }
+    }
+  };
+
+  explicit LiveMapCloud(const PointCloud2Layout &layout = PointCloud2Layout(),
+                        std::size_t reserve = 0)
+    : layout_(layout)
+  {
+    layout_.apply(msg_, 0);
+    msg_.data.reserve(reserve * layout_.point_step());
+    chunks_.reserve(used_chunks(reserve));
+    dirty_.reserve(used_chunks(reserve));
+    ids_.reserve(reserve);
+    index_.reserve(reserve);
+  }
+
+  void apply(const MapPointDelta &delta)
+  {
+    switch (delta.type) {
+    case MapPointDelta::Type::Added: {
+      auto [it, inserted] = index_.emplace(delta.id, ids_.size());
+      if (!inserted) {
+        write(it->second, delta);
+        return;
+      }
+      ids_.push_back(delta.id);
+      reserve_chunks(ids_.size());
+      write(ids_.size() - 1, delta);
+      break;
+    }
+    case MapPointDelta::Type::Moved:
+    case MapPointDelta::Type::Updated: {
+      auto it = index_.find(delta.id);
+      if (it != index_.end()) {
+        write(it->second, delta);
+      }
+      break;
+    }
+    case MapPointDelta::Type::Removed:
+      remove(delta.id);
+      break;
+    }
+  }
+
+  void clear()
+  {
+    ids_.clear();
+    index_.clear();
+  }
+
+  std::size_t size() const { return ids_.size(); }
+  const PointCloud2Layout &layout() const { return layout_; }
+
+  Snapshot snapshot() const
+  {
+    Snapshot snapshot;
+    snapshot.layout = layout_;
+    snapshot.chunks.assign(chunks_.begin(),
+                           chunks_.begin() + used_chunks(ids_.size()));
+    snapshot.size = ids_.size();
+    return snapshot;
+  }
+
+  // the whole cloud as one message; its header is kept between calls
+  sensor_msgs::msg::PointCloud2 &msg()
+  {
+    layout_.resize(msg_, ids_.size());
+    std::size_t used = used_chunks(ids_.size());
+    for (std::size_t chunk : dirty_chunks_) {
+      if (chunk < used) {
+        copy_chunk(*chunks_[chunk], chunk, msg_);
+      }
+      dirty_[chunk] = false;
+    }
+    dirty_chunks_.clear();
+    return msg_;
+  }
+
+private:
+  static std::size_t used_chunks(std::size_t count)
+  {
+    return (count + kChunkPoints - 1) / kChunkPoints;
+  }
+
+  // copies the part of chunk `index` that lies within the message
+  static void copy_chunk(const Chunk &chunk, std::size_t index,
+                         sensor_msgs::msg::PointCloud2 &msg)
+  {
+    const std::size_t offset = index * chunk.size();
+    if (offset < msg.data.size()) {
+      std::memcpy(msg.data.data() + offset, chunk.data(),
+                  std::min(chunk.size(), msg.data.size() - offset));
+    }
+  }
+
+  // chunks are only ever added; the ones past the end are reused
+  void reserve_chunks(std::size_t count)
+  {
+    while (chunks_.size() < used_chunks(count)) {
+      chunks_.push_back(
+        std::make_shared<Chunk>(kChunkPoints * layout_.point_step()));
+      dirty_.push_back(false);
+    }
+  }
+
+  // the point at `index`, copying its chunk first if a snapshot shares it
+  uint8_t *mutable_point(std::size_t index)
+  {
+    std::size_t c = index / kChunkPoints;
+    std::shared_ptr<Chunk> &chunk = chunks_[c];
+    if (chunk.use_count() > 1) {
+      chunk = std::make_shared<Chunk>(*chunk);
+    }
+    if (!dirty_[c]) {
+      dirty_[c] = true;
+      dirty_chunks_.push_back(c);
+    }
+    return chunk->data() + index % kChunkPoints * layout_.point_step();
+  }
+
+  const uint8_t *point(std::size_t index) const
+  {
+    return chunks_[index / kChunkPoints]->data() +
+           index % kChunkPoints * layout_.point_step();
+  }
+
+  void write(std::size_t index, const MapPointDelta &delta)
+  {
+    layout_.write(mutable_point(index), delta.position.x(),
+                  delta.position.y(), delta.position.z(), delta.observations,
+                  delta.keyframe);
+  }
+
+  void remove(uint64_t id)
+  {
+    auto it = index_.find(id);
+    if (it == index_.end()) {
+      return;
+    }
+    // move the last point into the hole so the cloud stays dense
+    std::size_t index = it->second;
+    std::size_t last = ids_.size() - 1;
+    index_.erase(it);
+    if (index != last) {
+      std::memcpy(mutable_point(index), point(last), layout_.point_step());
+      ids_[index] = ids_[last];
+      index_[ids_[index]] = index;
+    }
+    ids_.pop_back();
+  }
+
+  PointCloud2Layout layout_;
+  // every chunk ever used, only the first used_chunks(size()) hold points
+  std::vector<std::shared_ptr<Chunk>> chunks_;
+  // chunks written since msg() last copied them
+  std::vector<bool> dirty_;
+  std::vector<std::size_t> dirty_chunks_;
+  std::vector<uint64_t> ids_;
+  std::unordered_map<uint64_t, std::size_t> index_;
+  sensor_msgs::msg::PointCloud2 msg_;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__LIVE_MAP_CLOUD_HPP_
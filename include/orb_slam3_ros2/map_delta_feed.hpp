@@ -0,0 +1,179 @@
+#ifndef ORB_SLAM3_ROS2__MAP_DELTA_FEED_HPP_
+#define ORB_SLAM3_ROS2__MAP_DELTA_FEED_HPP_
+
+#include <Eigen/Core>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+struct MapPointDelta {
+  // Updated means only observations or keyframe changed
+  enum class Type : uint8_t { Added, Moved, Updated, Removed };
+
+  Type type;
+  uint64_t id;
+  Eigen::Vector3f position; // current position, last known one if Removed
+  Eigen::Vector3f previous; // position before the change, Moved only
+  Eigen::Vector3f observer; // camera centre when the change was seen
+  uint32_t observations;    // number of keyframes observing the point
+  uint64_t keyframe;        // id of the point's reference keyframe
+};
+
+// Monotonically versioned change log of map points. The tracking thread
+// records points as they are added, moved by bundle adjustment or loop
+// closure, or culled; consumers remember the version they last saw and pull
+// only what changed after it. A consumer that falls further behind than the
+// log keeps, or that saw the map before clear(), rebuilds from snapshot().
+class MapDeltaFeed {
+public:
+  explicit MapDeltaFeed(std::size_t max_log_size = 1 << 20,
+                        float move_threshold = 0.01f)
+    : max_log_size_(max_log_size), move_threshold_(move_threshold)
+  {
+  }
+
+  // Updated deltas are only logged when some consumer reads observations
+  // or keyframes; otherwise most tracked frames would log one per point.
+  // Set before the first change is recorded.
+  void set_track_metadata(bool track_metadata)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    track_metadata_ = track_metadata;
+  }
+
+  // Records a new point, a move if it is further than the move threshold
+  // from where it was last recorded, or an update if only its observations
+  // or reference keyframe changed and metadata is tracked.
+  void add_or_move(uint64_t id, const Eigen::Vector3f &position,
+                   const Eigen::Vector3f &observer, uint32_t observations,
+                   uint64_t keyframe)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = points_.find(id);
+    if (it == points_.end()) {
+      points_.emplace(id, Entry{position, observations, keyframe});
+      append({MapPointDelta::Type::Added, id, position, position, observer,
+              observations, keyframe});
+      return;
+    }
+
+    Entry &entry = it->second;
+    if ((entry.position - position).norm() > move_threshold_) {
+      append({MapPointDelta::Type::Moved, id, position, entry.position,
+              observer, observations, keyframe});
+      entry = Entry{position, observations, keyframe};
+    } else if (track_metadata_ && (entry.observations != observations ||
+                                   entry.keyframe != keyframe)) {
+      append({MapPointDelta::Type::Updated, id, entry.position,
+              entry.position, observer, observations, keyframe});
+      entry.observations = observations;
+      entry.keyframe = keyframe;
+    }
+  }
+
+  void remove(uint64_t id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = points_.find(id);
+    if (it == points_.end()) {
+      return;
+    }
+    const Entry &entry = it->second;
+    append({MapPointDelta::Type::Removed, id, entry.position, entry.position,
+            entry.position, entry.observations, entry.keyframe});
+    points_.erase(it);
+  }
+
+  // The map was reset; every consumer has to start over.
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    points_.clear();
+    log_.clear();
+    version_++;
+    first_version_ = version_ + 1;
+  }
+
+  uint64_t version() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return version_;
+  }
+
+  std::size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return points_.size();
+  }
+
+  // Appends every change after `since` to `out` and sets `version` to the
+  // version they bring the consumer up to. Returns false if those changes are
+  // no longer available; the consumer must then rebuild from snapshot().
+  bool changes_since(uint64_t since, std::vector<MapPointDelta> &out,
+                     uint64_t &version) const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (since >= version_) {
+      version = version_;
+      return true;
+    }
+    if (since + 1 < first_version_) {
+      return false;
+    }
+    out.insert(out.end(), log_.begin() + (since + 1 - first_version_),
+               log_.end());
+    version = version_;
+    return true;
+  }
+
+  // Every current point as an Added delta, plus the version the snapshot
+  // corresponds to.
+  uint64_t snapshot(std::vector<MapPointDelta> &out) const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out.clear();
+    out.reserve(points_.size());
+    for (const auto &[id, entry] : points_) {
+      out.push_back({MapPointDelta::Type::Added, id, entry.position,
+                     entry.position, entry.position, entry.observations,
+                     entry.keyframe});
+    }
+    return version_;
+  }
+
+private:
+  struct Entry {
+    Eigen::Vector3f position;
+    uint32_t observations;
+    uint64_t keyframe;
+  };
+
+  void append(const MapPointDelta &delta)
+  {
+    log_.push_back(delta);
+    version_++;
+    while (log_.size() > max_log_size_) {
+      log_.pop_front();
+      first_version_++;
+    }
+  }
+
+  std::size_t max_log_size_;
+  float move_threshold_;
+  bool track_metadata_ = false;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, Entry> points_;
+  std::deque<MapPointDelta> log_;
+  uint64_t version_ = 0;
+  uint64_t first_version_ = 1; // version of log_.front()
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__MAP_DELTA_FEED_HPP_
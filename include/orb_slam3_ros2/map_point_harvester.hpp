@@ -0,0 +1,220 @@
+#ifndef ORB_SLAM3_ROS2__MAP_POINT_HARVESTER_HPP_
+#define ORB_SLAM3_ROS2__MAP_POINT_HARVESTER_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "KeyFrame.h"
+#include "Map.h"
+#include "MapPoint.h"
+#include "System.h"
+#include "Tracking.h"
+
+#include "orb_slam3_ros2/map_delta_feed.hpp"
+
+namespace orb_slam3_ros2 {
+
+// Records map point changes into a MapDeltaFeed without copying the map.
+// After every frame it looks at the points tracked in that frame. It also
+// sweeps the active map, a bounded number of points per frame, which picks
+// up points local mapping triangulated but that were never tracked again,
+// and local BA moves of points out of view. A sweep starts every
+// `sweep_period` frames, and over again after a loop closure, merge or
+// inertial BA (System::MapChanged). Points culled from the map are found
+// the same way, by checking a bounded number of the recorded points per
+// frame.
+//
+// Between sweeps the feed is an approximation of the map, good enough for
+// the live cloud and grid. full_read() reconciles the whole map at once, for
+// when the feed has to match it, such as before saving the map.
+//
+// Must be called from the thread that calls Track*, right after it
+// returns, and must be the only caller of System::MapChanged in the
+// process. Like the rest of this package it relies on orbslam3 never
+// freeing maps or map points while it runs.
+class MapPointHarvester {
+public:
+  explicit MapPointHarvester(MapDeltaFeed &feed,
+                             unsigned int sweep_period = 30,
+                             std::size_t points_per_frame = 1000)
+    : feed_(feed), sweep_period_(sweep_period),
+      points_per_frame_(std::max<std::size_t>(1, points_per_frame))
+  {
+  }
+
+  void harvest(ORB_SLAM3::System &system, const Sophus::SE3f &Tcw)
+  {
+    int state = system.GetTrackingState();
+    if (state == ORB_SLAM3::Tracking::NO_IMAGES_YET ||
+        state == ORB_SLAM3::Tracking::NOT_INITIALIZED) {
+      // Tracking starts over either in a new map, and the old one is kept
+      // in the atlas, or in the old map after it has been emptied. Only in
+      // the latter case are its points gone.
+      if (active_map_ && active_map_->MapPointsInMap() == 0) {
+        forget(active_map_id_);
+      }
+      active_map_ = nullptr;
+      sweep_.clear();
+      sweep_next_ = 0;
+      return;
+    }
+
+    observer_ = Tcw.inverse().translation();
+    std::vector<ORB_SLAM3::MapPoint *> points = system.GetTrackedMapPoints();
+    for (ORB_SLAM3::MapPoint *point : points) {
+      if (!point) {
+        continue;
+      }
+      ORB_SLAM3::Map *map = point->GetMap();
+      if (record(point, map ? map->GetId() : 0) && map &&
+          map != active_map_) {
+        active_map_ = map;
+        active_map_id_ = map->GetId();
+        // sweep the new map right away
+        sweep_.clear();
+        sweep_next_ = 0;
+        frames_since_sweep_ = sweep_period_;
+      }
+    }
+
+    // a loop closure or merge may have moved every point, so the sweep
+    // starts over
+    bool changed = system.MapChanged();
+    ++frames_since_sweep_;
+    if (active_map_ &&
+        (changed || (sweep_next_ == sweep_.size() &&
+                     frames_since_sweep_ >= sweep_period_))) {
+      start_sweep();
+    }
+    continue_sweep(points_per_frame_);
+    check_culled(points_per_frame_);
+  }
+
+  // Reconciles the feed with the whole active map. Takes time in the size
+  // of the map, so it is meant for when tracking has stopped.
+  void full_read()
+  {
+    if (active_map_) {
+      start_sweep();
+      continue_sweep(sweep_.size());
+    }
+    for (std::size_t i = 0; i < known_.size();) {
+      if (known_[i].point->isBad()) {
+        drop(known_[i].point->mnId);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+private:
+  struct Known {
+    ORB_SLAM3::MapPoint *point;
+    unsigned long map;
+  };
+
+  void start_sweep()
+  {
+    frames_since_sweep_ = 0;
+    sweep_ = active_map_->GetAllMapPoints();
+    sweep_next_ = 0;
+  }
+
+  // re-reads up to `count` points of the current sweep
+  void continue_sweep(std::size_t count)
+  {
+    std::size_t end = std::min(sweep_.size(), sweep_next_ + count);
+    for (; sweep_next_ < end; ++sweep_next_) {
+      if (sweep_[sweep_next_]) {
+        record(sweep_[sweep_next_], active_map_id_);
+      }
+    }
+  }
+
+  // Checks up to `count` recorded points, round robin, for having been
+  // erased from their map; erased points are bad by then.
+  void check_culled(std::size_t count)
+  {
+    for (std::size_t i = 0; i < count && !known_.empty(); ++i) {
+      if (known_next_ >= known_.size()) {
+        known_next_ = 0;
+      }
+      ORB_SLAM3::MapPoint *point = known_[known_next_].point;
+      if (point->isBad()) {
+        drop(point->mnId);
+      } else {
+        ++known_next_;
+      }
+    }
+  }
+
+  // the points of a map that was emptied
+  void forget(unsigned long map)
+  {
+    for (std::size_t i = 0; i < known_.size();) {
+      if (known_[i].map == map) {
+        drop(known_[i].point->mnId);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  // returns false if the point has been culled
+  bool record(ORB_SLAM3::MapPoint *point, unsigned long map)
+  {
+    if (point->isBad()) {
+      drop(point->mnId);
+      return false;
+    }
+    ORB_SLAM3::KeyFrame *keyframe = point->GetReferenceKeyFrame();
+    feed_.add_or_move(point->mnId, point->GetWorldPos(), observer_,
+                      point->Observations(), keyframe ? keyframe->mnId : 0);
+    auto [it, added] = slots_.try_emplace(point->mnId, known_.size());
+    if (added) {
+      known_.push_back(Known{point, map});
+    } else {
+      known_[it->second].map = map;
+    }
+    return true;
+  }
+
+  // Removes a point from the feed, and from known_ by moving the last one
+  // into its slot.
+  void drop(uint64_t id)
+  {
+    feed_.remove(id);
+    auto it = slots_.find(id);
+    if (it == slots_.end()) {
+      return;
+    }
+    std::size_t slot = it->second;
+    slots_.erase(it);
+    if (slot + 1 != known_.size()) {
+      known_[slot] = known_.back();
+      slots_[known_[slot].point->mnId] = slot;
+    }
+    known_.pop_back();
+  }
+
+  MapDeltaFeed &feed_;
+  unsigned int sweep_period_;
+  std::size_t points_per_frame_;
+  unsigned int frames_since_sweep_ = 0;
+  Eigen::Vector3f observer_ = Eigen::Vector3f::Zero();
+  // every recorded point, and its index in known_ by id
+  std::vector<Known> known_;
+  std::unordered_map<uint64_t, std::size_t> slots_;
+  std::size_t known_next_ = 0;
+  // the active map's points as of the start of the sweep
+  std::vector<ORB_SLAM3::MapPoint *> sweep_;
+  std::size_t sweep_next_ = 0;
+  ORB_SLAM3::Map *active_map_ = nullptr;
+  unsigned long active_map_id_ = 0;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__MAP_POINT_HARVESTER_HPP_
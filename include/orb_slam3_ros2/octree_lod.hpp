@@ -0,0 +1,449 @@
+#ifndef ORB_SLAM3_ROS2__OCTREE_LOD_HPP_
+#define ORB_SLAM3_ROS2__OCTREE_LOD_HPP_
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+// Level-of-detail hierarchy over a static point cloud. The points are
+// reordered so every octree node covers one contiguous range, and every
+// inner node keeps a spatially even sample of its points (one per cell of a
+// sample_grid^3 grid over the node). collect() refines the tree level by
+// level for as long as the result still fits a point budget, so the same
+// structure serves both a coarse overview and full-resolution detail for a
+// small region.
+//
+// The hierarchy can be saved as a binary map: a header, the node table (the
+// spatial index, one entry per chunk with its bounds and point ranges), the
+// samples and the reordered points, each section page aligned. map() opens
+// such a file with mmap instead of reading it, so startup does no parsing and
+// only the pages of the chunks that collect() actually visits become
+// resident.
+class OctreeLod {
+public:
+  explicit OctreeLod(std::size_t leaf_points = 4096, int sample_grid = 16,
+                     int max_depth = 20)
+    : leaf_points_(leaf_points), sample_grid_(sample_grid),
+      max_depth_(max_depth)
+  {
+  }
+
+  OctreeLod(OctreeLod &&) = default;
+  OctreeLod &operator=(OctreeLod &&) = default;
+  OctreeLod(const OctreeLod &) = delete;
+  OctreeLod &operator=(const OctreeLod &) = delete;
+
+  void build(std::vector<Eigen::Vector3f> points)
+  {
+    mapping_.reset();
+    points_ = std::move(points);
+    nodes_.clear();
+    samples_.clear();
+    if (points_.empty()) {
+      set_views();
+      return;
+    }
+
+    Eigen::AlignedBox3f box;
+    for (const Eigen::Vector3f &point : points_) {
+      box.extend(point);
+    }
+    // cubic cells keep the octants of every node cubic as well
+    Eigen::Vector3f half =
+      Eigen::Vector3f::Constant(box.sizes().maxCoeff() * 0.5f + 1e-3f);
+    box = Eigen::AlignedBox3f(box.center() - half, box.center() + half);
+
+    scratch_.resize(points_.size());
+    build_node(box, 0, points_.size(), 0);
+    scratch_.clear();
+    scratch_.shrink_to_fit();
+    set_views();
+  }
+
+  // Writes the hierarchy as a binary map. The file is written next to `path`
+  // and renamed into place, so a reader never sees a partial map.
+  bool save(const std::string &path) const
+  {
+    Header header = make_header(node_count_, sample_count_, point_count_);
+    std::string tmp_path = path + ".tmp";
+    std::FILE *file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+      return false;
+    }
+    bool ok = write_section(file, 0, &header, sizeof(header)) &&
+              write_section(file, header.nodes_offset, node_data_,
+                            node_count_ * sizeof(Node)) &&
+              write_section(file, header.samples_offset, sample_data_,
+                            sample_count_ * sizeof(Eigen::Vector3f)) &&
+              write_section(file, header.points_offset, point_data_,
+                            point_count_ * sizeof(Eigen::Vector3f));
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // Maps a file written by save(). Only the header and the node table are
+  // read up front, to check that every range and child in the table stays
+  // inside the file; the kernel pages samples and points in as collect()
+  // touches them.
+  bool map(const std::string &path)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+      ::close(fd);
+      return false;
+    }
+    std::size_t length = st.st_size;
+    void *data = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    std::shared_ptr<void> mapping(
+      data, [length](void *address) { ::munmap(address, length); });
+
+    Header header;
+    std::memcpy(&header, data, sizeof(header));
+    // bounds the counts before they are multiplied into offsets
+    if (header.node_count > length / sizeof(Node) ||
+        header.sample_count > length / sizeof(Eigen::Vector3f) ||
+        header.point_count > length / sizeof(Eigen::Vector3f)) {
+      return false;
+    }
+    Header expected = make_header(header.node_count, header.sample_count,
+                                  header.point_count);
+    if (std::memcmp(&header, &expected, sizeof(header)) != 0 ||
+        header.points_offset +
+            header.point_count * sizeof(Eigen::Vector3f) > length) {
+      return false;
+    }
+    // the node table is walked on every query, the points are read sparsely
+    const uint8_t *base = static_cast<const uint8_t *>(data);
+    ::madvise(data, header.samples_offset, MADV_WILLNEED);
+    ::madvise(const_cast<uint8_t *>(base) + header.samples_offset,
+              length - header.samples_offset, MADV_RANDOM);
+    const Node *nodes =
+      reinterpret_cast<const Node *>(base + header.nodes_offset);
+    if (!valid_nodes(nodes, header.node_count, header.sample_count,
+                     header.point_count)) {
+      return false;
+    }
+
+    points_.clear();
+    samples_.clear();
+    nodes_.clear();
+    mapping_ = std::move(mapping);
+    node_data_ = nodes;
+    sample_data_ =
+      reinterpret_cast<const Eigen::Vector3f *>(base + header.samples_offset);
+    point_data_ =
+      reinterpret_cast<const Eigen::Vector3f *>(base + header.points_offset);
+    node_count_ = header.node_count;
+    sample_count_ = header.sample_count;
+    point_count_ = header.point_count;
+    return true;
+  }
+
+  bool mapped() const { return mapping_ != nullptr; }
+  std::size_t size() const { return point_count_; }
+  std::size_t node_count() const { return node_count_; }
+
+  // Appends the finest representation of the cloud (or of the part inside
+  // `roi`, if given) that has at most max_points points.
+  void collect(std::vector<Eigen::Vector3f> &out, std::size_t max_points,
+               const Eigen::AlignedBox3f *roi = nullptr) const
+  {
+    if (node_count_ == 0 || (roi && !roi->intersects(node_data_[0].box()))) {
+      return;
+    }
+
+    // breadth first, so the budget is spent evenly over the cloud; a node
+    // that does not fit its children stays on the frontier as its sample
+    std::vector<uint32_t> frontier = {0};
+    std::vector<uint32_t> next;
+    std::size_t cost = points_in(node_data_[0]);
+    bool refined = true;
+    while (refined) {
+      refined = false;
+      next.clear();
+      for (uint32_t index : frontier) {
+        const Node &node = node_data_[index];
+        std::size_t children_cost = 0;
+        if (!node.leaf()) {
+          for (int32_t child : node.children) {
+            if (child >= 0 &&
+                (!roi || roi->intersects(node_data_[child].box()))) {
+              children_cost += points_in(node_data_[child]);
+            }
+          }
+        }
+        if (node.leaf() || cost - points_in(node) + children_cost >
+                             max_points) {
+          next.push_back(index);
+          continue;
+        }
+        cost = cost - points_in(node) + children_cost;
+        for (int32_t child : node.children) {
+          if (child >= 0 &&
+              (!roi || roi->intersects(node_data_[child].box()))) {
+            next.push_back(child);
+          }
+        }
+        refined = true;
+      }
+      frontier.swap(next);
+    }
+
+    for (uint32_t index : frontier) {
+      const Node &node = node_data_[index];
+      const Eigen::Vector3f *begin = node.leaf()
+                                       ? point_data_ + node.begin
+                                       : sample_data_ + node.sample_begin;
+      const Eigen::Vector3f *end = node.leaf()
+                                     ? point_data_ + node.end
+                                     : sample_data_ + node.sample_end;
+      for (const Eigen::Vector3f *point = begin; point != end; point++) {
+        if (!roi || roi->contains(*point)) {
+          out.push_back(*point);
+        }
+      }
+    }
+  }
+
+private:
+  struct Node {
+    float min[3], max[3];
+    uint32_t begin, end;               // range in points_
+    uint32_t sample_begin, sample_end; // range in samples_, inner nodes only
+    std::array<int32_t, 8> children;
+
+    bool leaf() const { return children[0] == -2; }
+    Eigen::AlignedBox3f box() const
+    {
+      return Eigen::AlignedBox3f(Eigen::Vector3f::Map(min),
+                                 Eigen::Vector3f::Map(max));
+    }
+  };
+  static_assert(std::is_trivially_copyable<Node>::value &&
+                  sizeof(Node) == 72,
+                "Node is stored verbatim in the binary map");
+  static_assert(sizeof(Eigen::Vector3f) == 12,
+                "points are stored verbatim in the binary map");
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    uint64_t node_count, sample_count, point_count;
+    uint64_t nodes_offset, samples_offset, points_offset;
+  };
+
+  static constexpr uint64_t kPage = 4096;
+
+  static uint64_t page_align(uint64_t offset)
+  {
+    return (offset + kPage - 1) / kPage * kPage;
+  }
+
+  static Header make_header(uint64_t nodes, uint64_t samples, uint64_t points)
+  {
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "ORBLOD01", sizeof(header.magic));
+    header.version = 1;
+    header.node_size = sizeof(Node);
+    header.node_count = nodes;
+    header.sample_count = samples;
+    header.point_count = points;
+    header.nodes_offset = page_align(sizeof(Header));
+    header.samples_offset =
+      page_align(header.nodes_offset + nodes * sizeof(Node));
+    header.points_offset = page_align(header.samples_offset +
+                                      samples * sizeof(Eigen::Vector3f));
+    return header;
+  }
+
+  static bool write_section(std::FILE *file, uint64_t offset, const void *data,
+                            std::size_t size)
+  {
+    if (std::fseek(file, offset, SEEK_SET) != 0) {
+      return false;
+    }
+    return size == 0 || std::fwrite(data, 1, size, file) == size;
+  }
+
+  // Children always come after their parent in the table, which also keeps
+  // collect() from looping on a corrupt file.
+  static bool valid_nodes(const Node *nodes, uint64_t node_count,
+                          uint64_t sample_count, uint64_t point_count)
+  {
+    for (uint64_t i = 0; i < node_count; i++) {
+      const Node &node = nodes[i];
+      if (node.begin > node.end || node.end > point_count) {
+        return false;
+      }
+      if (node.leaf()) {
+        continue;
+      }
+      if (node.sample_begin > node.sample_end ||
+          node.sample_end > sample_count) {
+        return false;
+      }
+      for (int32_t child : node.children) {
+        if (child != -1 &&
+            (child <= static_cast<int64_t>(i) ||
+             static_cast<uint64_t>(child) >= node_count)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  void set_views()
+  {
+    node_data_ = nodes_.data();
+    sample_data_ = samples_.data();
+    point_data_ = points_.data();
+    node_count_ = nodes_.size();
+    sample_count_ = samples_.size();
+    point_count_ = points_.size();
+  }
+
+  // how many points the node contributes when it is on the frontier
+  std::size_t points_in(const Node &node) const
+  {
+    return node.leaf() ? node.end - node.begin
+                       : node.sample_end - node.sample_begin;
+  }
+
+  uint32_t build_node(const Eigen::AlignedBox3f &box, std::size_t begin,
+                      std::size_t end, int depth)
+  {
+    uint32_t index = nodes_.size();
+    Node node{};
+    Eigen::Vector3f::Map(node.min) = box.min();
+    Eigen::Vector3f::Map(node.max) = box.max();
+    node.begin = begin;
+    node.end = end;
+    node.children.fill(-1);
+    nodes_.push_back(node);
+
+    if (end - begin <= leaf_points_ || depth >= max_depth_) {
+      nodes_[index].children[0] = -2;
+      return index;
+    }
+
+    sample(index);
+
+    // counting sort of the range by octant
+    const Eigen::Vector3f center = box.center();
+    std::array<std::size_t, 9> offsets{};
+    for (std::size_t i = begin; i < end; i++) {
+      offsets[octant(points_[i], center) + 1]++;
+    }
+    offsets[0] = begin;
+    for (int o = 1; o < 9; o++) {
+      offsets[o] += offsets[o - 1];
+    }
+    std::array<std::size_t, 8> cursor;
+    std::copy(offsets.begin(), offsets.begin() + 8, cursor.begin());
+    for (std::size_t i = begin; i < end; i++) {
+      scratch_[cursor[octant(points_[i], center)]++] = points_[i];
+    }
+    std::copy(scratch_.begin() + begin, scratch_.begin() + end,
+              points_.begin() + begin);
+
+    for (int o = 0; o < 8; o++) {
+      if (offsets[o + 1] == offsets[o]) {
+        continue;
+      }
+      Eigen::Vector3f min = box.min(), max = center;
+      for (int axis = 0; axis < 3; axis++) {
+        if (o & (1 << axis)) {
+          min[axis] = center[axis];
+          max[axis] = box.max()[axis];
+        }
+      }
+      uint32_t child = build_node(Eigen::AlignedBox3f(min, max), offsets[o],
+                                  offsets[o + 1], depth + 1);
+      nodes_[index].children[o] = child;
+    }
+    return index;
+  }
+
+  // keeps the first point that falls into each cell of the node's grid
+  void sample(uint32_t index)
+  {
+    Node &node = nodes_[index];
+    node.sample_begin = samples_.size();
+    const Eigen::Vector3f min = node.box().min();
+    const float scale = sample_grid_ / node.box().sizes().maxCoeff();
+    std::unordered_set<uint32_t> taken;
+    for (uint32_t i = node.begin; i < node.end; i++) {
+      Eigen::Vector3f cell = (points_[i] - min) * scale;
+      uint32_t x = std::min<int>(cell.x(), sample_grid_ - 1);
+      uint32_t y = std::min<int>(cell.y(), sample_grid_ - 1);
+      uint32_t z = std::min<int>(cell.z(), sample_grid_ - 1);
+      if (taken.insert((x * sample_grid_ + y) * sample_grid_ + z).second) {
+        samples_.push_back(points_[i]);
+      }
+    }
+    node.sample_end = samples_.size();
+  }
+
+  static int octant(const Eigen::Vector3f &point,
+                    const Eigen::Vector3f &center)
+  {
+    return (point.x() >= center.x()) | ((point.y() >= center.y()) << 1) |
+           ((point.z() >= center.z()) << 2);
+  }
+
+  std::size_t leaf_points_;
+  int sample_grid_;
+  int max_depth_;
+
+  // owned storage after build(), empty after map()
+  std::vector<Eigen::Vector3f> points_;
+  std::vector<Eigen::Vector3f> samples_;
+  std::vector<Eigen::Vector3f> scratch_;
+  std::vector<Node> nodes_;
+  std::shared_ptr<void> mapping_;
+
+  // what collect() reads, pointing into either of the above
+  const Node *node_data_ = nullptr;
+  const Eigen::Vector3f *sample_data_ = nullptr;
+  const Eigen::Vector3f *point_data_ = nullptr;
+  std::size_t node_count_ = 0;
+  std::size_t sample_count_ = 0;
+  std::size_t point_count_ = 0;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__OCTREE_LOD_HPP_
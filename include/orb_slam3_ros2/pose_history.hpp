@@ -0,0 +1,93 @@
+#ifndef ORB_SLAM3_ROS2__POSE_HISTORY_HPP_
+#define ORB_SLAM3_ROS2__POSE_HISTORY_HPP_
+
+#include <Eigen/Core>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+struct StampedPose {
+  double stamp;
+  Eigen::Matrix4f Twc;
+};
+
+// Camera trajectory kept in memory in fixed-size chunks. Full chunks are
+// never written again and are shared with every snapshot, so taking one
+// copies a pointer per chunk plus the partly filled last chunk, no matter
+// how long the trajectory has grown.
+class PoseHistory {
+public:
+  using Chunk = std::vector<StampedPose>;
+
+  struct Snapshot {
+    std::vector<std::shared_ptr<const Chunk>> chunks;
+
+    std::size_t size() const
+    {
+      std::size_t count = 0;
+      for (const auto &chunk : chunks) {
+        count += chunk->size();
+      }
+      return count;
+    }
+
+    template <typename F>
+    void for_each(F &&f) const
+    {
+      for (const auto &chunk : chunks) {
+        for (const StampedPose &pose : *chunk) {
+          f(pose);
+        }
+      }
+    }
+  };
+
+  explicit PoseHistory(std::size_t chunk_size = 1024)
+    : chunk_size_(chunk_size)
+  {
+    current_.reserve(chunk_size_);
+  }
+
+  void append(double stamp, const Eigen::Matrix4f &Twc)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    current_.push_back(StampedPose{stamp, Twc});
+    if (current_.size() == chunk_size_) {
+      full_.push_back(std::make_shared<const Chunk>(std::move(current_)));
+      current_ = Chunk();
+      current_.reserve(chunk_size_);
+    }
+  }
+
+  Snapshot snapshot() const
+  {
+    Snapshot snapshot;
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshot.chunks.reserve(full_.size() + 1);
+    snapshot.chunks = full_;
+    if (!current_.empty()) {
+      snapshot.chunks.push_back(std::make_shared<const Chunk>(current_));
+    }
+    return snapshot;
+  }
+
+  std::size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return full_.size() * chunk_size_ + current_.size();
+  }
+
+private:
+  std::size_t chunk_size_;
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<const Chunk>> full_;
+  Chunk current_;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__POSE_HISTORY_HPP_
@@ -0,0 +1,234 @@
+#ifndef ORB_SLAM3_ROS2__QUALITY_CONTROLLER_HPP_
+#define ORB_SLAM3_ROS2__QUALITY_CONTROLLER_HPP_
+
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "orb_slam3_ros2/settings_file.hpp"
+
+namespace orb_slam3_ros2 {
+
+// The ORB_SLAM3 settings that trade tracking cost against accuracy, and
+// the pyramid scale factor the cost depends on, which is never tuned.
+struct QualitySettings {
+  int features = 1250;       // ORBextractor.nFeatures
+  int levels = 8;            // ORBextractor.nLevels
+  float scale = 1.f;         // Camera.imageScale
+  float scale_factor = 1.2f; // ORBextractor.scaleFactor
+
+  bool operator==(const QualitySettings &other) const
+  {
+    return features == other.features && levels == other.levels &&
+           scale == other.scale;
+  }
+
+  // reads the settings from an ORB_SLAM3 settings file, keeping the
+  // defaults for keys it does not have
+  bool load(const std::string &settings_path)
+  {
+    try {
+      cv::FileStorage settings(settings_path, cv::FileStorage::READ);
+      if (!settings.isOpened()) {
+        return false;
+      }
+      if (!settings["ORBextractor.nFeatures"].empty()) {
+        features = static_cast<int>(settings["ORBextractor.nFeatures"]);
+      }
+      if (!settings["ORBextractor.nLevels"].empty()) {
+        levels = static_cast<int>(settings["ORBextractor.nLevels"]);
+      }
+      if (!settings["Camera.imageScale"].empty()) {
+        scale = settings["Camera.imageScale"].real();
+      }
+      if (!settings["ORBextractor.scaleFactor"].empty()) {
+        scale_factor = settings["ORBextractor.scaleFactor"].real();
+      }
+    } catch (const cv::Exception &) {
+      return false;
+    }
+    return true;
+  }
+
+  // copies a settings file with these settings in place of its own
+  bool write(const std::string &settings_path,
+             const std::string &out_path) const
+  {
+    std::ostringstream tuned;
+    tuned << "\n# tuned by orb_slam3_ros2\n"
+          << "ORBextractor.nFeatures: " << features << "\n"
+          << "ORBextractor.nLevels: " << levels << "\n"
+          << "Camera.imageScale: " << scale << "\n";
+    return rewrite_settings(settings_path, out_path,
+                            {"ORBextractor.nFeatures", "ORBextractor.nLevels",
+                             "Camera.imageScale"},
+                            tuned.str());
+  }
+};
+
+// Feedback controller that picks the settings ORB_SLAM3 should run with to
+// hold tracking latency under a deadline. ORB_SLAM3 only reads its settings
+// when it is constructed, so the controller measures the settings that are
+// running and recommends, rather than applies, new ones: the 90th percentile
+// latency of every window of frames is scaled by a rough cost model to
+// predict the latency of other settings. When the prediction misses the
+// deadline, features are cut first, then pyramid levels, then image scale,
+// the order in which they cost accuracy; with clear headroom the steps are
+// undone in reverse.
+class QualityController {
+public:
+  enum class Decision { Hold, Lower, Raise, AtMinimum };
+
+  struct Status {
+    QualitySettings running;
+    QualitySettings recommended;
+    Decision decision = Decision::Hold;
+    double window_p90_ms = 0.0;
+    double predicted_p90_ms = 0.0;
+    uint64_t windows = 0;
+    uint64_t missed_windows = 0;
+  };
+
+  // `running` is also the upper bound of the recommendations
+  QualityController(const QualitySettings &running, const QualitySettings &min,
+                    double deadline_ms, std::size_t window = 30)
+    : max_(running), min_(min), deadline_ms_(deadline_ms),
+      window_(std::max<std::size_t>(1, window))
+  {
+    min_.features = std::max(1, std::min(min_.features, max_.features));
+    min_.levels = std::max(1, std::min(min_.levels, max_.levels));
+    min_.scale = std::min(min_.scale, max_.scale);
+    status_.running = running;
+    status_.recommended = running;
+    latencies_.reserve(window_);
+  }
+
+  // Records the tracking latency of one frame. Returns true when the
+  // recommendation changed.
+  bool add(double latency_ms)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    latencies_.push_back(latency_ms);
+    if (latencies_.size() < window_) {
+      return false;
+    }
+    auto p90 = latencies_.begin() + latencies_.size() * 9 / 10;
+    std::nth_element(latencies_.begin(), p90, latencies_.end());
+    status_.window_p90_ms = *p90;
+    status_.windows++;
+    status_.missed_windows += *p90 > deadline_ms_;
+    latencies_.clear();
+
+    QualitySettings before = status_.recommended;
+    QualitySettings &s = status_.recommended;
+    status_.decision = Decision::Hold;
+    if (predict(s) > deadline_ms_) {
+      while (predict(s) > deadline_ms_ && lower(s)) {
+        status_.decision = Decision::Lower;
+      }
+      if (predict(s) > deadline_ms_) {
+        status_.decision = Decision::AtMinimum;
+      }
+    } else {
+      QualitySettings next = s;
+      while (raise(next) && predict(next) <= deadline_ms_ * kHeadroom) {
+        s = next;
+        status_.decision = Decision::Raise;
+      }
+    }
+    status_.predicted_p90_ms = predict(s);
+    return !(s == before);
+  }
+
+  Status status() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return status_;
+  }
+
+  double deadline_ms() const { return deadline_ms_; }
+
+  // the decisions are recommendations for the next run, never applied
+  static const char *decision_name(Decision decision)
+  {
+    switch (decision) {
+    case Decision::Lower:
+      return "lower next run";
+    case Decision::Raise:
+      return "raise next run";
+    case Decision::AtMinimum:
+      return "at-minimum";
+    default:
+      return "hold";
+    }
+  }
+
+private:
+  // raising stops well short of the deadline so it does not flap
+  static constexpr double kHeadroom = 0.7;
+  static constexpr float kScaleStep = 0.1f;
+
+  // Relative cost of tracking with `s`. Roughly half of a frame goes into
+  // building and scanning the pyramid, which scales with its pixel count,
+  // and half into describing and matching features.
+  static double cost(const QualitySettings &s)
+  {
+    double pixels = 0.0;
+    double level_area = 1.0;
+    for (int level = 0; level < s.levels; level++) {
+      pixels += level_area;
+      level_area /= s.scale_factor * s.scale_factor;
+    }
+    return 0.5 * pixels * s.scale * s.scale + 0.5 * s.features / 1000.0;
+  }
+
+  double predict(const QualitySettings &s) const
+  {
+    return status_.window_p90_ms * cost(s) / cost(status_.running);
+  }
+
+  bool lower(QualitySettings &s) const
+  {
+    if (s.features > min_.features) {
+      s.features = std::max(min_.features, s.features * 4 / 5);
+    } else if (s.levels > min_.levels) {
+      s.levels--;
+    } else if (s.scale > min_.scale) {
+      s.scale = std::max(min_.scale, s.scale - kScaleStep);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  bool raise(QualitySettings &s) const
+  {
+    if (s.scale < max_.scale) {
+      s.scale = std::min(max_.scale, s.scale + kScaleStep);
+    } else if (s.levels < max_.levels) {
+      s.levels++;
+    } else if (s.features < max_.features) {
+      s.features = std::min(max_.features, s.features * 5 / 4);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  QualitySettings max_;
+  QualitySettings min_;
+  double deadline_ms_;
+  std::size_t window_;
+  mutable std::mutex mutex_;
+  std::vector<double> latencies_;
+  Status status_;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__QUALITY_CONTROLLER_HPP_
@@ -0,0 +1,173 @@
+#ifndef ORB_SLAM3_ROS2__RECTIFY_POOL_HPP_
+#define ORB_SLAM3_ROS2__RECTIFY_POOL_HPP_
+
+#include <cv_bridge/cv_bridge.hpp>
+#include <sensor_msgs/msg/image.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "orb_slam3_ros2/camera_model.hpp"
+#include "orb_slam3_ros2/stage_tracer.hpp"
+
+namespace orb_slam3_ros2 {
+
+// Rectifies images on a small pool of threads and hands them to `output` in
+// the order they were submitted, with the original header. Each output is
+// remapped straight into a freshly allocated message that the receiver owns,
+// ready for an intra-process publish without another copy. submit() never
+// blocks: when the queue is full the image is dropped and counted instead.
+// The model must have its lookup tables built and outlive the pool.
+class RectifyPool {
+public:
+  using Image = sensor_msgs::msg::Image;
+  using Output = std::function<void(std::unique_ptr<Image>)>;
+
+  RectifyPool(const CameraModel &model, std::size_t threads,
+              std::size_t queue_size, Output output)
+    : model_(model), queue_size_(queue_size), output_(std::move(output))
+  {
+    for (std::size_t i = 0; i < std::max<std::size_t>(1, threads); i++) {
+      threads_.emplace_back(&RectifyPool::run, this);
+    }
+  }
+
+  ~RectifyPool() { close(); }
+
+  RectifyPool(const RectifyPool &) = delete;
+  RectifyPool &operator=(const RectifyPool &) = delete;
+
+  // times every rectified image as `stage`; set before the first submit()
+  void set_tracer(StageTracer *tracer, std::size_t stage)
+  {
+    tracer_ = tracer;
+    tracer_stage_ = stage;
+  }
+
+  bool submit(Image::ConstSharedPtr image)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_ || jobs_.size() >= queue_size_) {
+        dropped_++;
+        return false;
+      }
+      jobs_.emplace_back(next_submitted_++, std::move(image));
+    }
+    cv_.notify_one();
+    return true;
+  }
+
+  // rectifies everything still queued, then stops the threads
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread &thread : threads_) {
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  }
+
+  uint64_t rectified() const { return rectified_.load(); }
+  uint64_t dropped() const { return dropped_.load(); }
+  uint64_t failed() const { return failed_.load(); }
+
+private:
+  void run()
+  {
+    while (true) {
+      std::pair<uint64_t, Image::ConstSharedPtr> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+          return;
+        }
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+      deliver(job.first, rectify(job.second));
+    }
+  }
+
+  std::unique_ptr<Image> rectify(const Image::ConstSharedPtr &image)
+  {
+    ScopedTrace trace(tracer_, tracer_stage_);
+    try {
+      cv_bridge::CvImageConstPtr src = cv_bridge::toCvShare(image);
+      auto out = std::make_unique<Image>();
+      out->header = image->header;
+      out->encoding = image->encoding;
+      out->width = image->width;
+      out->height = image->height;
+      out->is_bigendian = image->is_bigendian;
+      out->step = image->width * src->image.elemSize();
+      out->data.resize(out->step * out->height);
+      cv::Mat dst(out->height, out->width, src->image.type(), out->data.data(),
+                  out->step);
+      if (model_.rectify(src->image, dst)) {
+        rectified_++;
+        return out;
+      }
+    } catch (const cv_bridge::Exception &) {
+    }
+    failed_++;
+    return nullptr;
+  }
+
+  // Results are released strictly in submission order; a failed image only
+  // releases the ones queued behind it.
+  void deliver(uint64_t sequence, std::unique_ptr<Image> image)
+  {
+    std::lock_guard<std::mutex> lock(deliver_mutex_);
+    done_.emplace(sequence, std::move(image));
+    for (auto it = done_.begin();
+         it != done_.end() && it->first == next_delivered_;
+         it = done_.erase(it)) {
+      if (it->second) {
+        output_(std::move(it->second));
+      }
+      next_delivered_++;
+    }
+  }
+
+  const CameraModel &model_;
+  std::size_t queue_size_;
+  Output output_;
+
+  std::deque<std::pair<uint64_t, Image::ConstSharedPtr>> jobs_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  uint64_t next_submitted_ = 0;
+  StageTracer *tracer_ = nullptr;
+  std::size_t tracer_stage_ = 0;
+
+  std::mutex deliver_mutex_;
+  std::map<uint64_t, std::unique_ptr<Image>> done_;
+  uint64_t next_delivered_ = 0;
+
+  std::atomic<uint64_t> rectified_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> failed_{0};
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__RECTIFY_POOL_HPP_
@@ -0,0 +1,392 @@
+#ifndef ORB_SLAM3_ROS2__SESSION_CHECKPOINT_HPP_
+#define ORB_SLAM3_ROS2__SESSION_CHECKPOINT_HPP_
+
+#include <Eigen/Core>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "orb_slam3_ros2/map_delta_feed.hpp"
+#include "orb_slam3_ros2/pose_history.hpp"
+#include "orb_slam3_ros2/tiled_occupancy_grid.hpp"
+
+namespace orb_slam3_ros2 {
+
+// Append-only journal of a mapping session, so a crash loses at most the
+// last few seconds. Every checkpoint appends what changed since the previous
+// one: map point changes, new poses and the occupancy grid tiles that were
+// written, followed by a commit record. Records carry their size and an
+// FNV-1a checksum of their type, count, size and payload; recovery replays
+// committed checkpoints only, so a checkpoint torn by a crash is dropped as
+// a whole.
+//
+//   header   "ORBCKP01", uint32 version, uint32 tile_size, double resolution
+//   record   uint32 type, uint32 count, uint64 size, uint64 checksum, payload
+//
+// Appends go straight to the file; fdatasync is only issued on commits that
+// ask for it, so durability is batched over several checkpoints.
+class CheckpointWriter {
+public:
+  CheckpointWriter() = default;
+  ~CheckpointWriter() { close(); }
+
+  CheckpointWriter(const CheckpointWriter &) = delete;
+  CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+  bool open(const std::string &path, const TiledOccupancyGridParams &grid)
+  {
+    close();
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      return false;
+    }
+    FileHeader header = make_header(grid);
+    buffer_.clear();
+    committed_size_ = 0;
+    if (!write_all(&header, sizeof(header))) {
+      return false;
+    }
+    committed_size_ = sizeof(header);
+    return true;
+  }
+
+  void close()
+  {
+    if (fd_ >= 0) {
+      ::fdatasync(fd_);
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+
+  // the points recorded so far are void, e.g. after the map was reset
+  void reset_points() { add_record(kResetPoints, 0, nullptr, 0); }
+  void reset_grid() { add_record(kResetGrid, 0, nullptr, 0); }
+
+  void add_points(const std::vector<MapPointDelta> &deltas)
+  {
+    if (deltas.empty()) {
+      return;
+    }
+    std::vector<PointRecord> records;
+    records.reserve(deltas.size());
+    for (const MapPointDelta &delta : deltas) {
+      records.push_back(PointRecord{
+        delta.id, delta.position.x(), delta.position.y(), delta.position.z(),
+        delta.type == MapPointDelta::Type::Removed ? 1u : 0u});
+    }
+    add_record(kPoints, records.size(), records.data(),
+               records.size() * sizeof(PointRecord));
+  }
+
+  // appends the poses of `poses` from index `first` on
+  void add_poses(const PoseHistory::Snapshot &poses, std::size_t first)
+  {
+    std::vector<PoseRecord> records;
+    std::size_t index = 0;
+    poses.for_each([&](const StampedPose &pose) {
+      if (index++ < first) {
+        return;
+      }
+      PoseRecord record;
+      record.stamp = pose.stamp;
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+          record.Twc[i * 4 + j] = pose.Twc(i, j);
+        }
+      }
+      records.push_back(record);
+    });
+    if (!records.empty()) {
+      add_record(kPoses, records.size(), records.data(),
+                 records.size() * sizeof(PoseRecord));
+    }
+  }
+
+  void add_tile(const TiledOccupancyGrid::Tile &tile)
+  {
+    std::vector<uint8_t> payload(sizeof(TileRecord) +
+                                 tile.log_odds.size() * sizeof(float));
+    TileRecord record{tile.x, tile.y};
+    std::memcpy(payload.data(), &record, sizeof(record));
+    std::memcpy(payload.data() + sizeof(record), tile.log_odds.data(),
+                tile.log_odds.size() * sizeof(float));
+    add_record(kTile, 1, payload.data(), payload.size());
+  }
+
+  // Appends everything added since the last commit. With `sync` the data
+  // is on disk when this returns. A failed write is cut off the journal
+  // again and its records are kept, so the next commit retries them.
+  bool commit(bool sync)
+  {
+    add_record(kCommit, 0, nullptr, 0);
+    if (!write_all(buffer_.data(), buffer_.size())) {
+      // a torn tail would hide every later checkpoint from recovery
+      if (::ftruncate(fd_, committed_size_) == 0) {
+        ::lseek(fd_, committed_size_, SEEK_SET);
+      }
+      return false;
+    }
+    committed_size_ += buffer_.size();
+    bytes_written_ += buffer_.size();
+    buffer_.clear();
+    checkpoints_++;
+    return !sync || ::fdatasync(fd_) == 0;
+  }
+
+  uint64_t checkpoints() const { return checkpoints_; }
+  uint64_t bytes_written() const { return bytes_written_; }
+
+private:
+  friend class CheckpointReader;
+
+  enum RecordType : uint32_t {
+    kPoints = 1,
+    kPoses = 2,
+    kTile = 3,
+    kResetPoints = 4,
+    kResetGrid = 5,
+    kCommit = 6,
+  };
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tile_size;
+    double resolution;
+  };
+
+  struct RecordHeader {
+    uint32_t type;
+    uint32_t count;
+    uint64_t size;
+    uint64_t checksum;
+  };
+
+  struct PointRecord {
+    uint64_t id;
+    float x, y, z;
+    uint32_t removed;
+  };
+
+  struct PoseRecord {
+    double stamp;
+    float Twc[12];
+  };
+
+  struct TileRecord {
+    int64_t x;
+    int64_t y;
+  };
+
+  static FileHeader make_header(const TiledOccupancyGridParams &grid)
+  {
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "ORBCKP01", sizeof(header.magic));
+    header.version = 2;
+    header.tile_size = grid.tile_size;
+    header.resolution = grid.resolution;
+    return header;
+  }
+
+  static uint64_t fnv1a(const void *data, std::size_t size, uint64_t hash)
+  {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (std::size_t i = 0; i < size; i++) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // covers the header fields before the checksum, then the payload
+  static uint64_t checksum(const RecordHeader &header, const void *payload)
+  {
+    uint64_t hash = fnv1a(&header, offsetof(RecordHeader, checksum),
+                          14695981039346656037ull);
+    return fnv1a(payload, header.size, hash);
+  }
+
+  void add_record(uint32_t type, std::size_t count, const void *payload,
+                  std::size_t size)
+  {
+    RecordHeader header{type, static_cast<uint32_t>(count), size, 0};
+    header.checksum = checksum(header, payload);
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&header);
+    buffer_.insert(buffer_.end(), bytes, bytes + sizeof(header));
+    bytes = static_cast<const uint8_t *>(payload);
+    buffer_.insert(buffer_.end(), bytes, bytes + size);
+  }
+
+  bool write_all(const void *data, std::size_t size)
+  {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+      ssize_t written = ::write(fd_, bytes, size);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        return false;
+      }
+      bytes += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  int fd_ = -1;
+  std::vector<uint8_t> buffer_;
+  // the journal up to the end of the last commit that was written whole
+  uint64_t committed_size_ = 0;
+  uint64_t checkpoints_ = 0;
+  uint64_t bytes_written_ = 0;
+};
+
+// What a journal holds up to its last complete checkpoint.
+struct CheckpointContents {
+  TiledOccupancyGridParams grid_params;
+  std::unordered_map<uint64_t, Eigen::Vector3f> points;
+  std::vector<StampedPose> poses;
+  // log-odds per tile, keyed by tile x/y
+  std::map<std::pair<int64_t, int64_t>, std::vector<float>> tiles;
+  uint64_t checkpoints = 0;
+  bool torn = false; // an incomplete checkpoint was dropped
+};
+
+class CheckpointReader {
+public:
+  static bool read(const std::string &path, CheckpointContents &out,
+                   std::string &error)
+  {
+    using W = CheckpointWriter;
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+      error = "cannot open " + path;
+      return false;
+    }
+    W::FileHeader header;
+    W::FileHeader expected;
+    bool valid = std::fread(&header, sizeof(header), 1, file) == 1 &&
+                 header.tile_size > 0 && header.resolution > 0.0;
+    if (valid) {
+      TiledOccupancyGridParams params;
+      params.tile_size = header.tile_size;
+      params.resolution = header.resolution;
+      expected = W::make_header(params);
+      valid = std::memcmp(&header, &expected, sizeof(header)) == 0;
+    }
+    if (!valid) {
+      std::fclose(file);
+      error = "not a checkpoint journal: " + path;
+      return false;
+    }
+    out = CheckpointContents();
+    out.grid_params.tile_size = header.tile_size;
+    out.grid_params.resolution = header.resolution;
+    const std::size_t tile_cells =
+      static_cast<std::size_t>(header.tile_size) * header.tile_size;
+
+    // records are staged until their commit record has been read
+    std::vector<std::pair<W::RecordHeader, std::vector<uint8_t>>> pending;
+    W::RecordHeader record;
+    long committed_end = std::ftell(file);
+    while (std::fread(&record, sizeof(record), 1, file) == 1) {
+      if (record.size > (1ull << 32)) {
+        break;
+      }
+      std::vector<uint8_t> payload(record.size);
+      if (std::fread(payload.data(), 1, payload.size(), file) !=
+            payload.size() ||
+          W::checksum(record, payload.data()) != record.checksum) {
+        break;
+      }
+      if (record.type != W::kCommit) {
+        pending.emplace_back(record, std::move(payload));
+        continue;
+      }
+      for (const auto &[staged, data] : pending) {
+        apply(staged, data, tile_cells, out);
+      }
+      pending.clear();
+      out.checkpoints++;
+      committed_end = std::ftell(file);
+    }
+    std::fseek(file, 0, SEEK_END);
+    out.torn = std::ftell(file) != committed_end;
+    std::fclose(file);
+    return true;
+  }
+
+private:
+  static void apply(const CheckpointWriter::RecordHeader &record,
+                    const std::vector<uint8_t> &data, std::size_t tile_cells,
+                    CheckpointContents &out)
+  {
+    using W = CheckpointWriter;
+    switch (record.type) {
+    case W::kPoints:
+      if (data.size() != record.count * sizeof(W::PointRecord)) {
+        break;
+      }
+      for (std::size_t i = 0; i < record.count; i++) {
+        W::PointRecord point;
+        std::memcpy(&point, data.data() + i * sizeof(point), sizeof(point));
+        if (point.removed) {
+          out.points.erase(point.id);
+        } else {
+          out.points[point.id] = Eigen::Vector3f(point.x, point.y, point.z);
+        }
+      }
+      break;
+    case W::kPoses:
+      if (data.size() != record.count * sizeof(W::PoseRecord)) {
+        break;
+      }
+      for (std::size_t i = 0; i < record.count; i++) {
+        W::PoseRecord pose;
+        std::memcpy(&pose, data.data() + i * sizeof(pose), sizeof(pose));
+        StampedPose stamped{pose.stamp, Eigen::Matrix4f::Identity()};
+        for (int r = 0; r < 3; r++) {
+          for (int c = 0; c < 4; c++) {
+            stamped.Twc(r, c) = pose.Twc[r * 4 + c];
+          }
+        }
+        out.poses.push_back(stamped);
+      }
+      break;
+    case W::kTile:
+      if (data.size() == sizeof(W::TileRecord) + tile_cells * sizeof(float)) {
+        W::TileRecord tile;
+        std::memcpy(&tile, data.data(), sizeof(tile));
+        std::vector<float> &cells = out.tiles[{tile.x, tile.y}];
+        cells.resize(tile_cells);
+        std::memcpy(cells.data(), data.data() + sizeof(tile),
+                    tile_cells * sizeof(float));
+      }
+      break;
+    case W::kResetPoints:
+      out.points.clear();
+      break;
+    case W::kResetGrid:
+      out.tiles.clear();
+      break;
+    }
+  }
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__SESSION_CHECKPOINT_HPP_
@@ -0,0 +1,40 @@
+#ifndef ORB_SLAM3_ROS2__SETTINGS_FILE_HPP_
+#define ORB_SLAM3_ROS2__SETTINGS_FILE_HPP_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+// Copies the ORB_SLAM3 settings file `settings_path` to `out_path` without
+// the lines that start with any of `replaced`, then appends `overrides`.
+// ORB_SLAM3 settings are flat "Key.name: value" lines, so dropping a key by
+// prefix removes it entirely and the appended lines take its place.
+inline bool rewrite_settings(const std::string &settings_path,
+                             const std::string &out_path,
+                             const std::vector<std::string> &replaced,
+                             const std::string &overrides)
+{
+  std::ifstream in(settings_path);
+  std::ofstream out(out_path);
+  if (!in || !out) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    bool drop = false;
+    for (const std::string &key : replaced) {
+      drop = drop || line.compare(0, key.size(), key) == 0;
+    }
+    if (!drop) {
+      out << line << "\n";
+    }
+  }
+  out << overrides;
+  return static_cast<bool>(out);
+}
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__SETTINGS_FILE_HPP_
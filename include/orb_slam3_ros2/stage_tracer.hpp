@@ -0,0 +1,290 @@
+#ifndef ORB_SLAM3_ROS2__STAGE_TRACER_HPP_
+#define ORB_SLAM3_ROS2__STAGE_TRACER_HPP_
+
+#include <diagnostic_msgs/msg/diagnostic_status.hpp>
+#include <diagnostic_msgs/msg/key_value.hpp>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+struct LatencySummary {
+  uint64_t count = 0;
+  double mean_ms = 0;
+  double p50_ms = 0;
+  double p90_ms = 0;
+  double p99_ms = 0;
+  double max_ms = 0;
+};
+
+// HDR-style latency histogram: microsecond values fall into 16 linear
+// sub-buckets per power of two, so every reported percentile is within ~6%
+// of the true value from 1 us up to about a day. Recording is a couple of
+// relaxed atomic adds and can happen from any thread.
+class LatencyHistogram {
+public:
+  void record(uint64_t ns)
+  {
+    buckets_[index(ns / 1000)].fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = max_ns_.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns_.compare_exchange_weak(
+                         max, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  // summarises everything recorded since the last call and starts over
+  LatencySummary take_summary()
+  {
+    std::array<uint64_t, kBuckets> counts;
+    LatencySummary summary;
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      counts[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+      summary.count += counts[i];
+    }
+    uint64_t sum_ns = sum_ns_.exchange(0, std::memory_order_relaxed);
+    uint64_t max_ns = max_ns_.exchange(0, std::memory_order_relaxed);
+    if (summary.count == 0) {
+      return summary;
+    }
+
+    summary.mean_ms = sum_ns * 1e-6 / summary.count;
+    summary.max_ms = max_ns * 1e-6;
+    summary.p50_ms = percentile(counts, summary.count, 0.50);
+    summary.p90_ms = percentile(counts, summary.count, 0.90);
+    summary.p99_ms = percentile(counts, summary.count, 0.99);
+    return summary;
+  }
+
+private:
+  static constexpr int kSubBits = 4;
+  static constexpr uint64_t kSub = 1 << kSubBits;
+  static constexpr int kMaxMagnitude = 36;
+  static constexpr std::size_t kBuckets =
+    kSub + (kMaxMagnitude - kSubBits + 1) * kSub;
+
+  static std::size_t index(uint64_t us)
+  {
+    if (us < kSub) {
+      return us;
+    }
+    int magnitude = 63 - __builtin_clzll(us);
+    if (magnitude > kMaxMagnitude) {
+      return kBuckets - 1;
+    }
+    int shift = magnitude - kSubBits;
+    return kSub + shift * kSub + ((us >> shift) - kSub);
+  }
+
+  // highest value that still falls into bucket i, in us
+  static uint64_t upper_bound(std::size_t i)
+  {
+    if (i < kSub) {
+      return i;
+    }
+    std::size_t shift = (i - kSub) / kSub;
+    uint64_t sub = (i - kSub) % kSub + kSub;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  static double percentile(const std::array<uint64_t, kBuckets> &counts,
+                           uint64_t total, double fraction)
+  {
+    uint64_t rank = static_cast<uint64_t>(fraction * total);
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      seen += counts[i];
+      if (seen > rank) {
+        return upper_bound(i) * 1e-3;
+      }
+    }
+    return upper_bound(kBuckets - 1) * 1e-3;
+  }
+
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> sum_ns_{0};
+  std::atomic<uint64_t> max_ns_{0};
+};
+
+// Named pipeline stages timed with ScopedTrace. Stages are registered once
+// up front; while disabled a trace point costs a single relaxed load. When a
+// trace file is open every span is also written as a Chrome trace event, so
+// the file opens directly in chrome://tracing or ui.perfetto.dev.
+class StageTracer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  StageTracer() : epoch_(Clock::now()) {}
+  ~StageTracer() { close_trace(); }
+
+  StageTracer(const StageTracer &) = delete;
+  StageTracer &operator=(const StageTracer &) = delete;
+
+  // not thread safe, register every stage before tracing starts
+  std::size_t add_stage(const std::string &name)
+  {
+    names_.push_back(name);
+    histograms_.push_back(std::make_unique<LatencyHistogram>());
+    return names_.size() - 1;
+  }
+
+  void set_enabled(bool enabled)
+  {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Starts writing spans to `path`. Stops after max_events so a long session
+  // cannot fill the disk.
+  bool open_trace(const std::string &path, uint64_t max_events = 5000000)
+  {
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    trace_ = std::fopen(path.c_str(), "w");
+    if (!trace_) {
+      return false;
+    }
+    std::fputs("[\n", trace_);
+    trace_events_ = 0;
+    max_trace_events_ = max_events;
+    tracing_.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  void close_trace()
+  {
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    tracing_.store(false, std::memory_order_relaxed);
+    if (trace_) {
+      std::fputs("\n]\n", trace_);
+      std::fclose(trace_);
+      trace_ = nullptr;
+    }
+  }
+
+  void record(std::size_t stage, Clock::time_point start,
+              Clock::time_point end)
+  {
+    uint64_t ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+        .count();
+    histograms_[stage]->record(ns);
+    if (!tracing_.load(std::memory_order_relaxed)) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    if (!trace_ || trace_events_ >= max_trace_events_) {
+      return;
+    }
+    double ts =
+      std::chrono::duration<double, std::micro>(start - epoch_).count();
+    std::fprintf(trace_,
+                 "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                 "\"ts\":%.3f,\"dur\":%.3f}",
+                 trace_events_ ? ",\n" : "", names_[stage].c_str(), getpid(),
+                 static_cast<int>(gettid()), ts, ns * 1e-3);
+    trace_events_++;
+  }
+
+  std::size_t stage_count() const { return names_.size(); }
+  const std::string &stage_name(std::size_t stage) const
+  {
+    return names_[stage];
+  }
+
+  LatencySummary take_summary(std::size_t stage)
+  {
+    return histograms_[stage]->take_summary();
+  }
+
+private:
+  std::vector<std::string> names_;
+  std::vector<std::unique_ptr<LatencyHistogram>> histograms_;
+  std::atomic<bool> enabled_{false};
+  Clock::time_point epoch_;
+
+  std::atomic<bool> tracing_{false};
+  std::mutex trace_mutex_;
+  std::FILE *trace_ = nullptr;
+  uint64_t trace_events_ = 0;
+  uint64_t max_trace_events_ = 0;
+};
+
+// Times the enclosing scope as one span of `stage`.
+class ScopedTrace {
+public:
+  ScopedTrace(StageTracer *tracer, std::size_t stage)
+    : tracer_(tracer && tracer->enabled() ? tracer : nullptr), stage_(stage)
+  {
+    if (tracer_) {
+      start_ = StageTracer::Clock::now();
+    }
+  }
+
+  ScopedTrace(StageTracer &tracer, std::size_t stage)
+    : ScopedTrace(&tracer, stage)
+  {
+  }
+
+  ~ScopedTrace()
+  {
+    if (tracer_) {
+      tracer_->record(stage_, start_, StageTracer::Clock::now());
+    }
+  }
+
+  ScopedTrace(const ScopedTrace &) = delete;
+  ScopedTrace &operator=(const ScopedTrace &) = delete;
+
+private:
+  StageTracer *tracer_;
+  std::size_t stage_;
+  StageTracer::Clock::time_point start_;
+};
+
+inline void add_value(diagnostic_msgs::msg::DiagnosticStatus &status,
+                      const std::string &key, const std::string &value)
+{
+  diagnostic_msgs::msg::KeyValue kv;
+  kv.key = key;
+  kv.value = value;
+  status.values.push_back(kv);
+}
+
+// Latency of every stage of `tracer` since the last report, as the
+// "<node>: stage latency" status.
+inline diagnostic_msgs::msg::DiagnosticStatus
+stage_latency_status(StageTracer &tracer, const std::string &node_name)
+{
+  diagnostic_msgs::msg::DiagnosticStatus status;
+  status.name = node_name + ": stage latency";
+  status.hardware_id = "orb_slam3";
+  status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+  status.message = "Latency per stage since the last report";
+
+  for (std::size_t i = 0; i < tracer.stage_count(); i++) {
+    LatencySummary summary = tracer.take_summary(i);
+    const std::string &name = tracer.stage_name(i);
+    add_value(status, name + "_count", std::to_string(summary.count));
+    add_value(status, name + "_mean_ms", std::to_string(summary.mean_ms));
+    add_value(status, name + "_p50_ms", std::to_string(summary.p50_ms));
+    add_value(status, name + "_p90_ms", std::to_string(summary.p90_ms));
+    add_value(status, name + "_p99_ms", std::to_string(summary.p99_ms));
+    add_value(status, name + "_max_ms", std::to_string(summary.max_ms));
+  }
+  return status;
+}
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__STAGE_TRACER_HPP_
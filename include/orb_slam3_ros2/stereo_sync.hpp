@@ -0,0 +1,82 @@
+#ifndef ORB_SLAM3_ROS2__STEREO_SYNC_HPP_
+#define ORB_SLAM3_ROS2__STEREO_SYNC_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <utility>
+
+namespace orb_slam3_ros2 {
+
+// Pairs the left and right images of a stereo camera by timestamp. Frames
+// are only moved, never copied, so T is typically a shared message pointer.
+// Both streams are expected in stamp order: a waiting frame that is older
+// than the newest frame from the other side can no longer be matched and is
+// dropped. Not thread safe, feed it from a single callback group.
+template <typename T>
+class StereoSync {
+public:
+  using Emit = std::function<void(T left, T right)>;
+
+  StereoSync(double tolerance, std::size_t depth, Emit emit)
+    : tolerance_(tolerance), depth_(depth), emit_(std::move(emit))
+  {
+  }
+
+  void add_left(double stamp, T frame)
+  {
+    add(left_, right_, stamp, std::move(frame), true);
+  }
+
+  void add_right(double stamp, T frame)
+  {
+    add(right_, left_, stamp, std::move(frame), false);
+  }
+
+  uint64_t paired() const { return paired_; }
+  uint64_t unmatched() const { return unmatched_; }
+
+private:
+  struct Entry {
+    double stamp;
+    T frame;
+  };
+
+  void add(std::deque<Entry> &mine, std::deque<Entry> &other, double stamp,
+           T frame, bool left)
+  {
+    while (!other.empty() && other.front().stamp < stamp - tolerance_) {
+      other.pop_front();
+      unmatched_++;
+    }
+    if (!other.empty() && std::abs(other.front().stamp - stamp) <= tolerance_) {
+      T match = std::move(other.front().frame);
+      other.pop_front();
+      paired_++;
+      if (left) {
+        emit_(std::move(frame), std::move(match));
+      } else {
+        emit_(std::move(match), std::move(frame));
+      }
+      return;
+    }
+    mine.push_back(Entry{stamp, std::move(frame)});
+    if (mine.size() > depth_) {
+      mine.pop_front();
+      unmatched_++;
+    }
+  }
+
+  double tolerance_;
+  std::size_t depth_;
+  Emit emit_;
+  std::deque<Entry> left_;
+  std::deque<Entry> right_;
+  uint64_t paired_ = 0;
+  uint64_t unmatched_ = 0;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__STEREO_SYNC_HPP_
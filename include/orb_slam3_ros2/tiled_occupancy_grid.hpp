@@ -0,0 +1,290 @@
+#ifndef ORB_SLAM3_ROS2__TILED_OCCUPANCY_GRID_HPP_
+#define ORB_SLAM3_ROS2__TILED_OCCUPANCY_GRID_HPP_
+
+#include <nav_msgs/msg/occupancy_grid.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+struct TiledOccupancyGridParams {
+  double resolution = 0.05;    // m per cell
+  int tile_size = 64;          // cells per tile side
+  float min_height = -1.0;     // points outside [min_height, max_height]
+  float max_height = 2.0;      // are ignored
+  float max_range = 5.0;       // free space is only traced up to this range
+  float log_odds_hit = 0.85;   // log(0.7 / 0.3)
+  float log_odds_miss = -0.4;  // log(0.4 / 0.6)
+  float log_odds_min = -2.0;
+  float log_odds_max = 3.5;
+  float occupied_threshold = 0.65; // probability
+  float free_threshold = 0.196;    // probability
+};
+
+// Occupancy grid on the x/y plane that grows in fixed-size tiles allocated
+// the first time a point lands in them. Cells hold log-odds, so every update
+// touches only the cells of one point (plus its free-space ray) no matter how
+// large the map has become.
+//
+// Copies share their tiles, and a tile is only duplicated the first time
+// either side writes to it, so copying the grid to save it elsewhere costs a
+// pointer per tile and the live grid keeps updating meanwhile.
+class TiledOccupancyGrid {
+public:
+  // log-odds of tile_size^2 cells, row major, 0 where never observed
+  struct Tile {
+    int64_t x;
+    int64_t y;
+    std::vector<float> log_odds;
+    bool dirty = false;
+  };
+
+  explicit TiledOccupancyGrid(
+    const TiledOccupancyGridParams &params = TiledOccupancyGridParams())
+    : params_(params)
+  {
+  }
+
+  // Records a map point as occupied evidence.
+  void add_point(float x, float y, float z)
+  {
+    if (!in_height_band(z)) {
+      return;
+    }
+    update_cell(cell_index(x), cell_index(y), params_.log_odds_hit);
+  }
+
+  // Same, and also marks the cells between the camera at origin_x/origin_y
+  // and the point as free space.
+  void add_point(float x, float y, float z, float origin_x, float origin_y)
+  {
+    if (!in_height_band(z)) {
+      return;
+    }
+    int64_t cx = cell_index(x);
+    int64_t cy = cell_index(y);
+    float range = std::hypot(x - origin_x, y - origin_y);
+    if (range <= params_.max_range) {
+      trace_free(cell_index(origin_x), cell_index(origin_y), cx, cy);
+    }
+    update_cell(cx, cy, params_.log_odds_hit);
+  }
+
+  // A map point that was added earlier has been culled or moved away by
+  // bundle adjustment or loop closure.
+  void remove_point(float x, float y, float z)
+  {
+    if (!in_height_band(z)) {
+      return;
+    }
+    update_cell(cell_index(x), cell_index(y), params_.log_odds_miss);
+  }
+
+  void clear()
+  {
+    tiles_.clear();
+    dirty_.clear();
+    generation_++;
+    min_tile_x_ = min_tile_y_ = std::numeric_limits<int64_t>::max();
+    max_tile_x_ = max_tile_y_ = std::numeric_limits<int64_t>::min();
+    changed_ = true;
+  }
+
+  // true if any cell changed since the last call
+  bool take_changed()
+  {
+    bool changed = changed_;
+    changed_ = false;
+    return changed;
+  }
+
+  std::size_t tile_count() const { return tiles_.size(); }
+  const TiledOccupancyGridParams &params() const { return params_; }
+
+  // bumped by clear(), so an incremental reader knows to start over
+  uint64_t generation() const { return generation_; }
+
+  // Hands out every tile written since the last call. The tiles are shared,
+  // not copied, and stay as they are while the grid keeps updating.
+  void take_dirty_tiles(std::vector<std::shared_ptr<const Tile>> &out)
+  {
+    for (uint64_t key : dirty_) {
+      auto it = tiles_.find(key);
+      if (it != tiles_.end()) {
+        it->second->dirty = false;
+        out.push_back(it->second);
+      }
+    }
+    dirty_.clear();
+  }
+
+  // Puts back a tile that take_dirty_tiles() handed out, e.g. from a
+  // checkpoint. `log_odds` holds tile_size^2 cells.
+  void restore_tile(int64_t tx, int64_t ty, const float *log_odds)
+  {
+    const int64_t size = params_.tile_size;
+    cell(tx * size, ty * size);
+    Tile &tile = *tiles_[tile_key(tx, ty)];
+    tile.log_odds.assign(log_odds, log_odds + size * size);
+    changed_ = true;
+  }
+
+  // Writes the allocated area into `grid`, reusing its data buffer. Cells
+  // that were never observed are unknown (-1).
+  void to_msg(nav_msgs::msg::OccupancyGrid &grid) const
+  {
+    grid.info.resolution = params_.resolution;
+    grid.info.origin.position.z = 0;
+    grid.info.origin.orientation.x = 0;
+    grid.info.origin.orientation.y = 0;
+    grid.info.origin.orientation.z = 0;
+    grid.info.origin.orientation.w = 1;
+    if (tiles_.empty()) {
+      grid.info.width = 0;
+      grid.info.height = 0;
+      grid.data.clear();
+      return;
+    }
+
+    const int64_t size = params_.tile_size;
+    const int64_t width = (max_tile_x_ - min_tile_x_ + 1) * size;
+    const int64_t height = (max_tile_y_ - min_tile_y_ + 1) * size;
+    grid.info.width = width;
+    grid.info.height = height;
+    grid.info.origin.position.x = min_tile_x_ * size * params_.resolution;
+    grid.info.origin.position.y = min_tile_y_ * size * params_.resolution;
+    grid.data.assign(width * height, -1);
+
+    const float occupied = logit(params_.occupied_threshold);
+    const float free = logit(params_.free_threshold);
+    for (const auto &entry : tiles_) {
+      const Tile &tile = *entry.second;
+      int64_t x0 = (tile.x - min_tile_x_) * size;
+      int64_t y0 = (tile.y - min_tile_y_) * size;
+      for (int64_t j = 0; j < size; j++) {
+        int8_t *row = grid.data.data() + (y0 + j) * width + x0;
+        const float *cells = tile.log_odds.data() + j * size;
+        for (int64_t i = 0; i < size; i++) {
+          float l = cells[i];
+          if (l == 0.0f) {
+            continue;
+          }
+          if (l >= occupied) {
+            row[i] = 100;
+          } else if (l <= free) {
+            row[i] = 0;
+          } else {
+            row[i] = static_cast<int8_t>(100.0f / (1.0f + std::exp(-l)));
+          }
+        }
+      }
+    }
+  }
+
+private:
+  static float logit(float p) { return std::log(p / (1.0f - p)); }
+
+  bool in_height_band(float z) const
+  {
+    return z >= params_.min_height && z <= params_.max_height;
+  }
+
+  int64_t cell_index(float v) const
+  {
+    return static_cast<int64_t>(std::floor(v / params_.resolution));
+  }
+
+  static int64_t floor_div(int64_t a, int64_t b)
+  {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+  }
+
+  static uint64_t tile_key(int64_t tx, int64_t ty)
+  {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(tx)) << 32) |
+           static_cast<uint32_t>(ty);
+  }
+
+  float &cell(int64_t cx, int64_t cy)
+  {
+    const int64_t size = params_.tile_size;
+    int64_t tx = floor_div(cx, size);
+    int64_t ty = floor_div(cy, size);
+    std::shared_ptr<Tile> &tile = tiles_[tile_key(tx, ty)];
+    if (tile.use_count() > 1) {
+      tile = std::make_shared<Tile>(*tile);
+    } else if (tile) {
+      // pairs with the release of the last copy that shared the tile
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } else {
+      tile = std::make_shared<Tile>();
+      tile->x = tx;
+      tile->y = ty;
+      tile->log_odds.assign(size * size, 0.0f);
+      min_tile_x_ = std::min(min_tile_x_, tx);
+      min_tile_y_ = std::min(min_tile_y_, ty);
+      max_tile_x_ = std::max(max_tile_x_, tx);
+      max_tile_y_ = std::max(max_tile_y_, ty);
+    }
+    if (!tile->dirty) {
+      tile->dirty = true;
+      dirty_.push_back(tile_key(tx, ty));
+    }
+    return tile->log_odds[(cy - ty * size) * size + (cx - tx * size)];
+  }
+
+  void update_cell(int64_t cx, int64_t cy, float delta)
+  {
+    float &l = cell(cx, cy);
+    l = std::clamp(l + delta, params_.log_odds_min, params_.log_odds_max);
+    // keep 0 reserved for cells that were never observed
+    if (l == 0.0f) {
+      l = std::numeric_limits<float>::min();
+    }
+    changed_ = true;
+  }
+
+  // Bresenham from the origin cell up to, but not including, the end cell
+  void trace_free(int64_t x0, int64_t y0, int64_t x1, int64_t y1)
+  {
+    int64_t dx = std::abs(x1 - x0);
+    int64_t dy = -std::abs(y1 - y0);
+    int64_t sx = x0 < x1 ? 1 : -1;
+    int64_t sy = y0 < y1 ? 1 : -1;
+    int64_t err = dx + dy;
+    while (x0 != x1 || y0 != y1) {
+      update_cell(x0, y0, params_.log_odds_miss);
+      int64_t e2 = 2 * err;
+      if (e2 >= dy) {
+        err += dy;
+        x0 += sx;
+      }
+      if (e2 <= dx) {
+        err += dx;
+        y0 += sy;
+      }
+    }
+  }
+
+  TiledOccupancyGridParams params_;
+  std::unordered_map<uint64_t, std::shared_ptr<Tile>> tiles_;
+  std::vector<uint64_t> dirty_;
+  uint64_t generation_ = 0;
+  int64_t min_tile_x_ = std::numeric_limits<int64_t>::max();
+  int64_t min_tile_y_ = std::numeric_limits<int64_t>::max();
+  int64_t max_tile_x_ = std::numeric_limits<int64_t>::min();
+  int64_t max_tile_y_ = std::numeric_limits<int64_t>::min();
+  bool changed_ = false;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__TILED_OCCUPANCY_GRID_HPP_
@@ -0,0 +1,121 @@
+#ifndef ORB_SLAM3_ROS2__TRAJECTORY_LOG_HPP_
+#define ORB_SLAM3_ROS2__TRAJECTORY_LOG_HPP_
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace orb_slam3_ros2 {
+
+// Append-only camera trajectory written as poses are produced, so nothing
+// accumulates in memory and a crash loses at most the last unflushed batch.
+// Every enabled format gets its own file next to `base_path`:
+//   <base_path>.bin        "ORBTRAJ1" then one record per pose:
+//                          double stamp, uint64 index, float Twc[3][4]
+//   <base_path>_tum.txt    stamp tx ty tz qx qy qz qw
+//   <base_path>_kitti.txt  Twc as 12 row-major values of its top 3x4 block
+class TrajectoryLog {
+public:
+  TrajectoryLog(const std::string &base_path,
+                const std::vector<std::string> &formats,
+                std::size_t flush_every = 30)
+    : flush_every_(flush_every)
+  {
+    for (const std::string &format : formats) {
+      if (format == "binary") {
+        binary_ = std::fopen((base_path + ".bin").c_str(), "wb");
+        if (binary_) {
+          std::fwrite("ORBTRAJ1", 1, 8, binary_);
+        }
+      } else if (format == "tum") {
+        tum_ = std::fopen((base_path + "_tum.txt").c_str(), "w");
+      } else if (format == "kitti") {
+        kitti_ = std::fopen((base_path + "_kitti.txt").c_str(), "w");
+      } else {
+        unknown_formats_.push_back(format);
+      }
+    }
+  }
+
+  ~TrajectoryLog() { close(); }
+
+  TrajectoryLog(const TrajectoryLog &) = delete;
+  TrajectoryLog &operator=(const TrajectoryLog &) = delete;
+
+  // formats that were asked for but are not supported
+  const std::vector<std::string> &unknown_formats() const
+  {
+    return unknown_formats_;
+  }
+
+  void append(double stamp, const Eigen::Matrix4f &Twc)
+  {
+    if (binary_) {
+      float pose[12];
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+          pose[i * 4 + j] = Twc(i, j);
+        }
+      }
+      std::fwrite(&stamp, sizeof(stamp), 1, binary_);
+      std::fwrite(&count_, sizeof(count_), 1, binary_);
+      std::fwrite(pose, sizeof(pose), 1, binary_);
+    }
+    if (tum_) {
+      Eigen::Quaternionf q(Twc.block<3, 3>(0, 0));
+      std::fprintf(tum_, "%.9f %.6f %.6f %.6f %.6f %.6f %.6f %.6f\n", stamp,
+                   Twc(0, 3), Twc(1, 3), Twc(2, 3), q.x(), q.y(), q.z(),
+                   q.w());
+    }
+    if (kitti_) {
+      std::fprintf(kitti_,
+                   "%.6e %.6e %.6e %.6e %.6e %.6e %.6e %.6e %.6e %.6e %.6e "
+                   "%.6e\n",
+                   Twc(0, 0), Twc(0, 1), Twc(0, 2), Twc(0, 3), Twc(1, 0),
+                   Twc(1, 1), Twc(1, 2), Twc(1, 3), Twc(2, 0), Twc(2, 1),
+                   Twc(2, 2), Twc(2, 3));
+    }
+
+    count_++;
+    if (flush_every_ && count_ % flush_every_ == 0) {
+      flush();
+    }
+  }
+
+  void flush()
+  {
+    for (std::FILE *file : {binary_, tum_, kitti_}) {
+      if (file) {
+        std::fflush(file);
+      }
+    }
+  }
+
+  void close()
+  {
+    for (std::FILE **file : {&binary_, &tum_, &kitti_}) {
+      if (*file) {
+        std::fclose(*file);
+        *file = nullptr;
+      }
+    }
+  }
+
+  uint64_t size() const { return count_; }
+
+private:
+  std::size_t flush_every_;
+  std::FILE *binary_ = nullptr;
+  std::FILE *tum_ = nullptr;
+  std::FILE *kitti_ = nullptr;
+  std::vector<std::string> unknown_formats_;
+  uint64_t count_ = 0;
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__TRAJECTORY_LOG_HPP_
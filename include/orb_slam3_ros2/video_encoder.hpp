@@ -0,0 +1,126 @@
+#ifndef ORB_SLAM3_ROS2__VIDEO_ENCODER_HPP_
+#define ORB_SLAM3_ROS2__VIDEO_ENCODER_HPP_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "orb_slam3_ros2/frame_ring.hpp"
+#include "orb_slam3_ros2/stage_tracer.hpp"
+
+namespace orb_slam3_ros2 {
+
+// Writes frames to a video file on its own thread. submit() only queues the
+// frame; when the encoder falls behind the oldest queued frames are dropped
+// so the caller is never slowed down by encoding.
+class AsyncVideoEncoder {
+public:
+  AsyncVideoEncoder(const std::string &path, int fourcc, double fps,
+                    cv::Size size, std::size_t queue_size)
+    : queue_(queue_size)
+  {
+    writer_.open(path, fourcc, fps, size);
+    if (writer_.isOpened()) {
+      thread_ = std::thread(&AsyncVideoEncoder::run, this);
+    }
+  }
+
+  ~AsyncVideoEncoder() { close(); }
+
+  AsyncVideoEncoder(const AsyncVideoEncoder &) = delete;
+  AsyncVideoEncoder &operator=(const AsyncVideoEncoder &) = delete;
+
+  bool is_open() const { return writer_.isOpened(); }
+
+  // times every encoded frame as `stage`; set before the first submit()
+  void set_tracer(StageTracer *tracer, std::size_t stage)
+  {
+    tracer_ = tracer;
+    tracer_stage_ = stage;
+  }
+
+  void submit(const cv::Mat &frame)
+  {
+    queue_.push(frame);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    cv_.notify_one();
+  }
+
+  // writes whatever is still queued, then closes the file
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    writer_.release();
+  }
+
+  uint64_t frames_encoded() const { return encoded_.load(); }
+  uint64_t frames_dropped() const { return queue_.dropped(); }
+  std::size_t queue_depth() const { return queue_.size(); }
+
+  // average time spent encoding one frame, in ms
+  double mean_encode_ms() const
+  {
+    uint64_t encoded = encoded_.load();
+    return encoded ? encode_ns_.load() * 1e-6 / encoded : 0.0;
+  }
+
+private:
+  void run()
+  {
+    cv::Mat frame;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      }
+
+      while (queue_.pop(frame)) {
+        ScopedTrace trace(tracer_, tracer_stage_);
+        auto start = std::chrono::steady_clock::now();
+        writer_.write(frame);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        encode_ns_ +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+            .count();
+        encoded_++;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_ && queue_.empty()) {
+        return;
+      }
+    }
+  }
+
+  cv::VideoWriter writer_;
+  FrameRing<cv::Mat> queue_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  StageTracer *tracer_ = nullptr;
+  std::size_t tracer_stage_ = 0;
+
+  std::atomic<uint64_t> encoded_{0};
+  std::atomic<uint64_t> encode_ns_{0};
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__VIDEO_ENCODER_HPP_
@@ -0,0 +1,232 @@
+#ifndef ORB_SLAM3_ROS2__VOXEL_HASH_FILTER_HPP_
+#define ORB_SLAM3_ROS2__VOXEL_HASH_FILTER_HPP_
+
+#include <Eigen/Core>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "orb_slam3_ros2/live_map_cloud.hpp"
+#include "orb_slam3_ros2/map_delta_feed.hpp"
+
+namespace orb_slam3_ros2 {
+
+struct VoxelHashFilterParams {
+  float voxel_size = 0.05;
+  // points needed in a voxel and its 26 neighbours for it to be kept
+  uint32_t min_points = 5;
+};
+
+// Downsampled, outlier-free copy of the map, kept up to date point by point.
+// Every voxel stores its point count and coordinate sums; a voxel is an
+// inlier when its 3x3x3 neighbourhood holds at least min_points points, and
+// each inlier voxel contributes its centroid to the output cloud. Adding or
+// removing a point only re-evaluates the 27 voxels around it, so an update
+// costs O(changed points) instead of the KD-tree rebuilds of PCL's
+// StatisticalOutlierRemoval and RadiusOutlierRemoval.
+class VoxelHashFilter {
+public:
+  explicit VoxelHashFilter(
+    const VoxelHashFilterParams &params = VoxelHashFilterParams())
+    : params_(params)
+  {
+    layout_.apply(msg_, 0);
+  }
+
+  void apply(const MapPointDelta &delta)
+  {
+    switch (delta.type) {
+    case MapPointDelta::Type::Added:
+      add(delta.position);
+      break;
+    case MapPointDelta::Type::Moved:
+      remove(delta.previous);
+      add(delta.position);
+      break;
+    case MapPointDelta::Type::Updated:
+      break;
+    case MapPointDelta::Type::Removed:
+      remove(delta.position);
+      break;
+    }
+  }
+
+  void add(const Eigen::Vector3f &point)
+  {
+    uint64_t key = key_of(point);
+    Voxel &voxel = voxels_[key];
+    voxel.count++;
+    voxel.sum += point.cast<double>();
+    touch(key);
+  }
+
+  // `point` must be exactly what was added before
+  void remove(const Eigen::Vector3f &point)
+  {
+    uint64_t key = key_of(point);
+    auto it = voxels_.find(key);
+    if (it == voxels_.end()) {
+      return;
+    }
+    if (--it->second.count == 0) {
+      it->second.sum.setZero();
+    } else {
+      it->second.sum -= point.cast<double>();
+    }
+    touch(key);
+  }
+
+  // Re-evaluates the voxels touched since the last call and brings the
+  // output cloud up to date. Returns true if the cloud changed.
+  bool update()
+  {
+    if (dirty_.empty()) {
+      return false;
+    }
+    for (uint64_t key : dirty_) {
+      auto it = voxels_.find(key);
+      if (it == voxels_.end()) {
+        continue;
+      }
+      Voxel &voxel = it->second;
+      bool inlier = voxel.count > 0 && support(key) >= params_.min_points;
+      if (inlier) {
+        if (voxel.index == kNone) {
+          voxel.index = keys_.size();
+          keys_.push_back(key);
+          layout_.resize(msg_, keys_.size());
+        }
+        write(voxel);
+      } else if (voxel.index != kNone) {
+        remove_output(voxel.index);
+        voxel.index = kNone;
+      }
+      if (voxel.count == 0) {
+        voxels_.erase(it);
+      }
+    }
+    dirty_.clear();
+    return true;
+  }
+
+  void clear()
+  {
+    voxels_.clear();
+    dirty_.clear();
+    keys_.clear();
+    layout_.resize(msg_, 0);
+  }
+
+  std::size_t size() const { return keys_.size(); }
+  std::size_t voxel_count() const { return voxels_.size(); }
+
+  sensor_msgs::msg::PointCloud2 &msg() { return msg_; }
+  const sensor_msgs::msg::PointCloud2 &msg() const { return msg_; }
+
+private:
+  static constexpr std::size_t kNone = static_cast<std::size_t>(-1);
+  static constexpr int64_t kBias = 1 << 20; // 21 bits per axis
+
+  struct Voxel {
+    uint32_t count = 0;
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+    std::size_t index = kNone; // position in the output cloud
+  };
+
+  static uint64_t pack(int64_t x, int64_t y, int64_t z)
+  {
+    return (static_cast<uint64_t>(x + kBias) << 42) |
+           (static_cast<uint64_t>(y + kBias) << 21) |
+           static_cast<uint64_t>(z + kBias);
+  }
+
+  static void unpack(uint64_t key, int64_t &x, int64_t &y, int64_t &z)
+  {
+    constexpr uint64_t mask = (1 << 21) - 1;
+    x = static_cast<int64_t>((key >> 42) & mask) - kBias;
+    y = static_cast<int64_t>((key >> 21) & mask) - kBias;
+    z = static_cast<int64_t>(key & mask) - kBias;
+  }
+
+  uint64_t key_of(const Eigen::Vector3f &point) const
+  {
+    const float scale = 1.0f / params_.voxel_size;
+    return pack(static_cast<int64_t>(std::floor(point.x() * scale)),
+                static_cast<int64_t>(std::floor(point.y() * scale)),
+                static_cast<int64_t>(std::floor(point.z() * scale)));
+  }
+
+  // marks the voxel and every existing neighbour for re-evaluation
+  void touch(uint64_t key)
+  {
+    int64_t x, y, z;
+    unpack(key, x, y, z);
+    for (int64_t dx = -1; dx <= 1; dx++) {
+      for (int64_t dy = -1; dy <= 1; dy++) {
+        for (int64_t dz = -1; dz <= 1; dz++) {
+          uint64_t neighbour = pack(x + dx, y + dy, z + dz);
+          if (neighbour == key || voxels_.count(neighbour)) {
+            dirty_.insert(neighbour);
+          }
+        }
+      }
+    }
+  }
+
+  uint32_t support(uint64_t key) const
+  {
+    int64_t x, y, z;
+    unpack(key, x, y, z);
+    uint32_t points = 0;
+    for (int64_t dx = -1; dx <= 1; dx++) {
+      for (int64_t dy = -1; dy <= 1; dy++) {
+        for (int64_t dz = -1; dz <= 1; dz++) {
+          auto it = voxels_.find(pack(x + dx, y + dy, z + dz));
+          if (it != voxels_.end()) {
+            points += it->second.count;
+          }
+        }
+      }
+    }
+    return points;
+  }
+
+  void write(const Voxel &voxel)
+  {
+    Eigen::Vector3d centroid = voxel.sum / voxel.count;
+    layout_.write(msg_.data.data() + voxel.index * layout_.point_step(),
+                  centroid.x(), centroid.y(), centroid.z(), 0, 0);
+  }
+
+  // moves the last output point into the hole so the cloud stays dense
+  void remove_output(std::size_t index)
+  {
+    std::size_t last = keys_.size() - 1;
+    if (index != last) {
+      const uint32_t step = layout_.point_step();
+      std::memcpy(msg_.data.data() + index * step,
+                  msg_.data.data() + last * step, step);
+      keys_[index] = keys_[last];
+      voxels_[keys_[index]].index = index;
+    }
+    keys_.pop_back();
+    layout_.resize(msg_, keys_.size());
+  }
+
+  VoxelHashFilterParams params_;
+  std::unordered_map<uint64_t, Voxel> voxels_;
+  std::unordered_set<uint64_t> dirty_;
+
+  PointCloud2Layout layout_;
+  sensor_msgs::msg::PointCloud2 msg_;
+  std::vector<uint64_t> keys_; // voxel of every output point
+};
+
+} // namespace orb_slam3_ros2
+
+#endif // ORB_SLAM3_ROS2__VOXEL_HASH_FILTER_HPP_
@@ -0,0 +1,73 @@
+from launch.actions import DeclareLaunchArgument
+from launch.substitutions import LaunchConfiguration
+from launch_ros.actions import ComposableNodeContainer
+from launch_ros.descriptions import ComposableNode
+
+from launch import LaunchDescription
+
+
+def generate_launch_description():
+    # every node shares one process with the camera driver, so images are
+    # handed over as pointers instead of going through DDS
+    intra_process = [{"use_intra_process_comms": True}]
+    return LaunchDescription(
+        [
+            DeclareLaunchArgument(
+                "sensor_type",
+                default_value="monocular",
+                description="The mode which ORB_SLAM3 will run in.",
+            ),
+            DeclareLaunchArgument(
+                "use_pangolin",
+                default_value="true",
+                description="Whether to use Pangolin for visualization.",
+            ),
+            ComposableNodeContainer(
+                name="orb_slam3_container",
+                namespace="",
+                package="rclcpp_components",
+                # the slam node relies on a multi-threaded executor
+                executable="component_container_mt",
+                output="screen",
+                composable_node_descriptions=[
+                    ComposableNode(
+                        package="realsense2_camera",
+                        plugin="realsense2_camera::RealSenseNodeFactory",
+                        name="camera",
+                        namespace="",
+                        parameters=[
+                            {
+                                "enable_color": False,
+                                "enable_depth": False,
+                                "enable_infra1": True,
+                                "enable_infra2": True,
+                                "depth_module.emitter_enabled": 0,
+                                "enable_accel": True,
+                                "enable_gyro": True,
+                                "unite_imu_method": 2,
+                            }
+                        ],
+                        extra_arguments=intra_process,
+                    ),
+                    ComposableNode(
+                        package="orb_slam3_ros2",
+                        plugin="orb_slam3_ros2::ImuMonoRealSense",
+                        name="imu_mono_realsense",
+                        parameters=[
+                            {
+                                "sensor_type": LaunchConfiguration("sensor_type"),
+                                "use_pangolin": LaunchConfiguration("use_pangolin"),
+                            }
+                        ],
+                        extra_arguments=intra_process,
+                    ),
+                    ComposableNode(
+                        package="orb_slam3_ros2",
+                        plugin="orb_slam3_ros2::OrbCameraInfo",
+                        name="orb_camera_info_node",
+                        extra_arguments=intra_process,
+                    ),
+                ],
+            ),
+        ]
+    )
@@ -0,0 +1,492 @@
+// Cleans up saved map clouds that are too large to filter in memory. The
+// input PCDs are streamed once and split into square xy tiles, each padded
+// with an overlap border so the neighbour searches near a tile edge see the
+// same points they would in the full cloud. Tiles are then filtered in
+// parallel (statistical outliers, radius outliers, optional voxel
+// downsampling), cropped back to their own area and merged into one binary
+// PCD. Memory use is bounded by the spill buffer plus one tile per thread.
+//
+// usage: cloud_postprocess <output.pcd> <input.pcd>... [options]
+//   --tile-size <m>        tile edge length (default: 10)
+//   --overlap <m>          border shared with neighbouring tiles (default: 0.5)
+//   --mean-k <n>           statistical outlier neighbours (default: 100)
+//   --stddev <mul>         statistical outlier threshold (default: 0.1)
+//   --radius <m>           radius outlier search radius (default: 0.1)
+//   --min-neighbors <n>    radius outlier minimum neighbours (default: 5)
+//   --leaf <m>             voxel downsampling leaf size, 0 keeps every point
+//   --threads <n>          worker threads (default: all cores)
+//   --buffer-mb <n>        spill buffer size before tiles go to disk (256)
+
+#include <pcl/filters/radius_outlier_removal.h>
+#include <pcl/filters/statistical_outlier_removal.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct Options {
+  double tile_size = 10.0;
+  double overlap = 0.5;
+  int mean_k = 100;
+  double stddev = 0.1;
+  double radius = 0.1;
+  int min_neighbors = 5;
+  double leaf = 0.0;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::size_t buffer_bytes = 256u << 20;
+};
+
+// Streams x, y, z out of an uncompressed PCD without loading it.
+class PcdStreamReader {
+public:
+  explicit PcdStreamReader(const fs::path &path)
+    : file_(path, std::ios::binary)
+  {
+    if (!file_) {
+      error_ = "cannot open " + path.string();
+      return;
+    }
+
+    std::vector<std::string> fields;
+    std::vector<int> sizes, counts;
+    std::vector<char> types;
+    std::string line;
+    while (std::getline(file_, line)) {
+      std::stringstream ss(line);
+      std::string key;
+      ss >> key;
+      if (key.empty() || key[0] == '#') {
+        continue;
+      }
+      std::string value;
+      if (key == "FIELDS") {
+        while (ss >> value) {
+          fields.push_back(value);
+        }
+      } else if (key == "SIZE") {
+        while (ss >> value) {
+          sizes.push_back(std::stoi(value));
+        }
+      } else if (key == "TYPE") {
+        while (ss >> value) {
+          types.push_back(value[0]);
+        }
+      } else if (key == "COUNT") {
+        while (ss >> value) {
+          counts.push_back(std::stoi(value));
+        }
+      } else if (key == "POINTS") {
+        ss >> points_;
+      } else if (key == "DATA") {
+        ss >> data_;
+        break;
+      }
+    }
+    if (counts.empty()) {
+      counts.assign(fields.size(), 1);
+    }
+    if (sizes.size() != fields.size() || types.size() != fields.size() ||
+        counts.size() != fields.size()) {
+      error_ = "malformed header in " + path.string();
+      return;
+    }
+    if (data_ != "binary" && data_ != "ascii") {
+      error_ = path.string() + ": DATA " + data_ +
+               " cannot be streamed, re-save it as binary or ascii";
+      return;
+    }
+
+    // byte offset (binary) or column (ascii) of each coordinate
+    int offset = 0, column = 0;
+    for (std::size_t i = 0; i < fields.size(); i++) {
+      for (int c = 0; c < 3; c++) {
+        if (fields[i] == std::string(1, "xyz"[c])) {
+          if (types[i] != 'F' || sizes[i] != 4) {
+            error_ = path.string() + ": coordinates must be float32";
+            return;
+          }
+          offsets_[c] = offset;
+          columns_[c] = column;
+          found_[c] = true;
+        }
+      }
+      offset += sizes[i] * counts[i];
+      column += counts[i];
+    }
+    point_step_ = offset;
+    if (!found_[0] || !found_[1] || !found_[2]) {
+      error_ = path.string() + ": no x, y and z fields";
+    }
+  }
+
+  const std::string &error() const { return error_; }
+  uint64_t points() const { return points_; }
+
+  // calls fn(x, y, z) for every point
+  template <typename Fn>
+  void for_each(Fn fn)
+  {
+    if (data_ == "ascii") {
+      std::string line;
+      std::vector<float> values;
+      while (std::getline(file_, line)) {
+        std::stringstream ss(line);
+        values.clear();
+        float value;
+        while (ss >> value) {
+          values.push_back(value);
+        }
+        int needed = std::max({columns_[0], columns_[1], columns_[2]});
+        if (static_cast<int>(values.size()) > needed) {
+          fn(values[columns_[0]], values[columns_[1]], values[columns_[2]]);
+        }
+      }
+      return;
+    }
+
+    constexpr std::size_t chunk_points = 1 << 16;
+    std::vector<char> chunk(chunk_points * point_step_);
+    uint64_t remaining = points_;
+    while (remaining > 0 && file_) {
+      std::size_t n = std::min<uint64_t>(remaining, chunk_points);
+      file_.read(chunk.data(), n * point_step_);
+      n = file_.gcount() / point_step_;
+      for (std::size_t i = 0; i < n; i++) {
+        const char *point = chunk.data() + i * point_step_;
+        float xyz[3];
+        for (int c = 0; c < 3; c++) {
+          std::memcpy(&xyz[c], point + offsets_[c], sizeof(float));
+        }
+        fn(xyz[0], xyz[1], xyz[2]);
+      }
+      remaining -= n;
+      if (n == 0) {
+        break;
+      }
+    }
+  }
+
+private:
+  std::ifstream file_;
+  std::string error_;
+  std::string data_;
+  uint64_t points_ = 0;
+  int point_step_ = 0;
+  int offsets_[3] = {0, 0, 0};
+  int columns_[3] = {0, 0, 0};
+  bool found_[3] = {false, false, false};
+};
+
+// Sorts streamed points into per-tile spill files, including every tile
+// whose overlap border a point falls into. Points are buffered in memory and
+// appended to the tile files whenever the buffer fills up.
+class TileSpiller {
+public:
+  TileSpiller(const fs::path &dir, const Options &options)
+    : dir_(dir), options_(options)
+  {
+  }
+
+  void add(float x, float y, float z)
+  {
+    const double size = options_.tile_size;
+    const double margin = options_.overlap;
+    int64_t x0 = std::floor((x - margin) / size);
+    int64_t x1 = std::floor((x + margin) / size);
+    int64_t y0 = std::floor((y - margin) / size);
+    int64_t y1 = std::floor((y + margin) / size);
+    for (int64_t tx = x0; tx <= x1; tx++) {
+      for (int64_t ty = y0; ty <= y1; ty++) {
+        std::vector<float> &buffer = buffers_[tile_key(tx, ty)];
+        buffer.insert(buffer.end(), {x, y, z});
+        buffered_bytes_ += 3 * sizeof(float);
+      }
+    }
+    if (buffered_bytes_ >= options_.buffer_bytes) {
+      flush();
+    }
+  }
+
+  void flush()
+  {
+    for (auto &[key, buffer] : buffers_) {
+      if (buffer.empty()) {
+        continue;
+      }
+      std::ofstream out(tile_path(key), std::ios::binary | std::ios::app);
+      out.write(reinterpret_cast<const char *>(buffer.data()),
+                buffer.size() * sizeof(float));
+      tile_points_[key] += buffer.size() / 3;
+      buffer.clear();
+      buffer.shrink_to_fit();
+    }
+    buffered_bytes_ = 0;
+  }
+
+  // every tile written so far with its point count, overlap included
+  const std::map<int64_t, uint64_t> &tiles() const { return tile_points_; }
+
+  fs::path tile_path(int64_t key) const
+  {
+    return dir_ / (std::to_string(key) + ".xyz");
+  }
+
+  static int64_t tile_key(int64_t tx, int64_t ty)
+  {
+    return static_cast<int64_t>((static_cast<uint64_t>(tx) << 32) |
+                                static_cast<uint32_t>(ty));
+  }
+
+  static void tile_coords(int64_t key, int64_t &tx, int64_t &ty)
+  {
+    tx = key >> 32;
+    ty = static_cast<int32_t>(key & 0xffffffff);
+  }
+
+private:
+  fs::path dir_;
+  const Options &options_;
+  std::unordered_map<int64_t, std::vector<float>> buffers_;
+  std::map<int64_t, uint64_t> tile_points_;
+  std::size_t buffered_bytes_ = 0;
+};
+
+// the same filters filter_point_cloud used to run on the whole live cloud,
+// then cropped to the tile's own area
+static pcl::PointCloud<pcl::PointXYZ>::Ptr
+filter_tile(int64_t key, const fs::path &path, const Options &options)
+{
+  pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(
+    new pcl::PointCloud<pcl::PointXYZ>);
+  {
+    std::ifstream in(path, std::ios::binary);
+    std::vector<float> xyz(fs::file_size(path) / sizeof(float));
+    in.read(reinterpret_cast<char *>(xyz.data()), xyz.size() * sizeof(float));
+    cloud->reserve(xyz.size() / 3);
+    for (std::size_t i = 0; i + 2 < xyz.size(); i += 3) {
+      cloud->push_back(pcl::PointXYZ(xyz[i], xyz[i + 1], xyz[i + 2]));
+    }
+  }
+
+  if (static_cast<int>(cloud->size()) > options.mean_k) {
+    pcl::PointCloud<pcl::PointXYZ>::Ptr sor_cloud(
+      new pcl::PointCloud<pcl::PointXYZ>);
+    pcl::StatisticalOutlierRemoval<pcl::PointXYZ> sor;
+    sor.setInputCloud(cloud);
+    sor.setMeanK(options.mean_k);
+    sor.setStddevMulThresh(options.stddev);
+    sor.filter(*sor_cloud);
+    cloud = sor_cloud;
+  }
+
+  if (options.radius > 0 && !cloud->empty()) {
+    pcl::PointCloud<pcl::PointXYZ>::Ptr radius_cloud(
+      new pcl::PointCloud<pcl::PointXYZ>);
+    pcl::RadiusOutlierRemoval<pcl::PointXYZ> radius_outlier;
+    radius_outlier.setInputCloud(cloud);
+    radius_outlier.setRadiusSearch(options.radius);
+    radius_outlier.setMinNeighborsInRadius(options.min_neighbors);
+    radius_outlier.filter(*radius_cloud);
+    cloud = radius_cloud;
+  }
+
+  // keep only the points this tile owns, the border belongs to its neighbours
+  int64_t tx, ty;
+  TileSpiller::tile_coords(key, tx, ty);
+  pcl::PointCloud<pcl::PointXYZ>::Ptr owned(
+    new pcl::PointCloud<pcl::PointXYZ>);
+  owned->reserve(cloud->size());
+  for (const pcl::PointXYZ &point : *cloud) {
+    if (static_cast<int64_t>(std::floor(point.x / options.tile_size)) == tx &&
+        static_cast<int64_t>(std::floor(point.y / options.tile_size)) == ty) {
+      owned->push_back(point);
+    }
+  }
+
+  if (options.leaf > 0 && !owned->empty()) {
+    pcl::PointCloud<pcl::PointXYZ>::Ptr voxel_cloud(
+      new pcl::PointCloud<pcl::PointXYZ>);
+    pcl::VoxelGrid<pcl::PointXYZ> voxel;
+    voxel.setInputCloud(owned);
+    voxel.setLeafSize(options.leaf, options.leaf, options.leaf);
+    voxel.filter(*voxel_cloud);
+    owned = voxel_cloud;
+  }
+  return owned;
+}
+
+static void write_pcd_header(std::ostream &out, uint64_t points)
+{
+  out << "# .PCD v0.7 - Point Cloud Data file format\n"
+      << "VERSION 0.7\n"
+      << "FIELDS x y z\n"
+      << "SIZE 4 4 4\n"
+      << "TYPE F F F\n"
+      << "COUNT 1 1 1\n"
+      << "WIDTH " << points << "\n"
+      << "HEIGHT 1\n"
+      << "VIEWPOINT 0 0 0 1 0 0 0\n"
+      << "POINTS " << points << "\n"
+      << "DATA binary\n";
+}
+
+static void usage()
+{
+  std::cerr << "usage: cloud_postprocess <output.pcd> <input.pcd>... "
+               "[--tile-size <m>] [--overlap <m>] [--mean-k <n>] "
+               "[--stddev <mul>] [--radius <m>] [--min-neighbors <n>] "
+               "[--leaf <m>] [--threads <n>] [--buffer-mb <n>]"
+            << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  Options options;
+  std::vector<fs::path> inputs;
+  fs::path output;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      if (output.empty()) {
+        output = arg;
+      } else {
+        inputs.push_back(arg);
+      }
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--tile-size") {
+      options.tile_size = std::stod(value);
+    } else if (arg == "--overlap") {
+      options.overlap = std::stod(value);
+    } else if (arg == "--mean-k") {
+      options.mean_k = std::stoi(value);
+    } else if (arg == "--stddev") {
+      options.stddev = std::stod(value);
+    } else if (arg == "--radius") {
+      options.radius = std::stod(value);
+    } else if (arg == "--min-neighbors") {
+      options.min_neighbors = std::stoi(value);
+    } else if (arg == "--leaf") {
+      options.leaf = std::stod(value);
+    } else if (arg == "--threads") {
+      options.threads = std::max(1, std::stoi(value));
+    } else if (arg == "--buffer-mb") {
+      options.buffer_bytes = std::stoull(value) << 20;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (output.empty() || inputs.empty() || options.tile_size <= 0) {
+    usage();
+    return 1;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  fs::path tile_dir = output.string() + ".tiles";
+  fs::remove_all(tile_dir);
+  fs::create_directories(tile_dir);
+
+  // pass 1: stream every input into overlapping tiles on disk
+  TileSpiller spiller(tile_dir, options);
+  uint64_t input_points = 0;
+  for (const fs::path &input : inputs) {
+    PcdStreamReader reader(input);
+    if (!reader.error().empty()) {
+      std::cerr << reader.error() << std::endl;
+      fs::remove_all(tile_dir);
+      return 1;
+    }
+    std::cout << "reading " << input.string() << " (" << reader.points()
+              << " points)" << std::endl;
+    reader.for_each([&](float x, float y, float z) {
+      if (std::isfinite(x) && std::isfinite(y) && std::isfinite(z)) {
+        spiller.add(x, y, z);
+        input_points++;
+      }
+    });
+  }
+  spiller.flush();
+
+  // pass 2: filter tiles in parallel, largest first so no thread is left
+  // with a big tile at the end
+  std::vector<std::pair<int64_t, uint64_t>> tiles(spiller.tiles().begin(),
+                                                  spiller.tiles().end());
+  std::sort(tiles.begin(), tiles.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  std::cout << input_points << " points in " << tiles.size() << " tiles, "
+            << "filtering on " << options.threads << " threads" << std::endl;
+
+  fs::path body_path = tile_dir / "body.bin";
+  std::ofstream body(body_path, std::ios::binary);
+  std::mutex body_mutex;
+  std::atomic<std::size_t> next_tile{0};
+  std::atomic<uint64_t> output_points{0};
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < options.threads; t++) {
+    workers.emplace_back([&]() {
+      std::vector<float> xyz;
+      std::size_t i;
+      while ((i = next_tile++) < tiles.size()) {
+        int64_t key = tiles[i].first;
+        pcl::PointCloud<pcl::PointXYZ>::Ptr filtered =
+          filter_tile(key, spiller.tile_path(key), options);
+        fs::remove(spiller.tile_path(key));
+
+        xyz.clear();
+        xyz.reserve(filtered->size() * 3);
+        for (const pcl::PointXYZ &point : *filtered) {
+          xyz.insert(xyz.end(), {point.x, point.y, point.z});
+        }
+        std::lock_guard<std::mutex> lock(body_mutex);
+        body.write(reinterpret_cast<const char *>(xyz.data()),
+                   xyz.size() * sizeof(float));
+        output_points += filtered->size();
+      }
+    });
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  body.close();
+
+  // the point count is only known now, so the header goes in front last
+  {
+    std::ofstream out(output, std::ios::binary);
+    write_pcd_header(out, output_points);
+    std::ifstream in(body_path, std::ios::binary);
+    out << in.rdbuf();
+  }
+  fs::remove_all(tile_dir);
+
+  double seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  std::cout << "wrote " << output_points << " of " << input_points
+            << " points to " << output.string() << " in " << seconds << " s"
+            << std::endl;
+  return 0;
+}
@@ -4,15 +4,13 @@
 #include <pcl/common/centroid.h>
 #include <pcl/conversions.h>
 #include <pcl/filters/filter.h>
-#include <pcl/filters/radius_outlier_removal.h>
-#include <pcl/filters/statistical_outlier_removal.h>
-#include <pcl/filters/voxel_grid.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/io/ply_io.h>
 #include <pcl/point_cloud.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl_ros/transforms.hpp>
 
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
 #include <geometry_msgs/msg/pose_array.hpp>
 #include <geometry_msgs/msg/quaternion.hpp>
 #include <geometry_msgs/msg/vector3.hpp>
@@ -25,14 +23,23 @@
 #include <sensor_msgs/msg/imu.hpp>
 #include <sensor_msgs/msg/point_cloud2.hpp>
 #include <std_srvs/srv/empty.hpp>
+#include <std_srvs/srv/set_bool.hpp>
+#include <std_srvs/srv/trigger.hpp>
 #include <tf2/LinearMath/Matrix3x3.h>
 #include <tf2/LinearMath/Quaternion.h>
 #include <tf2_ros/transform_broadcaster.h>
 
 #include "nav2_map_server/map_io.hpp"
 
+#include <algorithm>
+#include <condition_variable>
 #include <filesystem>
+#include <future>
+#include <limits>
+#include <optional>
+#include <stdexcept>
 #include <sstream>
+#include <thread>
 
 #include <cv_bridge/cv_bridge.hpp>
 
@@ -40,14 +47,38 @@
 #include "System.h"
 
 #include <rclcpp/rclcpp.hpp>
+#include <rclcpp_components/register_node_macro.hpp>
+
+#include "orb_slam3_ros2/atlas_store.hpp"
+#include "orb_slam3_ros2/camera_model.hpp"
+#include "orb_slam3_ros2/frame_ring.hpp"
+#include "orb_slam3_ros2/frame_scheduler.hpp"
+#include "orb_slam3_ros2/image_buffer_pool.hpp"
+#include "orb_slam3_ros2/imu_ring_buffer.hpp"
+#include "orb_slam3_ros2/live_map_cloud.hpp"
+#include "orb_slam3_ros2/map_delta_feed.hpp"
+#include "orb_slam3_ros2/map_point_harvester.hpp"
+#include "orb_slam3_ros2/pose_history.hpp"
+#include "orb_slam3_ros2/quality_controller.hpp"
+#include "orb_slam3_ros2/rectify_pool.hpp"
+#include "orb_slam3_ros2/session_checkpoint.hpp"
+#include "orb_slam3_ros2/stage_tracer.hpp"
+#include "orb_slam3_ros2/stereo_sync.hpp"
+#include "orb_slam3_ros2/tiled_occupancy_grid.hpp"
+#include "orb_slam3_ros2/trajectory_log.hpp"
+#include "orb_slam3_ros2/video_encoder.hpp"
+#include "orb_slam3_ros2/voxel_hash_filter.hpp"
 
 using namespace std::chrono_literals;
 using std::placeholders::_1;
 
+namespace orb_slam3_ros2 {
+
 class ImuMonoRealSense : public rclcpp::Node {
 public:
-  ImuMonoRealSense()
-    : Node("imu_mono_realsense"),
+  explicit ImuMonoRealSense(
+    const rclcpp::NodeOptions &options = rclcpp::NodeOptions())
+    : Node("imu_mono_realsense", options),
       vocabulary_file_path(std::string(PROJECT_PATH) +
                            "/ORB_SLAM3/Vocabulary/ORBvoc.txt")
   {
@@ -55,10 +86,103 @@ public:
     // declare parameters
     declare_parameter("sensor_type", "imu-monocular");
     declare_parameter("use_pangolin", true);
+    declare_parameter("settings_file", "");
+    declare_parameter("stereo_sync_tolerance", 0.001);
+    declare_parameter("atlas_mode", "off");
+    declare_parameter("atlas_name", "atlas");
+    declare_parameter("localization_only", false);
+    declare_parameter("rectify_images", false);
+    declare_parameter("rectify_threads", 2);
+    declare_parameter("rectify_balance", 0.0);
+    declare_parameter("frame_queue_size", 4);
+    declare_parameter("frame_drop_policy", "drop-oldest");
+    declare_parameter("imu_buffer_size", 2000);
+    declare_parameter("grid_resolution", 0.05);
+    declare_parameter("grid_tile_size", 64);
+    declare_parameter("grid_min_height", -1.0);
+    declare_parameter("grid_max_height", 2.0);
+    declare_parameter("grid_max_range", 5.0);
+    declare_parameter("live_cloud_observations", false);
+    declare_parameter("live_cloud_keyframe", false);
+    declare_parameter("live_cloud_reserve", 200000);
+    declare_parameter("live_cloud_filtered", true);
+    declare_parameter("filter_voxel_size", 0.05);
+    declare_parameter("filter_min_points", 5);
+    declare_parameter("record_video", true);
+    declare_parameter("video_queue_size", 8);
+    declare_parameter("trace_stages", false);
+    declare_parameter("trace_file", false);
+    declare_parameter("checkpoint_period", 2.0);
+    declare_parameter("checkpoint_sync_every", 5);
+    declare_parameter("compact_on_shutdown", false);
+    declare_parameter("adaptive_quality", false);
+    declare_parameter("target_latency_ms", 33.0);
+    declare_parameter("quality_min_features", 500);
+    declare_parameter("quality_min_levels", 4);
+    declare_parameter("quality_min_scale", 0.6);
+    declare_parameter("frame_skip_budget_ms", 0.0);
+    declare_parameter("frame_skip_keyframe_rotation", 0.1);
+    declare_parameter("frame_skip_max_interval", 0.25);
 
     // get parameters
     sensor_type_param = get_parameter("sensor_type").as_string();
     use_pangolin = get_parameter("use_pangolin").as_bool();
+    frame_queue_size_ = std::clamp<int64_t>(
+      get_parameter("frame_queue_size").as_int(), 1,
+      orb_slam3_ros2::FrameRing<CameraFrame>::kMaxCapacity);
+    frame_ring_ =
+      std::make_unique<orb_slam3_ros2::FrameRing<CameraFrame>>(
+        frame_queue_size_);
+    if (!orb_slam3_ros2::parse_drop_policy(
+          get_parameter("frame_drop_policy").as_string(), drop_policy_)) {
+      RCLCPP_WARN(get_logger(),
+                  "Unknown frame_drop_policy, using drop-oldest instead");
+    }
+    imu_buffer_ = std::make_unique<orb_slam3_ros2::ImuRingBuffer>(
+      std::max<int64_t>(2, get_parameter("imu_buffer_size").as_int()));
+    vImuMeas_.reserve(256);
+
+    orb_slam3_ros2::FrameSchedulerParams scheduler_params;
+    scheduler_params.latency_budget_ms =
+      get_parameter("frame_skip_budget_ms").as_double();
+    scheduler_params.keyframe_rotation =
+      get_parameter("frame_skip_keyframe_rotation").as_double();
+    scheduler_params.max_skip_interval =
+      get_parameter("frame_skip_max_interval").as_double();
+    frame_scheduler_ =
+      std::make_unique<orb_slam3_ros2::FrameScheduler>(scheduler_params);
+
+    orb_slam3_ros2::TiledOccupancyGridParams grid_params;
+    grid_params.resolution = get_parameter("grid_resolution").as_double();
+    grid_params.tile_size = get_parameter("grid_tile_size").as_int();
+    grid_params.min_height = get_parameter("grid_min_height").as_double();
+    grid_params.max_height = get_parameter("grid_max_height").as_double();
+    grid_params.max_range = get_parameter("grid_max_range").as_double();
+    // both divide every cell and tile index
+    if (grid_params.resolution <= 0.0 || grid_params.tile_size <= 0) {
+      throw std::invalid_argument(
+        "grid_resolution and grid_tile_size must be positive");
+    }
+    occupancy_grid_ = orb_slam3_ros2::TiledOccupancyGrid(grid_params);
+
+    orb_slam3_ros2::PointCloud2Layout live_layout(
+      get_parameter("live_cloud_observations").as_bool(),
+      get_parameter("live_cloud_keyframe").as_bool());
+    live_cloud_ = orb_slam3_ros2::LiveMapCloud(
+      live_layout,
+      std::max<int64_t>(0, get_parameter("live_cloud_reserve").as_int()));
+    map_feed_.set_track_metadata(live_layout.has_metadata());
+    live_cloud_.msg().header.frame_id = "live_map";
+
+    // the published cloud is downsampled and outlier free unless disabled
+    if (get_parameter("live_cloud_filtered").as_bool()) {
+      orb_slam3_ros2::VoxelHashFilterParams filter_params;
+      filter_params.voxel_size = get_parameter("filter_voxel_size").as_double();
+      filter_params.min_points = get_parameter("filter_min_points").as_int();
+      cloud_filter_ =
+        std::make_unique<orb_slam3_ros2::VoxelHashFilter>(filter_params);
+      cloud_filter_->msg().header.frame_id = "live_map";
+    }
 
     // define callback groups
     image_callback_group_ =
@@ -76,7 +200,6 @@ public:
     imu_options.callback_group = imu_callback_group_;
 
     // set the sensor type based on parameter
-    ORB_SLAM3::System::eSensor sensor_type;
     if (sensor_type_param == "monocular") {
       sensor_type = ORB_SLAM3::System::MONOCULAR;
       settings_file_path =
@@ -85,18 +208,52 @@ public:
       sensor_type = ORB_SLAM3::System::IMU_MONOCULAR;
       settings_file_path = std::string(PROJECT_PATH) +
                            "/config/Monocular-Inertial/RealSense_D435i.yaml";
+      inertial_ = true;
+    } else if (sensor_type_param == "stereo") {
+      sensor_type = ORB_SLAM3::System::STEREO;
+      settings_file_path =
+        std::string(PROJECT_PATH) + "/config/Stereo/RealSense_D435i.yaml";
+      stereo_ = true;
+    } else if (sensor_type_param == "imu-stereo") {
+      sensor_type = ORB_SLAM3::System::IMU_STEREO;
+      settings_file_path = std::string(PROJECT_PATH) +
+                           "/config/Stereo-Inertial/RealSense_D435i.yaml";
+      stereo_ = true;
+      inertial_ = true;
     } else {
-      RCLCPP_ERROR(get_logger(), "Sensor type not recognized");
-      rclcpp::shutdown();
+      throw std::invalid_argument("sensor_type not recognized: " +
+                                  sensor_type_param);
+    }
+    std::string settings_file = get_parameter("settings_file").as_string();
+    if (!settings_file.empty()) {
+      settings_file_path =
+        settings_file[0] == '/'
+          ? settings_file
+          : std::string(PROJECT_PATH) + "/config/" + settings_file;
+    }
+    base_settings_path_ = settings_file_path;
+    if (get_parameter("adaptive_quality").as_bool()) {
+      setup_quality_controller();
+    }
+
+    // undistort on a worker pool before tracking, so orbslam3 sees a plain
+    // pinhole camera and fisheye configs cost it nothing extra per frame
+    if (get_parameter("rectify_images").as_bool()) {
+      if (stereo_) {
+        RCLCPP_WARN(get_logger(), "rectify_images is ignored in stereo modes, "
+                                  "the infrared pair is already rectified");
+      } else {
+        setup_rectification();
+      }
     }
 
+    setup_atlas();
+    localization_only_ = get_parameter("localization_only").as_bool() ||
+                         atlas_mode_ == orb_slam3_ros2::AtlasMode::Localize;
+
     RCLCPP_INFO_STREAM(get_logger(),
                        "vocabulary_file_path: " << vocabulary_file_path);
 
-    // setup orb slam object
-    orb_slam3_system_ = std::make_shared<ORB_SLAM3::System>(
-      vocabulary_file_path, settings_file_path, sensor_type, use_pangolin, 0);
-
     // create publishers
     live_point_cloud_publisher_ =
       create_publisher<sensor_msgs::msg::PointCloud2>("live_point_cloud", 10);
@@ -105,19 +262,56 @@ public:
     odom_publisher_ = create_publisher<nav_msgs::msg::Odometry>("orb_odom", 10);
     orb_image_publisher_ =
       create_publisher<sensor_msgs::msg::Image>("/camera/pretty", 10);
+    diagnostics_publisher_ =
+      create_publisher<diagnostic_msgs::msg::DiagnosticArray>("/diagnostics",
+                                                              10);
 
     // create subscriptions
     rclcpp::QoS sensor_qos(
       rclcpp::QoSInitialization::from_rmw(rmw_qos_profile_sensor_data),
       rmw_qos_profile_sensor_data);
-    image_sub = create_subscription<sensor_msgs::msg::Image>(
-      "camera/infra1/image_rect_raw", sensor_qos,
-      std::bind(&ImuMonoRealSense::image_callback, this, _1), image_options);
+    if (stereo_) {
+      // left and right are paired by stamp and handed on as shared
+      // messages, the pixels are never copied
+      stereo_sync_ = std::make_unique<
+        orb_slam3_ros2::StereoSync<sensor_msgs::msg::Image::ConstSharedPtr>>(
+        get_parameter("stereo_sync_tolerance").as_double(),
+        frame_queue_size_,
+        [this](sensor_msgs::msg::Image::ConstSharedPtr left,
+               sensor_msgs::msg::Image::ConstSharedPtr right) {
+          enqueue_frame(CameraFrame{std::move(left), std::move(right)});
+        });
+      image_sub = create_subscription<sensor_msgs::msg::Image>(
+        "camera/infra1/image_rect_raw", sensor_qos,
+        std::bind(&ImuMonoRealSense::left_image_callback, this, _1),
+        image_options);
+      right_image_sub = create_subscription<sensor_msgs::msg::Image>(
+        "camera/infra2/image_rect_raw", sensor_qos,
+        std::bind(&ImuMonoRealSense::right_image_callback, this, _1),
+        image_options);
+    } else {
+      image_sub = create_subscription<sensor_msgs::msg::Image>(
+        "camera/infra1/image_rect_raw", sensor_qos,
+        std::bind(&ImuMonoRealSense::image_callback, this, _1),
+        image_options);
+    }
 
     imu_sub = create_subscription<sensor_msgs::msg::Imu>(
       "camera/imu", sensor_qos,
       std::bind(&ImuMonoRealSense::imu_callback, this, _1), imu_options);
 
+    // create services
+    localization_mode_service_ = create_service<std_srvs::srv::SetBool>(
+      "localization_mode",
+      std::bind(&ImuMonoRealSense::localization_mode_callback, this,
+                std::placeholders::_1, std::placeholders::_2),
+      rclcpp::ServicesQoS(), slam_service_callback_group_);
+    save_snapshot_service_ = create_service<std_srvs::srv::Trigger>(
+      "save_snapshot",
+      std::bind(&ImuMonoRealSense::save_snapshot_callback, this,
+                std::placeholders::_1, std::placeholders::_2),
+      rclcpp::ServicesQoS(), slam_service_callback_group_);
+
     // tf broadcaster
     tf_broadcaster = std::make_unique<tf2_ros::TransformBroadcaster>(*this);
 
@@ -125,14 +319,59 @@ public:
     timer = create_wall_timer(
       100ms, std::bind(&ImuMonoRealSense::timer_callback, this),
       timer_callback_group_);
+    diagnostics_timer_ = create_wall_timer(
+      1s, std::bind(&ImuMonoRealSense::diagnostics_callback, this),
+      timer_callback_group_);
 
     timestamp_ = generate_timestamp_string();
 
     std::string path = std::string(PROJECT_PATH) + "/output/" + timestamp_;
     if (!std::filesystem::create_directory(path)) {
-      std::cout << "Failed to create output directory" << std::endl;
-      return;
+      throw std::runtime_error("Failed to create output directory " + path);
+    }
+
+    std::string orb_slam_video_path = std::string(PROJECT_PATH) + "/output/" +
+                                      timestamp_ + "/video/" + timestamp_ +
+                                      ".mp4";
+    if (get_parameter("record_video").as_bool()) {
+      RCLCPP_INFO_STREAM(get_logger(), "Video path: " << orb_slam_video_path);
+      // the writer does not create directories
+      std::filesystem::create_directories(path + "/video");
+      video_encoder_ = std::make_unique<orb_slam3_ros2::AsyncVideoEncoder>(
+        orb_slam_video_path, cv::VideoWriter::fourcc('m', 'p', '4', 'v'), 30,
+        cv::Size(640, 500),
+        std::max<int64_t>(1, get_parameter("video_queue_size").as_int()));
+      if (!video_encoder_->is_open()) {
+        throw std::runtime_error("Error opening video writer " +
+                                 orb_slam_video_path);
+      }
+      video_encoder_->set_tracer(&tracer_, stage_video_encode_);
+    }
+
+    // latency histograms of each stage on /diagnostics, and optionally
+    // every span as a Chrome trace in the output directory
+    bool trace_file = get_parameter("trace_file").as_bool();
+    tracer_.set_enabled(trace_file || get_parameter("trace_stages").as_bool());
+    if (trace_file && !tracer_.open_trace(path + "/trace.json")) {
+      RCLCPP_WARN(get_logger(), "Failed to open the trace file");
+    }
+
+    // what changed in the map is journaled every checkpoint_period, so a
+    // crash loses at most that much; session_recover rebuilds the outputs
+    double checkpoint_period = get_parameter("checkpoint_period").as_double();
+    checkpoint_sync_every_ =
+      std::max<int64_t>(1, get_parameter("checkpoint_sync_every").as_int());
+    if (checkpoint_period > 0.0) {
+      if (checkpoint_.open(path + "/checkpoint.journal",
+                           occupancy_grid_.params())) {
+        checkpoint_thread_ =
+          std::thread(&ImuMonoRealSense::checkpoint_loop, this,
+                      std::chrono::duration<double>(checkpoint_period));
+      } else {
+        RCLCPP_WARN(get_logger(), "Failed to open the checkpoint journal");
+      }
     }
+
     // if (!std::filesystem::create_directory(path + "/cloud")) {
     //   std::cout << "Failed to create cloud directory" << std::endl;
     //   return;
@@ -146,117 +385,248 @@ public:
     //   return;
     // }
 
-    rclcpp::on_shutdown([this]() {
-      video_writer_.release();
-      pcl::io::savePCDFileBinary(std::string(PROJECT_PATH) + "/output/" +
-                                   timestamp_ + "/cloud/" + timestamp_ + ".pcd",
-                                 live_pcl_cloud_);
-      nav2_map_server::SaveParameters save_params;
-      save_params.map_file_name = std::string(PROJECT_PATH) + "/output/" +
-                                  timestamp_ + "/grid/" + timestamp_;
-      save_params.image_format = "pgm";
-      save_params.free_thresh = 0.196;
-      save_params.occupied_thresh = 0.65;
-      nav2_map_server::saveMapToFile(*live_occupancy_grid_, save_params);
-    });
+    // the session is saved when the context shuts down, or when the node is
+    // unloaded from a component container before that
+    shutdown_callback_ =
+      get_node_base_interface()->get_context()->add_on_shutdown_callback(
+        [this]() { save_session(); });
 
     initialize_variables();
 
-    std::string orb_slam_video_path = std::string(PROJECT_PATH) + "/output/" +
-                                      timestamp_ + "/video/" + timestamp_ +
-                                      ".mp4";
-    RCLCPP_INFO_STREAM(get_logger(), "Video path: " << orb_slam_video_path);
-    video_writer_.open(orb_slam_video_path,
-                       cv::VideoWriter::fourcc('m', 'p', '4', 'v'), 30,
-                       cv::Size(640, 500));
+    // Setup orb slam object. Every configuration error has been thrown by
+    // now. Parsing the vocabulary dominates startup, so it runs in the
+    // background and the tracking thread picks the system up before its
+    // first frame; frames arriving meanwhile wait in the frame ring.
+    system_future_ = std::async(
+      std::launch::async,
+      [vocabulary = vocabulary_file_path, settings = settings_file_path,
+       sensor = sensor_type, pangolin = use_pangolin]() {
+        return std::make_shared<ORB_SLAM3::System>(vocabulary, settings,
+                                                   sensor, pangolin, 0);
+      });
+
+    // frames are tracked on their own thread so a slow frame never holds up
+    // the imu and timer callbacks
+    tracking_thread_ = std::thread(&ImuMonoRealSense::tracking_loop, this);
+  }
 
-    if (!video_writer_.isOpened()) {
-      RCLCPP_ERROR(get_logger(), "Error opening video writer");
-      rclcpp::shutdown();
+  ~ImuMonoRealSense()
+  {
+    if (shutdown_callback_) {
+      get_node_base_interface()->get_context()->remove_on_shutdown_callback(
+        *shutdown_callback_);
+      save_session();
     }
+    stop_tracking_thread();
+    stop_checkpoint_thread();
   }
 
 private:
-  pcl::PointCloud<pcl::PointXYZ>::Ptr
-  filter_point_cloud(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud)
-  {
-    // statistical outlier removal
-    pcl::PointCloud<pcl::PointXYZ>::Ptr sor_cloud(
-      new pcl::PointCloud<pcl::PointXYZ>);
-    pcl::StatisticalOutlierRemoval<pcl::PointXYZ> sor;
-    sor.setInputCloud(cloud);
-    sor.setMeanK(100);
-    sor.setStddevMulThresh(0.1);
-    sor.filter(*sor_cloud);
-
-    // radius outlier removal
-    pcl::PointCloud<pcl::PointXYZ>::Ptr radius_cloud(
-      new pcl::PointCloud<pcl::PointXYZ>);
-    pcl::RadiusOutlierRemoval<pcl::PointXYZ> radius_outlier;
-    radius_outlier.setInputCloud(sor_cloud);
-    radius_outlier.setRadiusSearch(
-      0.1); // Adjust based on spacing in the point cloud
-    radius_outlier.setMinNeighborsInRadius(
-      5); // Increase for more aggressive outlier removal
-    radius_outlier.filter(*radius_cloud);
-
-    return radius_cloud;
-  }
-
-  nav_msgs::msg::OccupancyGrid::SharedPtr
-  point_cloud_to_occupancy_grid(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud)
-  {
-    // calculate the centroid
-    Eigen::Matrix<float, 4, 1> centroid;
-    pcl::ConstCloudIterator<pcl::PointXYZ> cloud_iterator(*cloud);
-    pcl::compute3DCentroid(cloud_iterator, centroid);
-
-    float max_x = -std::numeric_limits<float>::infinity();
-    float max_y = -std::numeric_limits<float>::infinity();
-    float min_x = std::numeric_limits<float>::infinity();
-    float min_y = std::numeric_limits<float>::infinity();
-
-    for (const auto &point : cloud->points) {
-      if (point.x > max_x) {
-        max_x = point.x;
-      }
-      if (point.y > max_y) {
-        max_y = point.y;
+  void save_session()
+  {
+    if (session_saved_.exchange(true)) {
+      return;
+    }
+    stop_tracking_thread();
+    // the feed only approximates the map while tracking, so it is brought
+    // in line with the whole map before the cloud is saved from it
+    if (orb_slam3_system_) {
+      map_harvester_.full_read();
+    }
+    save_atlas();
+    if (video_encoder_) {
+      video_encoder_->close();
+    }
+    tracer_.close_trace();
+    {
+      // session_saved_ is set, so no new snapshot starts after this one
+      std::lock_guard<std::mutex> lock(snapshot_mutex_);
+      if (snapshot_writer_.valid()) {
+        snapshot_writer_.wait();
       }
-      if (point.x < min_x) {
-        min_x = point.x;
+    }
+
+    // the journal already holds everything up to the last checkpoint, so
+    // only the changes since then are left to write
+    std::string path = std::string(PROJECT_PATH) + "/output/" + timestamp_;
+    save_tuned_settings(path);
+    stop_checkpoint_thread();
+    if (checkpoint_.is_open()) {
+      write_checkpoint(true);
+      checkpoint_.close();
+      if (!get_parameter("compact_on_shutdown").as_bool()) {
+        RCLCPP_INFO_STREAM(get_logger(), "Session journaled, run "
+                                         "session_recover "
+                                           << path << " to write it out");
+        return;
       }
-      if (point.y < min_y) {
-        min_y = point.y;
+    }
+    MapSnapshot snapshot = take_snapshot();
+    if (write_snapshot(snapshot, path, timestamp_)) {
+      std::filesystem::remove(path + "/checkpoint.journal");
+    }
+  }
+
+  // Everything a snapshot saves. The cloud and grid share their chunks and
+  // tiles with the live ones and the trajectory its finished chunks, so
+  // nothing is copied while the live map is locked.
+  struct MapSnapshot {
+    orb_slam3_ros2::LiveMapCloud::Snapshot cloud;
+    orb_slam3_ros2::TiledOccupancyGrid grid;
+    orb_slam3_ros2::PoseHistory::Snapshot poses;
+  };
+
+  MapSnapshot take_snapshot()
+  {
+    apply_map_changes();
+    MapSnapshot snapshot;
+    {
+      std::lock_guard<std::mutex> lock(live_map_mutex_);
+      snapshot.cloud = live_cloud_.snapshot();
+      snapshot.grid = occupancy_grid_;
+    }
+    snapshot.poses = pose_history_.snapshot();
+    return snapshot;
+  }
+
+  // Writes cloud/<name>.pcd, grid/<name>.{pgm,yaml} and
+  // poses/<name>_tum.txt under `directory`.
+  bool write_snapshot(const MapSnapshot &snapshot,
+                      const std::string &directory, const std::string &name)
+  {
+    for (const char *subdirectory : {"/cloud", "/grid", "/poses"}) {
+      std::filesystem::create_directories(directory + subdirectory);
+    }
+    sensor_msgs::msg::PointCloud2 cloud_msg;
+    snapshot.cloud.to_msg(cloud_msg);
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    pcl::fromROSMsg(cloud_msg, cloud);
+    bool ok = cloud.empty() ||
+              pcl::io::savePCDFileBinary(
+                directory + "/cloud/" + name + ".pcd", cloud) == 0;
+
+    nav_msgs::msg::OccupancyGrid grid;
+    grid.header.frame_id = "live_map";
+    snapshot.grid.to_msg(grid);
+    nav2_map_server::SaveParameters save_params;
+    save_params.map_file_name = directory + "/grid/" + name;
+    save_params.image_format = "pgm";
+    save_params.free_thresh = 0.196;
+    save_params.occupied_thresh = 0.65;
+    ok = (snapshot.grid.tile_count() == 0 ||
+          nav2_map_server::saveMapToFile(grid, save_params)) &&
+         ok;
+
+    orb_slam3_ros2::TrajectoryLog trajectory(directory + "/poses/" + name,
+                                             {"tum"});
+    snapshot.poses.for_each([&](const orb_slam3_ros2::StampedPose &pose) {
+      trajectory.append(pose.stamp, pose.Twc);
+    });
+    return ok;
+  }
+
+  // Appends the map point changes, poses and grid tiles since the previous
+  // checkpoint to the journal.
+  void write_checkpoint(bool sync)
+  {
+    std::vector<orb_slam3_ros2::MapPointDelta> deltas;
+    if (!map_feed_.changes_since(checkpoint_version_, deltas,
+                                 checkpoint_version_)) {
+      checkpoint_.reset_points();
+      checkpoint_version_ = map_feed_.snapshot(deltas);
+    }
+    checkpoint_.add_points(deltas);
+
+    orb_slam3_ros2::PoseHistory::Snapshot poses = pose_history_.snapshot();
+    checkpoint_.add_poses(poses, checkpoint_poses_);
+    checkpoint_poses_ = poses.size();
+
+    // the tiles are shared with the live grid, not copied
+    std::vector<std::shared_ptr<const orb_slam3_ros2::TiledOccupancyGrid::Tile>>
+      tiles;
+    {
+      std::lock_guard<std::mutex> lock(live_map_mutex_);
+      if (occupancy_grid_.generation() != checkpoint_grid_generation_) {
+        checkpoint_.reset_grid();
+        checkpoint_grid_generation_ = occupancy_grid_.generation();
       }
+      occupancy_grid_.take_dirty_tiles(tiles);
+    }
+    for (const auto &tile : tiles) {
+      checkpoint_.add_tile(*tile);
+    }
+    if (!checkpoint_.commit(sync)) {
+      RCLCPP_WARN(get_logger(), "Failed to write a checkpoint");
+    }
+  }
+
+  // fdatasync only every checkpoint_sync_every_ checkpoints
+  void checkpoint_loop(std::chrono::duration<double> period)
+  {
+    uint64_t count = 0;
+    std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+    while (!checkpoint_cv_.wait_for(lock, period,
+                                    [this] { return stop_checkpoint_; })) {
+      lock.unlock();
+      write_checkpoint(++count % checkpoint_sync_every_ == 0);
+      lock.lock();
+    }
+  }
+
+  void stop_checkpoint_thread()
+  {
+    {
+      std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+      stop_checkpoint_ = true;
+    }
+    checkpoint_cv_.notify_one();
+    if (checkpoint_thread_.joinable()) {
+      checkpoint_thread_.join();
     }
+  }
 
-    nav_msgs::msg::OccupancyGrid::SharedPtr occupancy_grid =
-      std::make_shared<nav_msgs::msg::OccupancyGrid>();
-    cloud->width = cloud->points.size();
-    occupancy_grid->header.frame_id = "live_map";
-    occupancy_grid->header.stamp = get_clock()->now();
-    occupancy_grid->info.resolution = 0.05;
-    occupancy_grid->info.width =
-      std::abs(max_x - min_x) / occupancy_grid->info.resolution + 1;
-    occupancy_grid->info.height =
-      std::abs(max_y - min_y) / occupancy_grid->info.resolution + 1;
-    occupancy_grid->info.origin.position.x = min_x;
-    occupancy_grid->info.origin.position.y = min_y;
-    occupancy_grid->info.origin.position.z = 0;
-    occupancy_grid->info.origin.orientation.x = 0;
-    occupancy_grid->info.origin.orientation.y = 0;
-    occupancy_grid->info.origin.orientation.z = 0;
-    occupancy_grid->info.origin.orientation.w = 1;
-    occupancy_grid->data.resize(
-      occupancy_grid->info.width * occupancy_grid->info.height, 0);
-    for (const auto &point : cloud->points) {
-      int x = (point.x - min_x) / occupancy_grid->info.resolution;
-      int y = (point.y - min_y) / occupancy_grid->info.resolution;
-      int index = y * occupancy_grid->info.width + x;
-      occupancy_grid->data.at(index) = 100;
-    }
-    return occupancy_grid;
+  // Captures the map and writes it on a background thread, so tracking and
+  // the live map carry on while it is saved. One snapshot is written at a
+  // time; a request while one is still being written is refused.
+  void save_snapshot_callback(
+    const std::shared_ptr<std_srvs::srv::Trigger::Request>,
+    std::shared_ptr<std_srvs::srv::Trigger::Response> response)
+  {
+    std::lock_guard<std::mutex> lock(snapshot_mutex_);
+    if (session_saved_.load()) {
+      response->success = false;
+      response->message = "The session is being saved";
+      return;
+    }
+    if (snapshot_writer_.valid() &&
+        snapshot_writer_.wait_for(0s) != std::future_status::ready) {
+      response->success = false;
+      response->message = "A snapshot is still being written";
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto snapshot = std::make_shared<MapSnapshot>(take_snapshot());
+    double capture_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+    std::string directory =
+      std::string(PROJECT_PATH) + "/output/" + timestamp_ + "/snapshots";
+    std::string name = "snapshot_" + std::to_string(++snapshot_count_);
+    snapshot_writer_ =
+      std::async(std::launch::async, [this, snapshot, directory, name]() {
+        if (write_snapshot(*snapshot, directory, name)) {
+          RCLCPP_INFO_STREAM(get_logger(), "Saved " << name);
+        } else {
+          RCLCPP_WARN_STREAM(get_logger(), "Failed to save " << name);
+        }
+      });
+    response->success = true;
+    response->message = "Saving " + name + " to " + directory;
+    RCLCPP_INFO_STREAM(get_logger(), "Captured "
+                                       << name << " in " << capture_ms
+                                       << " ms, " << snapshot->poses.size()
+                                       << " poses");
   }
 
   void initialize_variables()
@@ -264,9 +634,6 @@ private:
     pose_array_ = geometry_msgs::msg::PoseArray();
     pose_array_.header.frame_id = "live_map";
 
-    live_pcl_cloud_msg_ = sensor_msgs::msg::PointCloud2();
-    live_pcl_cloud_msg_.header.frame_id = "live_map";
-
     live_occupancy_grid_ = std::make_shared<nav_msgs::msg::OccupancyGrid>();
   }
 
@@ -282,116 +649,638 @@ private:
     return oss.str();
   }
 
-  cv::Mat get_image(const sensor_msgs::msg::Image::SharedPtr msg)
+  // A mono8 image is wrapped, not copied: the frame holds the message until
+  // tracking is done with it, and orbslam3 copies whatever it keeps.
+  cv::Mat get_image(const sensor_msgs::msg::Image::ConstSharedPtr &msg)
   {
-    cv_bridge::CvImageConstPtr cv_ptr;
-
     try {
-      cv_ptr = cv_bridge::toCvShare(msg, sensor_msgs::image_encodings::MONO8);
+      return cv_bridge::toCvShare(msg, sensor_msgs::image_encodings::MONO8)
+        ->image;
     } catch (cv_bridge::Exception &e) {
       RCLCPP_ERROR(get_logger(), "cv_bridge exception: %s", e.what());
+      return cv::Mat();
     }
+  }
 
-    if (cv_ptr->image.type() == 0) {
-      return cv_ptr->image.clone();
+  // Points orbslam3 at the saved atlas through a copy of the settings. An
+  // atlas that would not load is caught here, since orbslam3 exits on it.
+  void setup_atlas()
+  {
+    if (!orb_slam3_ros2::parse_atlas_mode(
+          get_parameter("atlas_mode").as_string(), atlas_mode_)) {
+      RCLCPP_WARN(get_logger(), "Unknown atlas_mode, not saving the atlas");
+    }
+    if (atlas_mode_ == orb_slam3_ros2::AtlasMode::Off) {
+      return;
+    }
+    std::string directory = std::string(PROJECT_PATH) + "/maps";
+    std::filesystem::create_directories(directory);
+    atlas_store_ = std::make_unique<orb_slam3_ros2::AtlasStore>(
+      directory, get_parameter("atlas_name").as_string());
+
+    bool load = atlas_mode_ != orb_slam3_ros2::AtlasMode::Map;
+    if (load && !atlas_store_->check(sensor_type, vocabulary_file_path)) {
+      if (atlas_mode_ == orb_slam3_ros2::AtlasMode::Localize) {
+        throw std::runtime_error("Cannot localize in " +
+                                 atlas_store_->atlas_path() + ": " +
+                                 atlas_store_->error());
+      }
+      RCLCPP_WARN_STREAM(get_logger(), "Starting a new atlas, "
+                                         << atlas_store_->error());
+      load = false;
+    }
+    bool save = atlas_mode_ != orb_slam3_ros2::AtlasMode::Localize;
+    std::string atlas_settings_path =
+      (std::filesystem::temp_directory_path() /
+       ("orb_slam3_atlas_" + std::to_string(getpid()) + ".yaml"))
+        .string();
+    if (!atlas_store_->write_settings(settings_file_path, atlas_settings_path,
+                                      load, save)) {
+      throw std::runtime_error("Error writing " + atlas_settings_path);
+    }
+    settings_file_path = atlas_settings_path;
+    temp_settings_paths_.push_back(atlas_settings_path);
+    RCLCPP_INFO_STREAM(get_logger(),
+                       (load ? "Loading " : "Creating ")
+                         << atlas_store_->atlas_path());
+  }
+
+  // orbslam3 only writes the atlas from Shutdown()
+  void save_atlas()
+  {
+    if (!atlas_store_ || !orb_slam3_system_ ||
+        atlas_mode_ == orb_slam3_ros2::AtlasMode::Localize) {
+      return;
+    }
+    orb_slam3_system_->Shutdown();
+    if (atlas_store_->commit(sensor_type, vocabulary_file_path)) {
+      RCLCPP_INFO_STREAM(get_logger(),
+                         "Saved atlas " << atlas_store_->atlas_path());
     } else {
-      std::cerr << "Error image type" << std::endl;
-      return cv_ptr->image.clone();
+      RCLCPP_ERROR_STREAM(get_logger(), "Error saving the atlas: "
+                                          << atlas_store_->error());
+    }
+  }
+
+  // The feature budget, pyramid depth and image scale in the settings are
+  // the upper bounds of what the controller recommends.
+  void setup_quality_controller()
+  {
+    orb_slam3_ros2::QualitySettings running;
+    if (!running.load(base_settings_path_)) {
+      RCLCPP_WARN_STREAM(get_logger(), "Cannot read the quality settings of "
+                                         << base_settings_path_
+                                         << ", adaptive_quality disabled");
+      return;
+    }
+    orb_slam3_ros2::QualitySettings min;
+    min.features = get_parameter("quality_min_features").as_int();
+    min.levels = get_parameter("quality_min_levels").as_int();
+    min.scale = get_parameter("quality_min_scale").as_double();
+    quality_controller_ = std::make_unique<orb_slam3_ros2::QualityController>(
+      running, min, get_parameter("target_latency_ms").as_double());
+  }
+
+  void update_quality(double latency_ms)
+  {
+    if (!quality_controller_->add(latency_ms)) {
+      return;
+    }
+    orb_slam3_ros2::QualityController::Status quality =
+      quality_controller_->status();
+    RCLCPP_INFO(get_logger(),
+                "Tracking p90 %.1f ms against %.1f ms, recommending %d "
+                "features, %d levels, image scale %.2f for the next run",
+                quality.window_p90_ms, quality_controller_->deadline_ms(),
+                quality.recommended.features, quality.recommended.levels,
+                quality.recommended.scale);
+  }
+
+  // ORB_SLAM3 cannot be retuned while it runs, so the recommendation is
+  // saved as a settings file to start the next session from
+  void save_tuned_settings(const std::string &directory)
+  {
+    if (!quality_controller_ || quality_controller_->status().windows == 0) {
+      return;
+    }
+    std::string path = directory + "/tuned_settings.yaml";
+    if (quality_controller_->status().recommended.write(base_settings_path_,
+                                                        path)) {
+      RCLCPP_INFO_STREAM(get_logger(), "Tuned settings saved, start with "
+                                       "settings_file:="
+                                         << path);
+    } else {
+      RCLCPP_WARN_STREAM(get_logger(), "Failed to write " << path);
+    }
+  }
+
+  void setup_rectification()
+  {
+    if (!camera_model_.load(settings_file_path)) {
+      throw std::runtime_error("Error loading camera model: " +
+                               camera_model_.error());
+    }
+    camera_model_.init_rectification(
+      get_parameter("rectify_balance").as_double());
+    std::string rectified_path =
+      (std::filesystem::temp_directory_path() /
+       ("orb_slam3_rectified_" + std::to_string(getpid()) + ".yaml"))
+        .string();
+    if (!camera_model_.write_rectified_settings(settings_file_path,
+                                                rectified_path)) {
+      throw std::runtime_error("Error writing " + rectified_path);
     }
+    settings_file_path = rectified_path;
+    temp_settings_paths_.push_back(rectified_path);
+    std::size_t threads = std::clamp<int64_t>(
+      get_parameter("rectify_threads").as_int(), 1,
+      std::max(1u, std::thread::hardware_concurrency()));
+    rectify_pool_ = std::make_unique<orb_slam3_ros2::RectifyPool>(
+      camera_model_, threads, frame_queue_size_,
+      [this](std::unique_ptr<sensor_msgs::msg::Image> msg) {
+        enqueue_frame(CameraFrame{std::move(msg), nullptr});
+      });
+    rectify_pool_->set_tracer(&tracer_, stage_rectify_);
   }
 
-  void image_callback(const sensor_msgs::msg::Image::SharedPtr msg)
+  void image_callback(sensor_msgs::msg::Image::ConstSharedPtr msg)
   {
-    rclcpp::Time time_now = get_clock()->now();
+    if (rectify_pool_) {
+      rectify_pool_->submit(std::move(msg));
+      return;
+    }
+    enqueue_frame(CameraFrame{std::move(msg), nullptr});
+  }
 
-    img_buf_.push(msg);
+  static double stamp_of(const sensor_msgs::msg::Image &msg)
+  {
+    return msg.header.stamp.sec + msg.header.stamp.nanosec * 1e-9;
+  }
 
-    // begin to empty the img_buf_ queue, which is full of other queues
-    while (!img_buf_.empty()) {
-      // grab the oldest image
-      auto imgPtr = img_buf_.front();
-      img_buf_.pop();
+  void left_image_callback(sensor_msgs::msg::Image::ConstSharedPtr msg)
+  {
+    std::lock_guard<std::mutex> lock(stereo_sync_mutex_);
+    stereo_sync_->add_left(stamp_of(*msg), std::move(msg));
+  }
+
+  void right_image_callback(sensor_msgs::msg::Image::ConstSharedPtr msg)
+  {
+    std::lock_guard<std::mutex> lock(stereo_sync_mutex_);
+    stereo_sync_->add_right(stamp_of(*msg), std::move(msg));
+  }
 
-      cv::Mat imageFrame = get_image(imgPtr);
-      double tImage =
-        imgPtr->header.stamp.sec + imgPtr->header.stamp.nanosec * 1e-9;
+  void enqueue_frame(CameraFrame frame)
+  {
+    frame_ring_->push(std::move(frame));
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex_);
+    }
+    frame_cv_.notify_one();
+  }
 
-      vector<ORB_SLAM3::IMU::Point> vImuMeas;
+  // Frames that arrive while orbslam3 is still loading wait in the frame
+  // ring, which keeps only the newest of them.
+  void wait_for_system()
+  {
+    std::shared_ptr<ORB_SLAM3::System> system = system_future_.get();
+    // orbslam3 reads its settings only while it is constructed
+    for (const std::string &path : temp_settings_paths_) {
+      std::error_code ec;
+      std::filesystem::remove(path, ec);
+    }
+    {
+      std::lock_guard<std::mutex> lock(localization_mutex_);
+      orb_slam3_system_ = system;
+      if (localization_only_.load()) {
+        orb_slam3_system_->ActivateLocalizationMode();
+      }
+    }
+    image_scale_ = system->GetImageScale();
+    system_ready_.store(true);
+    RCLCPP_INFO_STREAM(
+      get_logger(),
+      "ORB_SLAM3 ready after "
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_time_)
+             .count()
+        << " s");
+  }
 
-      // package all the imu data for this image for orbslam3 to process
-      buf_mutex_imu_.lock();
-      while (!imu_buf_.empty()) {
-        auto imuPtr = imu_buf_.front();
-        imu_buf_.pop();
-        double tIMU =
-          imuPtr->header.stamp.sec + imuPtr->header.stamp.nanosec * 1e-9;
+  // Tracking only stops the local mapping thread and keyframe insertion
+  // inside orbslam3 at the next frame; loop closing then has nothing to do.
+  void localization_mode_callback(
+    const std::shared_ptr<std_srvs::srv::SetBool::Request> request,
+    std::shared_ptr<std_srvs::srv::SetBool::Response> response)
+  {
+    std::lock_guard<std::mutex> lock(localization_mutex_);
+    localization_only_.store(request->data);
+    response->success = true;
+    response->message = request->data ? "Tracking only" : "Full SLAM";
+    if (!orb_slam3_system_) {
+      response->message += ", once ORB_SLAM3 has loaded";
+    } else if (request->data) {
+      orb_slam3_system_->ActivateLocalizationMode();
+    } else {
+      orb_slam3_system_->DeactivateLocalizationMode();
+    }
+    RCLCPP_INFO_STREAM(get_logger(), response->message);
+  }
 
-        cv::Point3f acc(imuPtr->linear_acceleration.x,
-                        imuPtr->linear_acceleration.y,
-                        imuPtr->linear_acceleration.z);
-        cv::Point3f gyr(imuPtr->angular_velocity.x, imuPtr->angular_velocity.y,
-                        imuPtr->angular_velocity.z);
-        vImuMeas.push_back(ORB_SLAM3::IMU::Point(acc, gyr, tIMU));
+  void tracking_loop()
+  {
+    wait_for_system();
+    CameraFrame frame;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(frame_mutex_);
+        frame_cv_.wait(lock, [this] {
+          return stop_tracking_ || !frame_ring_->empty();
+        });
+        if (stop_tracking_) {
+          return;
+        }
       }
 
-      buf_mutex_imu_.unlock();
+      while (frame_ring_->pop(frame, drop_policy_)) {
+        if (schedule_frame(frame) && track_frame(frame)) {
+          frames_tracked_++;
+        }
+        frame = CameraFrame();
+      }
+    }
+  }
 
-      if (vImuMeas.empty() && sensor_type_param == "imu-monocular") {
-        RCLCPP_WARN(get_logger(),
-                    "No valid IMU data available for the current frame "
-                    "at time %.6f.",
-                    tImage);
-        return;
+  // the frame drawer image is only rendered if something consumes it
+  void publish_pretty_frame(const std_msgs::msg::Header &header)
+  {
+    bool publish = orb_image_publisher_->get_subscription_count() > 0;
+    if (!video_encoder_ && !publish) {
+      return;
+    }
+
+    cv::Mat pretty_frame;
+    {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_frame_drawer_);
+      pretty_frame = orb_slam3_system_->GetFrameDrawerImage();
+    }
+    if (video_encoder_) {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_video_submit_);
+      video_encoder_->submit(pretty_frame);
+    }
+    if (publish) {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_publish_pretty_);
+      orb_image_publisher_->publish(
+        *cv_bridge::CvImage(header, sensor_msgs::image_encodings::BGR8,
+                            pretty_frame)
+           .toImageMsg());
+    }
+  }
+
+  void stop_tracking_thread()
+  {
+    // the pool feeds the tracking thread, so it stops first
+    if (rectify_pool_) {
+      rectify_pool_->close();
+    }
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex_);
+      stop_tracking_ = true;
+    }
+    frame_cv_.notify_one();
+    if (tracking_thread_.joinable()) {
+      tracking_thread_.join();
+    }
+  }
+
+  // Collects the frame's imu samples and decides whether it is tracked. The
+  // samples of a skipped frame stay in vImuMeas_ and go to orbslam3 with
+  // the next tracked frame.
+  bool schedule_frame(const CameraFrame &frame)
+  {
+    double tImage = stamp_of(*frame.image);
+    {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_imu_slice_);
+      std::lock_guard<std::mutex> lock(buf_mutex_imu_);
+      imu_buffer_->slice(tImage, [this](double t, float ax, float ay,
+                                        float az, float gx, float gy,
+                                        float gz) {
+        vImuMeas_.emplace_back(ax, ay, az, gx, gy, gz, t);
+      });
+    }
+    if (!frame_scheduler_->enabled()) {
+      return true;
+    }
+    double since_tracked = last_tracked_stamp_ < 0.0
+                             ? std::numeric_limits<double>::infinity()
+                             : tImage - last_tracked_stamp_;
+    return frame_scheduler_->should_track(
+      frame_ring_->size(), since_tracked,
+      orb_slam3_ros2::FrameScheduler::rotation(vImuMeas_));
+  }
+
+  // returns false if the frame never reached orbslam3
+  bool track_frame(const CameraFrame &frame)
+  {
+    const sensor_msgs::msg::Image::ConstSharedPtr &imgPtr = frame.image;
+    cv::Mat imageFrame, rightFrame;
+    {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_get_image_);
+      imageFrame = get_image(imgPtr);
+      if (frame.right) {
+        rightFrame = get_image(frame.right);
       }
+    }
+    double tImage = stamp_of(*imgPtr);
+
+    // orbslam3 scales its calibration by Camera.imageScale but expects the
+    // caller to scale the images, into pooled buffers here
+    if (image_scale_ != 1.f && !imageFrame.empty()) {
+      cv::Size size(imageFrame.cols * image_scale_,
+                    imageFrame.rows * image_scale_);
+      if (!scaled_pool_ || scaled_pool_->size() != size) {
+        scaled_pool_ =
+          std::make_unique<orb_slam3_ros2::ImageBufferPool>(8, size, CV_8U);
+      }
+      cv::Mat scaled = scaled_pool_->acquire();
+      cv::resize(imageFrame, scaled, size);
+      imageFrame = scaled;
+      if (!rightFrame.empty()) {
+        cv::Mat scaled_right = scaled_pool_->acquire();
+        cv::resize(rightFrame, scaled_right, size);
+        rightFrame = scaled_right;
+      }
+    }
 
-      try {
-        if (sensor_type_param == "monocular") {
-          Tcw_ = orb_slam3_system_->TrackMonocular(imageFrame, tImage);
-        } else {
-          if (vImuMeas.size() > 1) {
-            Tcw_ =
-              orb_slam3_system_->TrackMonocular(imageFrame, tImage, vImuMeas);
-          }
+    // the imu data up to this image, collected by schedule_frame(). Samples
+    // newer than the image stay buffered for the next frame.
+    const vector<ORB_SLAM3::IMU::Point> &vImuMeas = vImuMeas_;
+
+    if (vImuMeas.empty() && inertial_) {
+      RCLCPP_WARN(get_logger(),
+                  "No valid IMU data available for the current frame "
+                  "at time %.6f.",
+                  tImage);
+      return false;
+    }
+
+    bool tracked = false;
+    try {
+      Sophus::SE3f Tcw;
+      auto track_start = std::chrono::steady_clock::now();
+      {
+        orb_slam3_ros2::ScopedTrace trace(tracer_, stage_track_);
+        // in stereo modes orbslam3 extracts the left and right features on
+        // two threads of its own
+        if (!inertial_) {
+          Tcw = stereo_ ? orb_slam3_system_->TrackStereo(imageFrame,
+                                                         rightFrame, tImage)
+                        : orb_slam3_system_->TrackMonocular(imageFrame, tImage);
+          tracked = true;
+        } else if (vImuMeas.size() > 1) {
+          Tcw = stereo_ ? orb_slam3_system_->TrackStereo(
+                            imageFrame, rightFrame, tImage, vImuMeas)
+                        : orb_slam3_system_->TrackMonocular(imageFrame, tImage,
+                                                            vImuMeas);
+          tracked = true;
+        }
+      }
+      if (tracked) {
+        double track_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - track_start)
+                            .count();
+        frame_scheduler_->add_latency(track_ms);
+        if (quality_controller_) {
+          update_quality(track_ms);
         }
-        cv::Mat pretty_frame = orb_slam3_system_->GetFrameDrawerImage();
-        video_writer_.write(pretty_frame);
+        // orbslam3 has the samples now; until then they are carried over
+        vImuMeas_.clear();
+        last_tracked_stamp_ = tImage;
+        {
+          std::lock_guard<std::mutex> lock(orbslam3_mutex_);
+          Tcw_ = Tcw;
+        }
+        pose_history_.append(tImage, Tcw.inverse().matrix());
+        orb_slam3_ros2::ScopedTrace trace(tracer_, stage_map_harvest_);
+        map_harvester_.harvest(*orb_slam3_system_, Tcw);
+      }
+      publish_pretty_frame(imgPtr->header);
 
-      } catch (const std::exception &e) {
-        RCLCPP_ERROR(get_logger(), "SLAM processing exception: %s", e.what());
+    } catch (const std::exception &e) {
+      RCLCPP_ERROR(get_logger(), "SLAM processing exception: %s", e.what());
+      vImuMeas_.clear();
+    }
+    return tracked;
+  }
+
+  // brings the live cloud and grid up to date with the map delta feed
+  void apply_map_changes()
+  {
+    std::lock_guard<std::mutex> lock(live_map_mutex_);
+    map_deltas_.clear();
+    if (!map_feed_.changes_since(map_version_, map_deltas_, map_version_)) {
+      // fell behind or the map was reset, start over from a snapshot
+      occupancy_grid_.clear();
+      live_cloud_.clear();
+      if (cloud_filter_) {
+        cloud_filter_->clear();
+      }
+      map_version_ = map_feed_.snapshot(map_deltas_);
+      for (const orb_slam3_ros2::MapPointDelta &delta : map_deltas_) {
+        const Eigen::Vector3f &pos = delta.position;
+        occupancy_grid_.add_point(pos.x(), pos.y(), pos.z());
+        live_cloud_.apply(delta);
+        if (cloud_filter_) {
+          cloud_filter_->apply(delta);
+        }
       }
+    } else {
+      for (const orb_slam3_ros2::MapPointDelta &delta : map_deltas_) {
+        apply_map_change(delta);
+      }
+    }
+
+    if (cloud_filter_) {
+      cloud_filter_->update();
+    }
+  }
+
+  void apply_map_change(const orb_slam3_ros2::MapPointDelta &delta)
+  {
+    const Eigen::Vector3f &pos = delta.position;
+    switch (delta.type) {
+    case orb_slam3_ros2::MapPointDelta::Type::Added:
+      occupancy_grid_.add_point(pos.x(), pos.y(), pos.z(), delta.observer.x(),
+                                delta.observer.y());
+      break;
+    case orb_slam3_ros2::MapPointDelta::Type::Moved:
+      occupancy_grid_.remove_point(delta.previous.x(), delta.previous.y(),
+                                   delta.previous.z());
+      occupancy_grid_.add_point(pos.x(), pos.y(), pos.z());
+      break;
+    case orb_slam3_ros2::MapPointDelta::Type::Updated:
+      break;
+    case orb_slam3_ros2::MapPointDelta::Type::Removed:
+      occupancy_grid_.remove_point(pos.x(), pos.y(), pos.z());
+      break;
+    }
+    live_cloud_.apply(delta);
+    if (cloud_filter_) {
+      cloud_filter_->apply(delta);
     }
   }
 
+  // publishes the live cloud (filtered, if enabled) as it is stored
+  void publish_live_cloud(const rclcpp::Time &stamp)
+  {
+    if (live_point_cloud_publisher_->get_subscription_count() == 0) {
+      return;
+    }
+
+    sensor_msgs::msg::PointCloud2 &cloud =
+      cloud_filter_ ? cloud_filter_->msg() : live_cloud_.msg();
+    cloud.header.stamp = stamp;
+    live_point_cloud_publisher_->publish(cloud);
+  }
+
   void imu_callback(const sensor_msgs::msg::Imu &msg)
   {
-    buf_mutex_imu_.lock();
-    sensor_msgs::msg::Imu msg_out = msg;
-    msg_out.header.stamp = get_clock()->now();
-    msg_out.header.frame_id = "base_link";
-    // imu_publisher_->publish(msg_out);
-    if (!std::isnan(msg.linear_acceleration.x) &&
-        !std::isnan(msg.linear_acceleration.y) &&
-        !std::isnan(msg.linear_acceleration.z) &&
-        !std::isnan(msg.angular_velocity.x) &&
-        !std::isnan(msg.angular_velocity.y) &&
-        !std::isnan(msg.angular_velocity.z)) {
-      const sensor_msgs::msg::Imu::SharedPtr msg_ptr =
-        std::make_shared<sensor_msgs::msg::Imu>(msg);
-      imu_buf_.push(msg_ptr);
-    } else {
+    if (std::isnan(msg.linear_acceleration.x) ||
+        std::isnan(msg.linear_acceleration.y) ||
+        std::isnan(msg.linear_acceleration.z) ||
+        std::isnan(msg.angular_velocity.x) ||
+        std::isnan(msg.angular_velocity.y) ||
+        std::isnan(msg.angular_velocity.z)) {
       RCLCPP_ERROR(get_logger(), "Invalid IMU data - nan");
+      return;
     }
-    buf_mutex_imu_.unlock();
+
+    double tIMU = msg.header.stamp.sec + msg.header.stamp.nanosec * 1e-9;
+    std::lock_guard<std::mutex> lock(buf_mutex_imu_);
+    imu_buffer_->push(tIMU, msg.linear_acceleration.x,
+                      msg.linear_acceleration.y, msg.linear_acceleration.z,
+                      msg.angular_velocity.x, msg.angular_velocity.y,
+                      msg.angular_velocity.z);
   }
 
-  void timer_callback()
+  void diagnostics_callback()
   {
-    unique_lock<mutex> lock(orbslam3_mutex_);
+    diagnostic_msgs::msg::DiagnosticStatus status = tracking_queue_status(
+      get_name(), *frame_ring_, drop_policy_, *frame_scheduler_,
+      frames_tracked_.load(), system_ready_.load(), last_reported_drops_);
+    add_value(status, "localization_only",
+              localization_only_.load() ? "true" : "false");
+    if (stereo_sync_) {
+      std::lock_guard<std::mutex> lock(stereo_sync_mutex_);
+      add_value(status, "stereo_pairs", std::to_string(stereo_sync_->paired()));
+      add_value(status, "stereo_unmatched",
+                std::to_string(stereo_sync_->unmatched()));
+    }
+    if (rectify_pool_) {
+      add_value(status, "frames_rectified",
+                std::to_string(rectify_pool_->rectified()));
+      add_value(status, "rectify_dropped",
+                std::to_string(rectify_pool_->dropped()));
+      add_value(status, "rectify_failed",
+                std::to_string(rectify_pool_->failed()));
+    }
+    {
+      std::lock_guard<std::mutex> lock(buf_mutex_imu_);
+      add_value(status, "imu_buffered", std::to_string(imu_buffer_->size()));
+      add_value(status, "imu_out_of_order",
+                std::to_string(imu_buffer_->out_of_order()));
+      add_value(status, "imu_overwritten",
+                std::to_string(imu_buffer_->overwritten()));
+    }
+    if (video_encoder_) {
+      add_value(status, "video_frames_encoded",
+                std::to_string(video_encoder_->frames_encoded()));
+      add_value(status, "video_frames_dropped",
+                std::to_string(video_encoder_->frames_dropped()));
+      add_value(status, "video_queue_depth",
+                std::to_string(video_encoder_->queue_depth()));
+      add_value(status, "video_mean_encode_ms",
+                std::to_string(video_encoder_->mean_encode_ms()));
+    }
+    add_value(status, "map_points", std::to_string(map_feed_.size()));
+    add_value(status, "map_version", std::to_string(map_feed_.version()));
+    if (cloud_filter_) {
+      std::lock_guard<std::mutex> lock(live_map_mutex_);
+      add_value(status, "filtered_points",
+                std::to_string(cloud_filter_->size()));
+      add_value(status, "filter_voxels",
+                std::to_string(cloud_filter_->voxel_count()));
+    }
+
+    diagnostic_msgs::msg::DiagnosticArray diagnostics;
+    diagnostics.header.stamp = get_clock()->now();
+    diagnostics.status.push_back(status);
+    if (tracer_.enabled()) {
+      diagnostics.status.push_back(
+        orb_slam3_ros2::stage_latency_status(tracer_, get_name()));
+    }
+    if (quality_controller_) {
+      diagnostics.status.push_back(quality_status());
+    }
+    diagnostics_publisher_->publish(diagnostics);
+  }
+
+  // what the quality controller measured and recommends
+  diagnostic_msgs::msg::DiagnosticStatus quality_status()
+  {
+    using Controller = orb_slam3_ros2::QualityController;
+    Controller::Status quality = quality_controller_->status();
+    diagnostic_msgs::msg::DiagnosticStatus status;
+    status.name = std::string(get_name()) + ": tracking quality";
+    status.hardware_id = "orb_slam3";
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+    status.message = "Running settings meet the deadline";
+    if (quality.decision == Controller::Decision::AtMinimum) {
+      status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+      status.message = "Misses the deadline even at the lowest settings, "
+                       "nothing was applied";
+    } else if (!(quality.recommended == quality.running)) {
+      status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+      status.message = "Recommends other settings for the next run, nothing "
+                       "was applied; see tuned_settings.yaml on shutdown";
+    }
+
+    add_value(status, "target_latency_ms",
+              std::to_string(quality_controller_->deadline_ms()));
+    add_value(status, "window_p90_ms", std::to_string(quality.window_p90_ms));
+    add_value(status, "predicted_p90_ms",
+              std::to_string(quality.predicted_p90_ms));
+    add_value(status, "windows", std::to_string(quality.windows));
+    add_value(status, "missed_windows", std::to_string(quality.missed_windows));
+    add_value(status, "recommended_change",
+              Controller::decision_name(quality.decision));
+    add_value(status, "running_features",
+              std::to_string(quality.running.features));
+    add_value(status, "running_levels",
+              std::to_string(quality.running.levels));
+    add_value(status, "running_image_scale",
+              std::to_string(quality.running.scale));
+    add_value(status, "recommended_features",
+              std::to_string(quality.recommended.features));
+    add_value(status, "recommended_levels",
+              std::to_string(quality.recommended.levels));
+    add_value(status, "recommended_image_scale",
+              std::to_string(quality.recommended.scale));
+    return status;
+  }
 
+  void timer_callback()
+  {
     geometry_msgs::msg::Pose pose;
+    if (!system_ready_.load()) {
+      return;
+    }
     if (!orb_slam3_system_->isShutDown()) {
       rclcpp::Time time_now = get_clock()->now();
-      auto Twc = Tcw_.inverse();
+      Sophus::SE3f Twc;
+      {
+        std::lock_guard<std::mutex> lock(orbslam3_mutex_);
+        Twc = Tcw_.inverse();
+      }
 
       geometry_msgs::msg::TransformStamped odom_tf;
       odom_tf.header.stamp = time_now;
@@ -431,28 +1320,24 @@ private:
       live_map_tf.child_frame_id = "live_map";
       tf_broadcaster->sendTransform(live_map_tf);
 
-      live_pcl_cloud_ = orb_slam3_system_->GetMapPCL();
-
-      // pcl::PointCloud<pcl::PointXYZ>::Ptr live_ptr =
-      //   std::make_shared<pcl::PointCloud<pcl::PointXYZ>>(live_pcl_cloud_);
-      //
-      // pcl::PointCloud<pcl::PointXYZ>::Ptr filtered_cloud_ptr(
-      //   new pcl::PointCloud<pcl::PointXYZ>);
-      // filtered_cloud_ptr = filter_point_cloud(live_ptr);
-      //
-      // filtered_cloud_ptr->width = filtered_cloud_ptr->points.size();
-      // pcl::toROSMsg(*filtered_cloud_ptr, live_pcl_cloud_msg_);
-
-      // this can go
-      // live_occupancy_grid_ =
-      // point_cloud_to_occupancy_grid(filtered_cloud_ptr);
-      // live_occupancy_grid_->header.stamp = time_now;
-      // live_occupancy_grid_->header.frame_id = "live_map";
-      // live_occupancy_grid_publisher_->publish(*live_occupancy_grid_);
-
-      // live_pcl_cloud_msg_.header.stamp = time_now;
-      // live_pcl_cloud_msg_.header.frame_id = "live_map";
-      // live_point_cloud_publisher_->publish(live_pcl_cloud_msg_);
+      apply_map_changes();
+
+      // the grid shares its tiles with the live one, so the message, which
+      // takes time in the grid's area, is built after the lock is released
+      std::optional<orb_slam3_ros2::TiledOccupancyGrid> grid;
+      {
+        std::lock_guard<std::mutex> lock(live_map_mutex_);
+        if (occupancy_grid_.take_changed()) {
+          grid = occupancy_grid_;
+        }
+        publish_live_cloud(time_now);
+      }
+      if (grid) {
+        grid->to_msg(*live_occupancy_grid_);
+        live_occupancy_grid_->header.stamp = time_now;
+        live_occupancy_grid_->header.frame_id = "live_map";
+        live_occupancy_grid_publisher_->publish(*live_occupancy_grid_);
+      }
     } else {
       // RCLCPP_INFO_STREAM(get_logger(), "IMU not initialized");
       initialize_variables();
@@ -471,6 +1356,7 @@ private:
   }
 
   rclcpp::Subscription<sensor_msgs::msg::Image>::SharedPtr image_sub;
+  rclcpp::Subscription<sensor_msgs::msg::Image>::SharedPtr right_image_sub;
   rclcpp::Subscription<sensor_msgs::msg::Imu>::SharedPtr imu_sub;
   rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr
     live_point_cloud_publisher_;
@@ -479,7 +1365,13 @@ private:
   rclcpp::Publisher<nav_msgs::msg::Odometry>::SharedPtr odom_publisher_;
   rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr orb_image_publisher_;
   rclcpp::Publisher<sensor_msgs::msg::Imu>::SharedPtr imu_publisher_;
+  rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr
+    diagnostics_publisher_;
   rclcpp::TimerBase::SharedPtr timer;
+  rclcpp::Service<std_srvs::srv::SetBool>::SharedPtr
+    localization_mode_service_;
+  rclcpp::Service<std_srvs::srv::Trigger>::SharedPtr save_snapshot_service_;
+  rclcpp::TimerBase::SharedPtr diagnostics_timer_;
 
   rclcpp::CallbackGroup::SharedPtr image_callback_group_;
   rclcpp::CallbackGroup::SharedPtr imu_callback_group_;
@@ -488,10 +1380,11 @@ private:
 
   std::unique_ptr<tf2_ros::TransformBroadcaster> tf_broadcaster;
 
-  sensor_msgs::msg::Imu imu_msg;
   geometry_msgs::msg::PoseArray pose_array_;
 
   std::string sensor_type_param;
+  bool stereo_ = false;
+  bool inertial_ = false;
   bool use_pangolin;
 
   std::vector<geometry_msgs::msg::Vector3> vGyro;
@@ -499,29 +1392,117 @@ private:
   std::vector<geometry_msgs::msg::Vector3> vAccel;
   std::vector<double> vAccel_times;
 
-  queue<sensor_msgs::msg::Imu::SharedPtr> imu_buf_;
-  queue<sensor_msgs::msg::Image::SharedPtr> img_buf_;
-  std::mutex buf_mutex_imu_, buf_mutex_img_, orbslam3_mutex_,
-    live_pcl_cloud_mutex_;
-
+  // per-stage latency, constructed before the stage ids registered below
+  orb_slam3_ros2::StageTracer tracer_;
+  std::size_t stage_rectify_ = tracer_.add_stage("rectify");
+  std::size_t stage_get_image_ = tracer_.add_stage("get_image");
+  std::size_t stage_imu_slice_ = tracer_.add_stage("imu_slice");
+  std::size_t stage_track_ = tracer_.add_stage("track_monocular");
+  std::size_t stage_map_harvest_ = tracer_.add_stage("map_harvest");
+  std::size_t stage_frame_drawer_ = tracer_.add_stage("frame_drawer");
+  std::size_t stage_video_submit_ = tracer_.add_stage("video_submit");
+  std::size_t stage_video_encode_ = tracer_.add_stage("video_encode");
+  std::size_t stage_publish_pretty_ = tracer_.add_stage("publish_pretty");
+
+  // imu samples waiting to be associated with an image
+  std::unique_ptr<orb_slam3_ros2::ImuRingBuffer> imu_buffer_;
+  vector<ORB_SLAM3::IMU::Point> vImuMeas_;
+  std::mutex buf_mutex_imu_, orbslam3_mutex_;
+
+  // frames handed from the image callbacks to the tracking thread; right is
+  // only set in stereo modes
+  struct CameraFrame {
+    sensor_msgs::msg::Image::ConstSharedPtr image;
+    sensor_msgs::msg::Image::ConstSharedPtr right;
+  };
+  std::unique_ptr<orb_slam3_ros2::FrameRing<CameraFrame>> frame_ring_;
+  std::unique_ptr<
+    orb_slam3_ros2::StereoSync<sensor_msgs::msg::Image::ConstSharedPtr>>
+    stereo_sync_;
+  std::mutex stereo_sync_mutex_;
+  orb_slam3_ros2::DropPolicy drop_policy_ =
+    orb_slam3_ros2::DropPolicy::DropOldest;
+  std::thread tracking_thread_;
+  std::mutex frame_mutex_;
+  std::condition_variable frame_cv_;
+  bool stop_tracking_ = false;
+  std::size_t frame_queue_size_ = 4;
+  std::atomic<uint64_t> frames_tracked_{0};
+  uint64_t last_reported_drops_ = 0;
+  // skips frames when tracking falls behind, see schedule_frame()
+  std::unique_ptr<orb_slam3_ros2::FrameScheduler> frame_scheduler_;
+  double last_tracked_stamp_ = -1.0;
+
+  // optional undistortion ahead of the frame ring
+  orb_slam3_ros2::CameraModel camera_model_;
+  std::unique_ptr<orb_slam3_ros2::RectifyPool> rectify_pool_;
+
+  // optional atlas persistence across runs
+  orb_slam3_ros2::AtlasMode atlas_mode_ = orb_slam3_ros2::AtlasMode::Off;
+  std::unique_ptr<orb_slam3_ros2::AtlasStore> atlas_store_;
+
+  // set by the tracking thread once system_future_ is ready
+  std::future<std::shared_ptr<ORB_SLAM3::System>> system_future_;
   std::shared_ptr<ORB_SLAM3::System> orb_slam3_system_;
+  std::atomic<bool> system_ready_{false};
+  // guards switching the mode against the system becoming ready
+  std::mutex localization_mutex_;
+  std::atomic<bool> localization_only_{false};
+  std::chrono::steady_clock::time_point start_time_ =
+    std::chrono::steady_clock::now();
+  ORB_SLAM3::System::eSensor sensor_type;
   std::string vocabulary_file_path;
   std::string settings_file_path;
+  // the settings as given, before the node rewrites them for orbslam3
+  std::string base_settings_path_;
+  // rewritten settings, removed once orbslam3 has read them
+  std::vector<std::string> temp_settings_paths_;
+  float image_scale_ = 1.f;
+  std::unique_ptr<orb_slam3_ros2::ImageBufferPool> scaled_pool_;
+  std::unique_ptr<orb_slam3_ros2::QualityController> quality_controller_;
 
-  sensor_msgs::msg::PointCloud2 live_pcl_cloud_msg_;
-  pcl::PointCloud<pcl::PointXYZ> live_pcl_cloud_;
   nav_msgs::msg::OccupancyGrid::SharedPtr live_occupancy_grid_;
 
-  Sophus::SE3f Tcw_;
+  // map point changes recorded by the tracking thread
+  orb_slam3_ros2::MapDeltaFeed map_feed_;
+  orb_slam3_ros2::MapPointHarvester map_harvester_{map_feed_};
 
-  cv::VideoWriter video_writer_;
+  // live cloud and grid, brought up to date from map_feed_ by the timer
+  std::mutex live_map_mutex_;
+  uint64_t map_version_ = 0;
+  std::vector<orb_slam3_ros2::MapPointDelta> map_deltas_;
+  orb_slam3_ros2::LiveMapCloud live_cloud_;
+  std::unique_ptr<orb_slam3_ros2::VoxelHashFilter> cloud_filter_;
+  orb_slam3_ros2::TiledOccupancyGrid occupancy_grid_;
+
+  Sophus::SE3f Tcw_;
+  orb_slam3_ros2::PoseHistory pose_history_;
+
+  // at most one snapshot is written in the background at a time
+  std::mutex snapshot_mutex_;
+  std::future<void> snapshot_writer_;
+
+  // crash-safe journal of the session, see write_checkpoint()
+  orb_slam3_ros2::CheckpointWriter checkpoint_;
+  std::thread checkpoint_thread_;
+  std::mutex checkpoint_mutex_;
+  std::condition_variable checkpoint_cv_;
+  bool stop_checkpoint_ = false;
+  int64_t checkpoint_sync_every_ = 5;
+  uint64_t checkpoint_version_ = 0;
+  uint64_t checkpoint_grid_generation_ = 0;
+  std::size_t checkpoint_poses_ = 0;
+  uint64_t snapshot_count_ = 0;
+
+  std::optional<rclcpp::OnShutdownCallbackHandle> shutdown_callback_;
+  std::atomic<bool> session_saved_{false};
+
+  std::unique_ptr<orb_slam3_ros2::AsyncVideoEncoder> video_encoder_;
   std::string timestamp_;
 };
 
-int main(int argc, char *argv[])
-{
-  rclcpp::init(argc, argv);
-  rclcpp::spin(std::make_shared<ImuMonoRealSense>());
-  rclcpp::shutdown();
-  return 0;
-}
+} // namespace orb_slam3_ros2
+
+// the callback groups only run concurrently on a multi-threaded executor,
+// which the standalone executable is built with
+RCLCPP_COMPONENTS_REGISTER_NODE(orb_slam3_ros2::ImuMonoRealSense)
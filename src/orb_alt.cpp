@@ -1,4 +1,5 @@
 #include "rclcpp/rclcpp.hpp"
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
 #include <geometry_msgs/msg/pose_array.hpp>
 #include <geometry_msgs/msg/quaternion.hpp>
 #include <geometry_msgs/msg/vector3.hpp>
@@ -29,14 +30,19 @@
 #include <tf2/LinearMath/Quaternion.h>
 #include <tf2_ros/transform_broadcaster.h>
 
-#include <yaml-cpp/yaml.h>
-
 #include <filesystem>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <condition_variable>
+#include <deque>
+#include <future>
+#include <thread>
 
 #include <opencv2/core/core.hpp>
 
@@ -44,8 +50,24 @@
 
 #include <System.h>
 
+#include "orb_slam3_ros2/frame_ring.hpp"
+#include "orb_slam3_ros2/frame_scheduler.hpp"
+#include "orb_slam3_ros2/image_buffer_pool.hpp"
+#include "orb_slam3_ros2/image_writer_pool.hpp"
+#include "orb_slam3_ros2/map_delta_feed.hpp"
+#include "orb_slam3_ros2/map_point_harvester.hpp"
+#include "orb_slam3_ros2/stage_tracer.hpp"
+#include "orb_slam3_ros2/trajectory_log.hpp"
+
 using namespace std::chrono_literals;
 
+// one gyro or accel reading, handed from the librealsense motion callback to
+// the tracking thread
+struct MotionSample {
+  double stamp = 0;
+  rs2_vector data{0, 0, 0};
+};
+
 static rs2_option get_sensor_option(const rs2::sensor &sensor)
 {
   // Sensors usually have several options to control their properties
@@ -89,15 +111,52 @@ class OrbAlt : public rclcpp::Node {
 public:
   OrbAlt() : Node("orb_alt")
   {
-    timer_ = create_wall_timer(5ms, std::bind(&OrbAlt::timer_callback, this));
-
     // declare parameters
     declare_parameter("sensor_type", "imu-monocular");
     declare_parameter("use_pangolin", true);
+    declare_parameter("frame_queue_size", 4);
+    declare_parameter("frame_drop_policy", "drop-oldest");
+    declare_parameter("motion_queue_size", 1024);
+    declare_parameter("save_images", true);
+    declare_parameter("image_writer_threads", 2);
+    declare_parameter("image_queue_size", 16);
+    declare_parameter("trajectory_formats",
+                      std::vector<std::string>{"tum", "kitti", "binary"});
+    declare_parameter("trace_stages", false);
+    declare_parameter("trace_file", false);
+    declare_parameter("frame_skip_budget_ms", 0.0);
+    declare_parameter("frame_skip_keyframe_rotation", 0.1);
+    declare_parameter("frame_skip_max_interval", 0.25);
 
     // get parameters
     sensor_type_param = get_parameter("sensor_type").as_string();
     use_pangolin = get_parameter("use_pangolin").as_bool();
+    save_images_ = get_parameter("save_images").as_bool();
+    frame_ring_ = std::make_unique<orb_slam3_ros2::FrameRing<rs2::frameset>>(
+      std::clamp<int64_t>(
+        get_parameter("frame_queue_size").as_int(), 1,
+        orb_slam3_ros2::FrameRing<rs2::frameset>::kMaxCapacity));
+    if (!orb_slam3_ros2::parse_drop_policy(
+          get_parameter("frame_drop_policy").as_string(), drop_policy_)) {
+      RCLCPP_WARN(get_logger(),
+                  "Unknown frame_drop_policy, using drop-oldest instead");
+    }
+    std::size_t motion_queue_size =
+      std::max<int64_t>(1, get_parameter("motion_queue_size").as_int());
+    gyro_ring_ = std::make_unique<orb_slam3_ros2::FrameRing<MotionSample>>(
+      motion_queue_size);
+    accel_ring_ = std::make_unique<orb_slam3_ros2::FrameRing<MotionSample>>(
+      motion_queue_size);
+
+    orb_slam3_ros2::FrameSchedulerParams scheduler_params;
+    scheduler_params.latency_budget_ms =
+      get_parameter("frame_skip_budget_ms").as_double();
+    scheduler_params.keyframe_rotation =
+      get_parameter("frame_skip_keyframe_rotation").as_double();
+    scheduler_params.max_skip_interval =
+      get_parameter("frame_skip_max_interval").as_double();
+    frame_scheduler_ =
+      std::make_unique<orb_slam3_ros2::FrameScheduler>(scheduler_params);
 
     // set the sensor type based on parameter
     vocabulary_file_path_ =
@@ -110,6 +169,14 @@ public:
       sensor_type = ORB_SLAM3::System::IMU_MONOCULAR;
       settings_file_path_ = std::string(PROJECT_PATH) +
                             "/config/Monocular-Inertial/RealSense_D435i.yaml";
+    } else if (sensor_type_param == "stereo") {
+      sensor_type = ORB_SLAM3::System::STEREO;
+      settings_file_path_ =
+        std::string(PROJECT_PATH) + "/config/Stereo/RealSense_D435i.yaml";
+    } else if (sensor_type_param == "imu-stereo") {
+      sensor_type = ORB_SLAM3::System::IMU_STEREO;
+      settings_file_path_ = std::string(PROJECT_PATH) +
+                            "/config/Stereo-Inertial/RealSense_D435i.yaml";
     } else {
       RCLCPP_ERROR(get_logger(), "Sensor type not recognized");
       rclcpp::shutdown();
@@ -118,15 +185,27 @@ public:
     RCLCPP_INFO_STREAM(get_logger(),
                        "vocabulary_file_path: " << vocabulary_file_path_);
 
-    // setup orb slam object
-    SLAM = std::make_shared<ORB_SLAM3::System>(
-      vocabulary_file_path_, settings_file_path_, sensor_type, use_pangolin, 0);
+    // setup orb slam object. Parsing the vocabulary dominates startup, so
+    // it runs in the background while the publishers and the camera are set
+    // up, and the tracking thread picks the system up before its first frame.
+    slam_future_ = std::async(
+      std::launch::async,
+      [vocabulary = vocabulary_file_path_, settings = settings_file_path_,
+       sensor = sensor_type, pangolin = use_pangolin]() {
+        return std::make_shared<ORB_SLAM3::System>(vocabulary, settings,
+                                                   sensor, pangolin, 0);
+      });
 
     // create publishers
     live_point_cloud_publisher_ =
       create_publisher<sensor_msgs::msg::PointCloud2>("live_point_cloud", 10);
     // orb_image_publisher_ =
     //   create_publisher<sensor_msgs::msg::Image>("/orb_camera/image", 10);
+    diagnostics_publisher_ =
+      create_publisher<diagnostic_msgs::msg::DiagnosticArray>("/diagnostics",
+                                                              10);
+    diagnostics_timer_ =
+      create_wall_timer(1s, std::bind(&OrbAlt::diagnostics_callback, this));
 
     // tf broadcaster
     tf_broadcaster = std::make_unique<tf2_ros::TransformBroadcaster>(*this);
@@ -152,6 +231,33 @@ public:
       return;
     }
 
+    // latency histograms of each stage on /diagnostics, and optionally
+    // every span as a Chrome trace in the output directory
+    bool trace_file = get_parameter("trace_file").as_bool();
+    tracer_.set_enabled(trace_file || get_parameter("trace_stages").as_bool());
+    if (trace_file && !tracer_.open_trace(output_path_ + "/trace.json")) {
+      RCLCPP_WARN(get_logger(), "Failed to open the trace file");
+    }
+
+    // images and poses are written off the tracking path
+    image_queue_size_ =
+      std::max<int64_t>(1, get_parameter("image_queue_size").as_int());
+    if (save_images_) {
+      std::size_t threads = std::clamp<int64_t>(
+        get_parameter("image_writer_threads").as_int(), 1,
+        std::max(1u, std::thread::hardware_concurrency()));
+      image_writer_ = std::make_unique<orb_slam3_ros2::ImageWriterPool>(
+        threads, image_queue_size_);
+      image_writer_->set_tracer(&tracer_, stage_image_write_);
+    }
+    trajectory_ = std::make_unique<orb_slam3_ros2::TrajectoryLog>(
+      output_path_ + "/poses/" + timestamp_,
+      get_parameter("trajectory_formats").as_string_array());
+    for (const std::string &format : trajectory_->unknown_formats()) {
+      RCLCPP_WARN_STREAM(get_logger(),
+                         "Unknown trajectory format: " << format);
+    }
+
     rclcpp::Context::SharedPtr context =
       get_node_base_interface()->get_context();
 
@@ -160,20 +266,49 @@ public:
         context->add_pre_shutdown_callback(
           std::bind(&OrbAlt::preshutdown, this)));
 
+    tracking_thread_ = std::thread(&OrbAlt::tracking_loop, this);
     setup_realsense();
   }
 
+  ~OrbAlt() { stop_tracking(); }
+
 private:
   void preshutdown()
   {
     RCLCPP_INFO(get_logger(), "Shutting down ROS 2");
-    pcl::PointCloud<pcl::PointXYZ> cloud = SLAM->GetMapPCL();
+    stop_tracking();
+    // the feed only approximates the map while tracking, so it is brought
+    // in line with the whole map before the cloud is saved from it
+    if (SLAM) {
+      map_harvester_.full_read();
+    }
+    std::vector<orb_slam3_ros2::MapPointDelta> points;
+    map_feed_.snapshot(points);
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    cloud.reserve(points.size());
+    for (const orb_slam3_ros2::MapPointDelta &point : points) {
+      const Eigen::Vector3f &pos = point.position;
+      cloud.push_back(pcl::PointXYZ(pos.x(), pos.y(), pos.z()));
+    }
     RCLCPP_INFO_STREAM(get_logger(), "cloud size: " << cloud.size());
     pcl::io::savePCDFileBinary(output_path_ + "/cloud/" + timestamp_ + ".pcd",
                                cloud);
-    std::ofstream fout(output_path_ + "/poses/" + timestamp_ + ".yaml");
-    fout << poses_;
-    fout.close();
+
+    if (image_writer_) {
+      image_writer_->close();
+      RCLCPP_INFO_STREAM(get_logger(),
+                         "images written: " << image_writer_->written()
+                                            << ", dropped: "
+                                            << image_writer_->dropped()
+                                            << ", failed: "
+                                            << image_writer_->failed());
+    }
+    if (trajectory_) {
+      trajectory_->close();
+      RCLCPP_INFO_STREAM(get_logger(),
+                         "poses written: " << trajectory_->size());
+    }
+    tracer_.close_trace();
   }
 
   rs2_vector interpolate_measure(const double target_time,
@@ -259,96 +394,167 @@ private:
     // Enabling the depth stream and using it for the mono8 image is faster, and
     // doesn't require a conversion from RGB to mono8 in the future.
     cfg.enable_stream(RS2_STREAM_INFRARED, 1, 640, 480, RS2_FORMAT_Y8, 30);
+    // both imagers are exposed together, so each frameset carries a matched
+    // left/right pair and no software synchronisation is needed
+    if (stereo()) {
+      cfg.enable_stream(RS2_STREAM_INFRARED, 2, 640, 480, RS2_FORMAT_Y8, 30);
+    }
     cfg.enable_stream(RS2_STREAM_COLOR, 640, 480, RS2_FORMAT_BGR8, 30);
     cfg.enable_stream(RS2_STREAM_ACCEL, RS2_FORMAT_MOTION_XYZ32F);
     cfg.enable_stream(RS2_STREAM_GYRO, RS2_FORMAT_MOTION_XYZ32F);
 
-    // IMU callback
-    auto imu_callback = [&](const rs2::frame &frame) {
-      std::unique_lock<std::mutex> lock(imu_mutex);
-
+    // Images and motion samples only get queued here; tracking happens on
+    // tracking_thread_, which the frameset wakes up directly.
+    auto frame_callback = [this](const rs2::frame &frame) {
       if (rs2::frameset fs = frame.as<rs2::frameset>()) {
-        count_im_buffer++;
-
-        double new_timestamp_image = fs.get_timestamp() * 1e-3;
-        if (abs(timestamp_image - new_timestamp_image) < 0.001) {
-          // cout << "Two frames with the same timeStamp!!!\n";
-          count_im_buffer--;
+        double stamp = fs.get_timestamp() * 1e-3;
+        if (std::abs(stamp - last_frame_stamp_) < 0.001) {
+          duplicate_frames_++;
           return;
         }
+        last_frame_stamp_ = stamp;
 
-        rs2::video_frame color_frame = fs.get_color_frame();
-        rs2::video_frame infrared_frame = fs.get_infrared_frame();
-        imCV_color =
-          cv::Mat(cv::Size(width_img, height_img), CV_8UC3,
-                  (void *)(color_frame.get_data()), cv::Mat::AUTO_STEP);
-        imCV = cv::Mat(cv::Size(width_img, height_img), CV_8U,
-                       (void *)(infrared_frame.get_data()), cv::Mat::AUTO_STEP);
-
-        timestamp_image = fs.get_timestamp() * 1e-3;
-        image_ready = true;
-
-        while (v_gyro_timestamp.size() > v_accel_timestamp_sync.size()) {
-
-          int index = v_accel_timestamp_sync.size();
-          double target_time = v_gyro_timestamp[index];
-
-          v_accel_data_sync.push_back(current_accel_data);
-          v_accel_timestamp_sync.push_back(target_time);
+        frame_ring_->push(std::move(fs));
+        {
+          std::lock_guard<std::mutex> lock(frame_mutex_);
         }
-
-        lock.unlock();
-        cond_image_rec.notify_all();
+        frame_cv_.notify_one();
       } else if (rs2::motion_frame m_frame = frame.as<rs2::motion_frame>()) {
-        if (m_frame.get_profile().stream_name() == "Gyro") {
+        MotionSample sample;
+        sample.stamp = (m_frame.get_timestamp() + offset) * 1e-3;
+        sample.data = m_frame.get_motion_data();
+        if (m_frame.get_profile().stream_type() == RS2_STREAM_GYRO) {
           // It runs at 200Hz
-          v_gyro_data.push_back(m_frame.get_motion_data());
-          v_gyro_timestamp.push_back((m_frame.get_timestamp() + offset) * 1e-3);
-          // rs2_vector gyro_sample = m_frame.get_motion_data();
-          // std::cout << "Gyro:" << gyro_sample.x << ", " << gyro_sample.y <<
-          // ", " << gyro_sample.z << std::endl;
-        } else if (m_frame.get_profile().stream_name() == "Accel") {
+          gyro_ring_->push(sample);
+        } else {
           // It runs at 60Hz
-          prev_accel_timestamp = current_accel_timestamp;
-          prev_accel_data = current_accel_data;
+          accel_ring_->push(sample);
+        }
+      }
+    };
 
-          current_accel_data = m_frame.get_motion_data();
-          current_accel_timestamp = (m_frame.get_timestamp() + offset) * 1e-3;
+    pipe_profile = pipe.start(cfg, frame_callback);
 
-          while (v_gyro_timestamp.size() > v_accel_timestamp_sync.size()) {
-            int index = v_accel_timestamp_sync.size();
-            double target_time = v_gyro_timestamp[index];
+    cam_stream = pipe_profile.get_stream(RS2_STREAM_INFRARED, 1);
+  }
 
-            rs2_vector interp_data = interpolate_measure(
-              target_time, current_accel_data, current_accel_timestamp,
-              prev_accel_data, prev_accel_timestamp);
+  // The camera is already streaming by now; the framesets that arrive
+  // while orbslam3 is still loading wait in the frame ring, which keeps
+  // only the newest of them.
+  void wait_for_slam()
+  {
+    SLAM = slam_future_.get();
+    imageScale = SLAM->GetImageScale();
+    slam_ready_.store(true);
+    RCLCPP_INFO_STREAM(
+      get_logger(),
+      "ORB_SLAM3 ready after "
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_time_)
+             .count()
+        << " s");
+  }
 
-            v_accel_data_sync.push_back(interp_data);
-            v_accel_timestamp_sync.push_back(target_time);
-          }
-          // std::cout << "Accel:" << current_accel_data.x << ", " <<
-          // current_accel_data.y << ", " << current_accel_data.z << std::endl;
+  void tracking_loop()
+  {
+    wait_for_slam();
+    rs2::frameset fs;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(frame_mutex_);
+        frame_cv_.wait(lock, [this] {
+          return stop_tracking_ || !frame_ring_->empty();
+        });
+        if (stop_tracking_) {
+          return;
         }
       }
-    };
 
-    pipe_profile = pipe.start(cfg, imu_callback);
+      while (frame_ring_->pop(fs, drop_policy_)) {
+        if (schedule_frame(fs) && track_frame(fs)) {
+          frames_tracked_++;
+        }
+        fs = rs2::frameset();
+      }
+    }
+  }
 
-    cam_stream = pipe_profile.get_stream(RS2_STREAM_INFRARED, 1);
+  // Collects the frame's imu samples and decides whether it is tracked. The
+  // samples of a skipped frame stay in vImuMeas and go to orbslam3 with the
+  // next tracked frame.
+  bool schedule_frame(const rs2::frameset &fs)
+  {
+    double timestamp = fs.get_timestamp() * 1e-3;
+    {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_imu_collect_);
+      collect_imu(timestamp);
+    }
+    if (!frame_scheduler_->enabled()) {
+      return true;
+    }
+    double since_tracked = last_tracked_stamp_ < 0.0
+                             ? std::numeric_limits<double>::infinity()
+                             : timestamp - last_tracked_stamp_;
+    return frame_scheduler_->should_track(
+      frame_ring_->size(), since_tracked,
+      orb_slam3_ros2::FrameScheduler::rotation(vImuMeas));
+  }
 
-    rs2::stream_profile imu_stream = pipe_profile.get_stream(RS2_STREAM_GYRO);
+  void stop_tracking()
+  {
+    if (pipe_profile) {
+      pipe.stop();
+      pipe_profile = rs2::pipeline_profile();
+    }
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex_);
+      stop_tracking_ = true;
+    }
+    frame_cv_.notify_one();
+    if (tracking_thread_.joinable()) {
+      tracking_thread_.join();
+    }
+  }
 
-    rs2_intrinsics intrinsics_cam =
-      cam_stream.as<rs2::video_stream_profile>().get_intrinsics();
-    width_img = intrinsics_cam.width;
-    height_img = intrinsics_cam.height;
-    imageScale = SLAM->GetImageScale();
+  // Moves every gyro sample up to `stamp` into vImuMeas, each paired with
+  // the accel reading interpolated at its time. Later gyro samples stay
+  // queued for the next frame, so frames dropped in between lose no IMU data.
+  void collect_imu(double stamp)
+  {
+    MotionSample sample;
+    while (gyro_ring_->pop(sample)) {
+      gyro_pending_.push_back(sample);
+    }
+    while (accel_ring_->pop(sample)) {
+      accel_pending_.push_back(sample);
+    }
+
+    while (!gyro_pending_.empty() && gyro_pending_.front().stamp <= stamp) {
+      const MotionSample &gyro = gyro_pending_.front();
+      while (!accel_pending_.empty() &&
+             accel_pending_.front().stamp <= gyro.stamp) {
+        prev_accel_ = current_accel_;
+        current_accel_ = accel_pending_.front();
+        accel_pending_.pop_front();
+      }
+
+      rs2_vector accel;
+      if (accel_pending_.empty()) {
+        accel = interpolate_measure(gyro.stamp, current_accel_.data,
+                                    current_accel_.stamp, prev_accel_.data,
+                                    prev_accel_.stamp);
+      } else {
+        accel = interpolate_measure(
+          gyro.stamp, accel_pending_.front().data,
+          accel_pending_.front().stamp, current_accel_.data,
+          current_accel_.stamp);
+      }
 
-    // Clear IMU vectors
-    v_gyro_data.clear();
-    v_gyro_timestamp.clear();
-    v_accel_data_sync.clear();
-    v_accel_timestamp_sync.clear();
+      vImuMeas.push_back(ORB_SLAM3::IMU::Point(accel.x, accel.y, accel.z,
+                                               gyro.data.x, gyro.data.y,
+                                               gyro.data.z, gyro.stamp));
+      gyro_pending_.pop_front();
+    }
   }
 
   std::string generate_timestamp_string()
@@ -363,106 +569,186 @@ private:
     return oss.str();
   }
 
-  void timer_callback()
+  bool stereo() const
   {
+    return sensor_type == ORB_SLAM3::System::STEREO ||
+           sensor_type == ORB_SLAM3::System::IMU_STEREO;
+  }
 
-    double timestamp;
-    cv::Mat im;
-
-    {
-      std::unique_lock<std::mutex> lk(imu_mutex);
-      if (!image_ready)
-        cond_image_rec.wait(lk);
-
-      if (count_im_buffer > 1)
-        cout << count_im_buffer - 1 << " dropped frs\n";
-      count_im_buffer = 0;
-
-      while (v_gyro_timestamp.size() > v_accel_timestamp_sync.size()) {
-        int index = v_accel_timestamp_sync.size();
-        double target_time = v_gyro_timestamp[index];
-
-        rs2_vector interp_data = interpolate_measure(
-          target_time, current_accel_data, current_accel_timestamp,
-          prev_accel_data, prev_accel_timestamp);
+  // a header over the frame's pixels, valid while the frame is held
+  static cv::Mat wrap_infrared(const rs2::video_frame &frame)
+  {
+    if (!frame) {
+      return cv::Mat();
+    }
+    return cv::Mat(cv::Size(frame.get_width(), frame.get_height()), CV_8U,
+                   const_cast<void *>(frame.get_data()),
+                   frame.get_stride_in_bytes());
+  }
 
-        v_accel_data_sync.push_back(interp_data);
-        // v_accel_data_sync.push_back(current_accel_data); // 0 interpolation
-        v_accel_timestamp_sync.push_back(target_time);
+  // returns false if the frame never reached orbslam3
+  bool track_frame(const rs2::frameset &fs)
+  {
+    double timestamp = fs.get_timestamp() * 1e-3;
+
+    // the frameset owns the pixels for as long as it is held
+    cv::Mat im = wrap_infrared(fs.get_infrared_frame(1));
+    cv::Mat im_right;
+    if (stereo()) {
+      im_right = wrap_infrared(fs.get_infrared_frame(2));
+      if (im_right.empty()) {
+        RCLCPP_WARN(get_logger(), "Frameset without a right image, skipped");
+        return false;
       }
-
-      // Copy the IMU data
-      vGyro = v_gyro_data;
-      vGyro_times = v_gyro_timestamp;
-      vAccel = v_accel_data_sync;
-      vAccel_times = v_accel_timestamp_sync;
-      timestamp = timestamp_image;
-      im = imCV.clone();
-
-      // Clear IMU vectors
-      v_gyro_data.clear();
-      v_gyro_timestamp.clear();
-      v_accel_data_sync.clear();
-      v_accel_timestamp_sync.clear();
-
-      image_ready = false;
     }
-
-    for (int i = 0; i < vGyro.size(); ++i) {
-      ORB_SLAM3::IMU::Point lastPoint(vAccel[i].x, vAccel[i].y, vAccel[i].z,
-                                      vGyro[i].x, vGyro[i].y, vGyro[i].z,
-                                      vGyro_times[i]);
-      vImuMeas.push_back(lastPoint);
+    cv::Mat im_color;
+    if (image_writer_) {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_image_copy_);
+      rs2::video_frame color_frame = fs.get_color_frame();
+      if (color_frame) {
+        cv::Mat wrapped(cv::Size(color_frame.get_width(),
+                                 color_frame.get_height()),
+                        CV_8UC3, (void *)(color_frame.get_data()),
+                        cv::Mat::AUTO_STEP);
+        // the writer queue holds at most image_queue_size images
+        im_color = acquire_buffer(color_pool_, image_queue_size_ + 2,
+                                  wrapped.size(), CV_8UC3);
+        wrapped.copyTo(im_color);
+      }
     }
 
     if (imageScale != 1.f) {
-      int width = im.cols * imageScale;
-      int height = im.rows * imageScale;
-      cv::resize(im, im, cv::Size(width, height));
+      // Resized straight into pooled buffers. orbslam3 keeps a reference to
+      // the last frame it tracked, so the pool has room for a few frames
+      // per camera before it has to allocate.
+      cv::Size size(im.cols * imageScale, im.rows * imageScale);
+      cv::Mat scaled = acquire_buffer(scaled_pool_, 8, size, CV_8U);
+      cv::resize(im, scaled, size);
+      im = scaled;
+      if (!im_right.empty()) {
+        cv::Mat scaled_right = acquire_buffer(scaled_pool_, 8, size, CV_8U);
+        cv::resize(im_right, scaled_right, size);
+        im_right = scaled_right;
+      }
     }
 
     // Pass the image to the SLAM system
     std::shared_ptr<Sophus::SE3f> Tcw;
-    if (sensor_type == ORB_SLAM3::System::MONOCULAR) {
-      Tcw = std::make_shared<Sophus::SE3f>(SLAM->TrackMonocular(im, timestamp));
-    } else if (sensor_type == ORB_SLAM3::System::IMU_MONOCULAR) {
-      Tcw = std::make_shared<Sophus::SE3f>(
-        SLAM->TrackMonocular(im, timestamp, vImuMeas));
+    auto track_start = std::chrono::steady_clock::now();
+    {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_track_);
+      if (sensor_type == ORB_SLAM3::System::MONOCULAR) {
+        Tcw =
+          std::make_shared<Sophus::SE3f>(SLAM->TrackMonocular(im, timestamp));
+      } else if (sensor_type == ORB_SLAM3::System::IMU_MONOCULAR) {
+        Tcw = std::make_shared<Sophus::SE3f>(
+          SLAM->TrackMonocular(im, timestamp, vImuMeas));
+      } else if (sensor_type == ORB_SLAM3::System::STEREO) {
+        // orbslam3 extracts the left and right features on two threads
+        Tcw = std::make_shared<Sophus::SE3f>(
+          SLAM->TrackStereo(im, im_right, timestamp));
+      } else if (sensor_type == ORB_SLAM3::System::IMU_STEREO) {
+        Tcw = std::make_shared<Sophus::SE3f>(
+          SLAM->TrackStereo(im, im_right, timestamp, vImuMeas));
+      }
+    }
+    frame_scheduler_->add_latency(
+      std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - track_start)
+        .count());
+    last_tracked_stamp_ = timestamp;
+    {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_map_harvest_);
+      map_harvester_.harvest(*SLAM, *Tcw);
     }
 
     // save image
     // cv::Mat pretty = SLAM->getPrettyFrame();
-    if (!imCV_color.empty()) {
-      cv::imwrite(output_path_ + "/images/" + std::to_string(img_iter_) +
-                    ".jpg",
-                  imCV_color);
+    if (!im_color.empty()) {
+      image_writer_->submit(output_path_ + "/images/" +
+                              std::to_string(img_iter_) + ".jpg",
+                            std::move(im_color));
     }
 
     // save pose
-    Eigen::Matrix4f transformation_matrix = Tcw->inverse().matrix();
-    YAML::Node matrix;
-    for (int i = 0; i < 4; i++) {
-      std::vector<float> row;
-      for (int j = 0; j < 4; j++) {
-        row.push_back(transformation_matrix(i, j));
-      }
-      matrix.push_back(row);
+    if (trajectory_) {
+      orb_slam3_ros2::ScopedTrace trace(tracer_, stage_trajectory_);
+      trajectory_->append(timestamp, Tcw->inverse().matrix());
     }
-    poses_["Twc_" + std::to_string(img_iter_)] = matrix;
     img_iter_++;
 
     // Clear the previous IMU measurements to load the new ones
     vImuMeas.clear();
-    // }
+    return true;
+  }
+
+  // (re)creates the pool when the camera resolution is first seen or changes
+  cv::Mat
+  acquire_buffer(std::unique_ptr<orb_slam3_ros2::ImageBufferPool> &pool,
+                 std::size_t count, cv::Size size, int type)
+  {
+    if (!pool || pool->size() != size) {
+      std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+      pool = std::make_unique<orb_slam3_ros2::ImageBufferPool>(count, size,
+                                                               type);
+    }
+    return pool->acquire();
+  }
+
+  void diagnostics_callback()
+  {
+    using orb_slam3_ros2::add_value;
+    diagnostic_msgs::msg::DiagnosticStatus status =
+      orb_slam3_ros2::tracking_queue_status(
+        get_name(), *frame_ring_, drop_policy_, *frame_scheduler_,
+        frames_tracked_.load(), slam_ready_.load(), last_reported_drops_);
+    add_value(status, "frames_duplicate",
+              std::to_string(duplicate_frames_.load()));
+    add_value(status, "gyro_received", std::to_string(gyro_ring_->pushed()));
+    add_value(status, "gyro_dropped", std::to_string(gyro_ring_->dropped()));
+    add_value(status, "accel_received", std::to_string(accel_ring_->pushed()));
+    add_value(status, "accel_dropped", std::to_string(accel_ring_->dropped()));
+    if (image_writer_) {
+      add_value(status, "images_written",
+                std::to_string(image_writer_->written()));
+      add_value(status, "images_dropped",
+                std::to_string(image_writer_->dropped()));
+    }
+    std::unique_lock<std::mutex> pool_lock(buffer_pool_mutex_);
+    for (const auto &[name, pool] : {std::make_pair("color", &color_pool_),
+                                     std::make_pair("scaled", &scaled_pool_)}) {
+      if (*pool) {
+        add_value(status, std::string(name) + "_buffers_reused",
+                  std::to_string((*pool)->hits()));
+        add_value(status, std::string(name) + "_buffers_allocated",
+                  std::to_string((*pool)->misses()));
+      }
+    }
+    pool_lock.unlock();
+    add_value(status, "map_points", std::to_string(map_feed_.size()));
+
+    diagnostic_msgs::msg::DiagnosticArray diagnostics;
+    diagnostics.header.stamp = get_clock()->now();
+    diagnostics.status.push_back(status);
+    if (tracer_.enabled()) {
+      diagnostics.status.push_back(
+        orb_slam3_ros2::stage_latency_status(tracer_, get_name()));
+    }
+    diagnostics_publisher_->publish(diagnostics);
   }
 
-  rclcpp::TimerBase::SharedPtr timer_;
+  rclcpp::TimerBase::SharedPtr diagnostics_timer_;
 
   geometry_msgs::msg::PoseArray pose_array_;
   std::string sensor_type_param;
   bool use_pangolin;
 
+  // set by the tracking thread once slam_future_ is ready
+  std::future<std::shared_ptr<ORB_SLAM3::System>> slam_future_;
   std::shared_ptr<ORB_SLAM3::System> SLAM;
+  std::atomic<bool> slam_ready_{false};
+  std::chrono::steady_clock::time_point start_time_ =
+    std::chrono::steady_clock::now();
   std::string vocabulary_file_path_;
   std::string settings_file_path_;
 
@@ -488,39 +774,63 @@ private:
   rs2::config cfg;
   rs2::pipeline_profile pipe_profile;
 
-  std::mutex imu_mutex;
   vector<ORB_SLAM3::IMU::Point> vImuMeas;
   ORB_SLAM3::System::eSensor sensor_type;
-  std::condition_variable cond_image_rec;
-  vector<double> v_accel_timestamp;
-  vector<rs2_vector> v_accel_data;
-  vector<double> v_gyro_timestamp;
-  vector<rs2_vector> v_gyro_data;
-  double prev_accel_timestamp = 0;
-  rs2_vector prev_accel_data;
-  double current_accel_timestamp = 0;
-  rs2_vector current_accel_data;
-  vector<double> v_accel_timestamp_sync;
-  vector<rs2_vector> v_accel_data_sync;
   rs2::stream_profile cam_stream;
 
-  std::vector<rs2_vector> vGyro;
-  std::vector<double> vGyro_times;
-  std::vector<rs2_vector> vAccel;
-  std::vector<double> vAccel_times;
-
-  cv::Mat imCV;
-  cv::Mat imCV_color;
-  int width_img, height_img;
-  double timestamp_image = -1.0;
-  bool image_ready = false;
-  int count_im_buffer = 0; // count dropped frames
+  // per-stage latency, constructed before the stage ids registered below
+  orb_slam3_ros2::StageTracer tracer_;
+  std::size_t stage_image_copy_ = tracer_.add_stage("image_copy");
+  std::size_t stage_imu_collect_ = tracer_.add_stage("imu_collect");
+  std::size_t stage_track_ = tracer_.add_stage("track_monocular");
+  std::size_t stage_map_harvest_ = tracer_.add_stage("map_harvest");
+  std::size_t stage_image_write_ = tracer_.add_stage("image_write");
+  std::size_t stage_trajectory_ = tracer_.add_stage("trajectory_append");
+
+  // frames and motion samples from librealsense, see setup_realsense()
+  std::unique_ptr<orb_slam3_ros2::FrameRing<rs2::frameset>> frame_ring_;
+  orb_slam3_ros2::DropPolicy drop_policy_ =
+    orb_slam3_ros2::DropPolicy::DropOldest;
+  std::unique_ptr<orb_slam3_ros2::FrameRing<MotionSample>> gyro_ring_;
+  std::unique_ptr<orb_slam3_ros2::FrameRing<MotionSample>> accel_ring_;
+  double last_frame_stamp_ = -1.0;
+  std::atomic<uint64_t> duplicate_frames_{0};
+
+  // tracking thread state
+  std::thread tracking_thread_;
+  std::mutex frame_mutex_;
+  std::condition_variable frame_cv_;
+  bool stop_tracking_ = false;
+  std::atomic<uint64_t> frames_tracked_{0};
+  std::deque<MotionSample> gyro_pending_;
+  std::deque<MotionSample> accel_pending_;
+  MotionSample prev_accel_;
+  MotionSample current_accel_;
+
+  rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr
+    diagnostics_publisher_;
+  uint64_t last_reported_drops_ = 0;
+  // skips frames when tracking falls behind, see schedule_frame()
+  std::unique_ptr<orb_slam3_ros2::FrameScheduler> frame_scheduler_;
+  double last_tracked_stamp_ = -1.0;
+
   float imageScale;
 
   double offset = 0; // ms
-                     //
-  YAML::Node poses_;
-  int img_iter_;
+
+  int img_iter_ = 0;
+  bool save_images_;
+  std::unique_ptr<orb_slam3_ros2::ImageWriterPool> image_writer_;
+  std::size_t image_queue_size_ = 16;
+  // images handed to orbslam3 and the writer, filled by the tracking thread
+  std::unique_ptr<orb_slam3_ros2::ImageBufferPool> color_pool_;
+  std::unique_ptr<orb_slam3_ros2::ImageBufferPool> scaled_pool_;
+  std::mutex buffer_pool_mutex_;
+  std::unique_ptr<orb_slam3_ros2::TrajectoryLog> trajectory_;
+
+  // map point changes, so shutdown never has to copy the whole map
+  orb_slam3_ros2::MapDeltaFeed map_feed_;
+  orb_slam3_ros2::MapPointHarvester map_harvester_{map_feed_};
 };
 
 int main(int argc, char *argv[])
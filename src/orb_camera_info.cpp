@@ -1,52 +1,131 @@
-#include <yaml-cpp/yaml.h>
-#include "sensor_msgs/msg/camera_info.hpp"
+#include <rmw/qos_profiles.h>
+#include <sensor_msgs/msg/camera_info.hpp>
+#include <sensor_msgs/msg/image.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include "orb_slam3_ros2/camera_model.hpp"
+#include "orb_slam3_ros2/rectify_pool.hpp"
 #include "rclcpp/rclcpp.hpp"
+#include "rclcpp_components/register_node_macro.hpp"
+
+using std::placeholders::_1;
 
-using namespace std::chrono_literals;
+namespace orb_slam3_ros2 {
 
+// Publishes the CameraInfo of an ORB_SLAM3 settings file alongside every
+// image, with the image's header. The settings are parsed once; with
+// `rectify` the images are also undistorted through precomputed lookup tables
+// on a worker pool and republished with the matching rectified CameraInfo.
 class OrbCameraInfo : public rclcpp::Node {
 public:
-  OrbCameraInfo() : Node("orb_camera_info_node")
+  explicit OrbCameraInfo(
+    const rclcpp::NodeOptions &options = rclcpp::NodeOptions())
+    : Node("orb_camera_info_node", options)
   {
+    // declare parameters
+    declare_parameter("settings_file",
+                      "Monocular-Inertial/RealSense_D435i.yaml");
+    declare_parameter("image_topic", "camera/infra1/image_rect_raw");
+    declare_parameter("rectify", false);
+    declare_parameter("rectify_threads", 2);
+    declare_parameter("rectify_queue_size", 4);
+    declare_parameter("rectify_balance", 0.0);
+
+    // get parameters
+    std::string settings_file = get_parameter("settings_file").as_string();
+    if (settings_file.empty() || settings_file[0] != '/') {
+      settings_file = std::string(PROJECT_PATH) + "/config/" + settings_file;
+    }
+    if (!camera_model_.load(settings_file)) {
+      throw std::runtime_error("Error loading " + settings_file + ": " +
+                               camera_model_.error());
+    }
+
+    // define publishers
     camera_info_publisher_ =
       create_publisher<sensor_msgs::msg::CameraInfo>("/orb_camera/info", 10);
-    camera_info_node_ =
-      YAML::LoadFile(std::string(PROJECT_PATH) +
-                     "/config/Monocular-Inertial/RealSense_D435i.yaml");
-    timer_ =
-      create_wall_timer(33ms, std::bind(&OrbCameraInfo::timer_callback, this));
+    if (get_parameter("rectify").as_bool()) {
+      camera_model_.init_rectification(
+        get_parameter("rectify_balance").as_double());
+      rect_info_ = camera_model_.camera_info(true);
+      rect_image_publisher_ = create_publisher<sensor_msgs::msg::Image>(
+        "/orb_camera/image_rect", 10);
+      rect_info_publisher_ = create_publisher<sensor_msgs::msg::CameraInfo>(
+        "/orb_camera/rect_info", 10);
+      std::size_t threads = std::clamp<int64_t>(
+        get_parameter("rectify_threads").as_int(), 1,
+        std::max(1u, std::thread::hardware_concurrency()));
+      rectify_pool_ = std::make_unique<RectifyPool>(
+        camera_model_, threads,
+        std::max<int64_t>(1, get_parameter("rectify_queue_size").as_int()),
+        std::bind(&OrbCameraInfo::rectified_callback, this, _1));
+    }
+    camera_info_ = camera_model_.camera_info(false);
+
+    // define subscribers
+    rclcpp::QoS sensor_qos(
+      rclcpp::QoSInitialization::from_rmw(rmw_qos_profile_sensor_data),
+      rmw_qos_profile_sensor_data);
+    image_subscriber_ = create_subscription<sensor_msgs::msg::Image>(
+      get_parameter("image_topic").as_string(), sensor_qos,
+      std::bind(&OrbCameraInfo::image_callback, this, _1));
+
+    RCLCPP_INFO_STREAM(
+      get_logger(),
+      "Camera model "
+        << (camera_model_.type() == CameraModel::Type::KannalaBrandt8
+              ? "KannalaBrandt8"
+              : "PinHole")
+        << " " << camera_model_.width() << "x" << camera_model_.height()
+        << (rectify_pool_ ? ", rectifying" : ""));
+  }
+
+  ~OrbCameraInfo()
+  {
+    if (rectify_pool_) {
+      rectify_pool_->close();
+    }
   }
 
 private:
-  void timer_callback()
+  // a const message is shared with the other intra-process subscribers
+  // instead of being copied for this one
+  void image_callback(sensor_msgs::msg::Image::ConstSharedPtr msg)
+  {
+    auto info = std::make_unique<sensor_msgs::msg::CameraInfo>(camera_info_);
+    info->header = msg->header;
+    camera_info_publisher_->publish(std::move(info));
+    if (rectify_pool_) {
+      rectify_pool_->submit(std::move(msg));
+    }
+  }
+
+  // called on a pool thread, in image order
+  void rectified_callback(std::unique_ptr<sensor_msgs::msg::Image> msg)
   {
-    auto camera_info = std::make_unique<sensor_msgs::msg::CameraInfo>();
-    camera_info->header.frame_id = "base_link";
-    camera_info->header.stamp = get_clock()->now();
-
-    camera_info->width = camera_info_node_["Camera.width"].as<int>();
-    camera_info->height = camera_info_node_["Camera.height"].as<int>();
-    camera_info->distortion_model = "plumb_bob";
-    camera_info->k = {camera_info_node_["Camera1.fx"].as<double>(), 0.0, camera_info_node_["Camera1.cx"].as<double>(),
-                      0.0, camera_info_node_["Camera1.fy"].as<double>(), camera_info_node_["Camera1.cy"].as<double>(),
-                      0.0, 0.0, 1.0};
-    camera_info->r = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
-    camera_info->p = {camera_info_node_["Camera1.fx"].as<double>(), 0.0, camera_info_node_["Camera1.cx"].as<double>(), 0.0,
-                      0.0, camera_info_node_["Camera1.fy"].as<double>(), camera_info_node_["Camera1.cy"].as<double>(), 0.0,
-                      0.0, 0.0, 1.0, 0.0};
-
-    camera_info_publisher_->publish(*camera_info);
+    auto info = std::make_unique<sensor_msgs::msg::CameraInfo>(rect_info_);
+    info->header = msg->header;
+    rect_info_publisher_->publish(std::move(info));
+    rect_image_publisher_->publish(std::move(msg));
   }
-  rclcpp::TimerBase::SharedPtr timer_;
+
+  rclcpp::Subscription<sensor_msgs::msg::Image>::SharedPtr image_subscriber_;
   rclcpp::Publisher<sensor_msgs::msg::CameraInfo>::SharedPtr
     camera_info_publisher_;
-  YAML::Node camera_info_node_;
+  rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr rect_image_publisher_;
+  rclcpp::Publisher<sensor_msgs::msg::CameraInfo>::SharedPtr
+    rect_info_publisher_;
+
+  CameraModel camera_model_;
+  sensor_msgs::msg::CameraInfo camera_info_;
+  sensor_msgs::msg::CameraInfo rect_info_;
+  std::unique_ptr<RectifyPool> rectify_pool_;
 };
 
-int main(int argc, char *argv[])
-{
-  rclcpp::init(argc, argv);
-  rclcpp::spin(std::make_shared<OrbCameraInfo>());
-  rclcpp::shutdown();
-  return 0;
-}
+} // namespace orb_slam3_ros2
+
+RCLCPP_COMPONENTS_REGISTER_NODE(orb_slam3_ros2::OrbCameraInfo)
@@ -0,0 +1,119 @@
+// Rebuilds the outputs of an imu_mono_node_cpp session from its checkpoint
+// journal, after a crash or when the node was told not to compact on
+// shutdown. Everything up to the last complete checkpoint is recovered; a
+// checkpoint that was only partly written is dropped.
+//
+// usage: session_recover <output/session directory> [--keep-journal]
+//
+// writes cloud/<session>.pcd, grid/<session>.{pgm,yaml} and
+// poses/<session>_tum.txt, as a clean shutdown would, and removes the
+// journal unless --keep-journal is given.
+
+#include <pcl/io/pcd_io.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "nav2_map_server/map_io.hpp"
+#include "orb_slam3_ros2/session_checkpoint.hpp"
+#include "orb_slam3_ros2/tiled_occupancy_grid.hpp"
+#include "orb_slam3_ros2/trajectory_log.hpp"
+
+namespace fs = std::filesystem;
+
+static void usage()
+{
+  std::cerr << "usage: session_recover <session directory> [--keep-journal]"
+            << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  fs::path session;
+  bool keep_journal = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--keep-journal") {
+      keep_journal = true;
+    } else if (arg.rfind("--", 0) != 0 && session.empty()) {
+      session = arg;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (session.empty()) {
+    usage();
+    return 1;
+  }
+  session = fs::absolute(session).lexically_normal();
+  if (!session.has_filename()) {
+    session = session.parent_path();
+  }
+  const std::string name = session.filename().string();
+  const fs::path journal = session / "checkpoint.journal";
+
+  orb_slam3_ros2::CheckpointContents contents;
+  std::string error;
+  if (!orb_slam3_ros2::CheckpointReader::read(journal.string(), contents,
+                                              error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  std::cout << contents.checkpoints << " checkpoints, "
+            << contents.points.size() << " points, " << contents.poses.size()
+            << " poses, " << contents.tiles.size() << " grid tiles"
+            << std::endl;
+  if (contents.torn) {
+    std::cout << "dropped an incomplete checkpoint at the end" << std::endl;
+  }
+  for (const char *subdirectory : {"cloud", "grid", "poses"}) {
+    fs::create_directories(session / subdirectory);
+  }
+
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  cloud.reserve(contents.points.size());
+  for (const auto &[id, position] : contents.points) {
+    cloud.push_back(pcl::PointXYZ(position.x(), position.y(), position.z()));
+  }
+  bool ok = cloud.empty() ||
+            pcl::io::savePCDFileBinary(
+              (session / "cloud" / (name + ".pcd")).string(), cloud) == 0;
+
+  orb_slam3_ros2::TiledOccupancyGrid grid(contents.grid_params);
+  for (const auto &[key, cells] : contents.tiles) {
+    grid.restore_tile(key.first, key.second, cells.data());
+  }
+  nav_msgs::msg::OccupancyGrid grid_msg;
+  grid_msg.header.frame_id = "live_map";
+  grid.to_msg(grid_msg);
+  nav2_map_server::SaveParameters save_params;
+  save_params.map_file_name = (session / "grid" / name).string();
+  save_params.image_format = "pgm";
+  save_params.free_thresh = 0.196;
+  save_params.occupied_thresh = 0.65;
+  ok = (grid.tile_count() == 0 ||
+        nav2_map_server::saveMapToFile(grid_msg, save_params)) &&
+       ok;
+
+  {
+    orb_slam3_ros2::TrajectoryLog trajectory(
+      (session / "poses" / name).string(), {"tum"});
+    for (const orb_slam3_ros2::StampedPose &pose : contents.poses) {
+      trajectory.append(pose.stamp, pose.Twc);
+    }
+  }
+
+  if (!ok) {
+    std::cerr << "failed to write the recovered session" << std::endl;
+    return 1;
+  }
+  if (!keep_journal) {
+    fs::remove(journal);
+  }
+  std::cout << "recovered " << session.string() << std::endl;
+  return 0;
+}
@@ -0,0 +1,582 @@
+// Replays a recorded session through ORB_SLAM3 without ROS timing in the
+// loop and reports throughput, tracking latency, CPU time per thread and the
+// absolute trajectory error against ground truth.
+//
+// usage: slam_replay_bench <bag or dataset folder> [options]
+//   --format bag|euroc|tumvi  input type, guessed from the folder by default
+//   --sensor monocular|imu-monocular            (default: imu-monocular)
+//   --settings <yaml>      ORB_SLAM3 settings, picked from config/ by default
+//   --vocabulary <file>    (default: ORB_SLAM3/Vocabulary/ORBvoc.txt)
+//   --speed <factor>       replay speed, 0 replays as fast as possible
+//   --image-topic <topic>  (bag only, default: /camera/infra1/image_rect_raw)
+//   --imu-topic <topic>    (bag only, default: /camera/imu)
+//   --groundtruth <file>   ASL .csv or TUM .txt trajectory
+//   --trajectory <file>    write the estimated trajectory in TUM format
+//   --viewer               show the Pangolin viewer
+
+#include <cv_bridge/cv_bridge.hpp>
+#include <rclcpp/serialization.hpp>
+#include <rclcpp/serialized_message.hpp>
+#include <rosbag2_cpp/reader.hpp>
+#include <rosbag2_storage/storage_filter.hpp>
+#include <sensor_msgs/image_encodings.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/imu.hpp>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <System.h>
+#include <Tracking.h>
+
+#include "orb_slam3_ros2/imu_ring_buffer.hpp"
+
+namespace fs = std::filesystem;
+
+struct ReplayFrame {
+  double stamp;
+  cv::Mat image;
+};
+
+// Produces frames in stamp order. Before a frame is returned, every IMU
+// sample up to its stamp (and one past it, when there is one) has been
+// pushed to `imu`, so the caller can slice the interval exactly like the
+// live node does.
+class ReplaySource {
+public:
+  virtual ~ReplaySource() = default;
+  virtual bool next(ReplayFrame &frame,
+                    orb_slam3_ros2::ImuRingBuffer &imu) = 0;
+};
+
+static std::vector<std::vector<std::string>> read_csv(const fs::path &path)
+{
+  std::vector<std::vector<std::string>> rows;
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    if (line.back() == '\r') {
+      line.pop_back();
+    }
+    std::vector<std::string> row;
+    std::stringstream ss(line);
+    std::string cell;
+    while (std::getline(ss, cell, ',')) {
+      row.push_back(cell);
+    }
+    rows.push_back(row);
+  }
+  return rows;
+}
+
+// EuRoC and TUM-VI share the ASL folder layout: mav0/cam0/data.csv lists the
+// images by nanosecond stamp, mav0/imu0/data.csv holds gyro then accel.
+class AslDatasetSource : public ReplaySource {
+public:
+  explicit AslDatasetSource(const fs::path &root)
+  {
+    fs::path mav0 = root / "mav0";
+    for (const auto &row : read_csv(mav0 / "cam0" / "data.csv")) {
+      if (row.size() >= 2) {
+        images_.push_back(
+          {std::stod(row[0]) * 1e-9, mav0 / "cam0" / "data" / row[1]});
+      }
+    }
+    for (const auto &row : read_csv(mav0 / "imu0" / "data.csv")) {
+      if (row.size() >= 7) {
+        ImuRow imu;
+        imu.stamp = std::stod(row[0]) * 1e-9;
+        for (int i = 0; i < 6; i++) {
+          imu.values[i] = std::stof(row[i + 1]);
+        }
+        imu_.push_back(imu);
+      }
+    }
+  }
+
+  bool next(ReplayFrame &frame, orb_slam3_ros2::ImuRingBuffer &imu) override
+  {
+    if (image_index_ >= images_.size()) {
+      return false;
+    }
+    const auto &[stamp, path] = images_[image_index_++];
+    while (imu_index_ < imu_.size() &&
+           (imu_index_ == 0 || imu_[imu_index_ - 1].stamp <= stamp)) {
+      const ImuRow &row = imu_[imu_index_++];
+      imu.push(row.stamp, row.values[3], row.values[4], row.values[5],
+               row.values[0], row.values[1], row.values[2]);
+    }
+    frame.stamp = stamp;
+    frame.image = cv::imread(path.string(), cv::IMREAD_GRAYSCALE);
+    return !frame.image.empty();
+  }
+
+private:
+  struct ImuRow {
+    double stamp;
+    float values[6]; // wx wy wz ax ay az
+  };
+
+  std::vector<std::pair<double, fs::path>> images_;
+  std::vector<ImuRow> imu_;
+  std::size_t image_index_ = 0;
+  std::size_t imu_index_ = 0;
+};
+
+// Reads a rosbag2 recording of the camera and imu topics. Bags are ordered
+// by receive time, so an image is held back until an IMU sample newer than
+// it has been read.
+class BagSource : public ReplaySource {
+public:
+  BagSource(const std::string &path, const std::string &image_topic,
+            const std::string &imu_topic, bool use_imu)
+    : image_topic_(image_topic), imu_topic_(imu_topic), use_imu_(use_imu)
+  {
+    reader_.open(path);
+    rosbag2_storage::StorageFilter filter;
+    filter.topics = {image_topic_};
+    if (use_imu_) {
+      filter.topics.push_back(imu_topic_);
+    }
+    reader_.set_filter(filter);
+  }
+
+  bool next(ReplayFrame &frame, orb_slam3_ros2::ImuRingBuffer &imu) override
+  {
+    while (true) {
+      if (!pending_.empty() &&
+          (!use_imu_ || finished_ || pending_.front().stamp < last_imu_)) {
+        frame = std::move(pending_.front());
+        pending_.pop_front();
+        return true;
+      }
+      if (finished_) {
+        return false;
+      }
+      if (!reader_.has_next()) {
+        finished_ = true;
+        continue;
+      }
+
+      auto bag_msg = reader_.read_next();
+      rclcpp::SerializedMessage serialized(*bag_msg->serialized_data);
+      if (bag_msg->topic_name == image_topic_) {
+        auto msg = std::make_shared<sensor_msgs::msg::Image>();
+        image_serialization_.deserialize_message(&serialized, msg.get());
+        ReplayFrame pending;
+        pending.stamp =
+          msg->header.stamp.sec + msg->header.stamp.nanosec * 1e-9;
+        pending.image =
+          cv_bridge::toCvCopy(msg, sensor_msgs::image_encodings::MONO8)->image;
+        pending_.push_back(std::move(pending));
+      } else {
+        sensor_msgs::msg::Imu msg;
+        imu_serialization_.deserialize_message(&serialized, &msg);
+        last_imu_ = msg.header.stamp.sec + msg.header.stamp.nanosec * 1e-9;
+        imu.push(last_imu_, msg.linear_acceleration.x,
+                 msg.linear_acceleration.y, msg.linear_acceleration.z,
+                 msg.angular_velocity.x, msg.angular_velocity.y,
+                 msg.angular_velocity.z);
+      }
+    }
+  }
+
+private:
+  rosbag2_cpp::Reader reader_;
+  rclcpp::Serialization<sensor_msgs::msg::Image> image_serialization_;
+  rclcpp::Serialization<sensor_msgs::msg::Imu> imu_serialization_;
+  std::string image_topic_;
+  std::string imu_topic_;
+  bool use_imu_;
+  bool finished_ = false;
+  double last_imu_ = -1.0;
+  std::deque<ReplayFrame> pending_;
+};
+
+struct StampedPosition {
+  double stamp;
+  Eigen::Vector3d position;
+  Eigen::Quaterniond orientation = Eigen::Quaterniond::Identity();
+};
+
+// ASL ground truth csv (ns, px, py, pz, ...) or TUM text (s tx ty tz ...)
+static std::vector<StampedPosition> load_trajectory(const fs::path &path)
+{
+  std::vector<StampedPosition> trajectory;
+  if (path.extension() == ".csv") {
+    for (const auto &row : read_csv(path)) {
+      if (row.size() >= 4) {
+        trajectory.push_back(
+          {std::stod(row[0]) * 1e-9,
+           {std::stod(row[1]), std::stod(row[2]), std::stod(row[3])}});
+      }
+    }
+  } else {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      std::stringstream ss(line);
+      StampedPosition pose;
+      if (ss >> pose.stamp >> pose.position.x() >> pose.position.y() >>
+          pose.position.z()) {
+        trajectory.push_back(pose);
+      }
+    }
+  }
+  std::sort(trajectory.begin(), trajectory.end(),
+            [](const StampedPosition &a, const StampedPosition &b) {
+              return a.stamp < b.stamp;
+            });
+  return trajectory;
+}
+
+// Root mean square of the translation error after aligning the estimate to
+// the ground truth, with scale for monocular runs. Poses are associated with
+// the nearest ground truth stamp within max_dt. Returns the number of pairs.
+static std::size_t
+absolute_trajectory_error(const std::vector<StampedPosition> &estimate,
+                          const std::vector<StampedPosition> &groundtruth,
+                          bool with_scale, double &rmse, double &scale,
+                          double max_dt = 0.02)
+{
+  std::vector<Eigen::Vector3d> est, gt;
+  for (const StampedPosition &pose : estimate) {
+    auto it = std::lower_bound(
+      groundtruth.begin(), groundtruth.end(), pose.stamp,
+      [](const StampedPosition &p, double t) { return p.stamp < t; });
+    const StampedPosition *best = nullptr;
+    if (it != groundtruth.end()) {
+      best = &*it;
+    }
+    if (it != groundtruth.begin()) {
+      const StampedPosition &before = *std::prev(it);
+      if (!best || pose.stamp - before.stamp < best->stamp - pose.stamp) {
+        best = &before;
+      }
+    }
+    if (best && std::abs(best->stamp - pose.stamp) <= max_dt) {
+      est.push_back(pose.position);
+      gt.push_back(best->position);
+    }
+  }
+  if (est.size() < 3) {
+    return est.size();
+  }
+
+  Eigen::Matrix3Xd src(3, est.size()), dst(3, gt.size());
+  for (std::size_t i = 0; i < est.size(); i++) {
+    src.col(i) = est[i];
+    dst.col(i) = gt[i];
+  }
+  Eigen::Matrix4d T = Eigen::umeyama(src, dst, with_scale);
+  Eigen::Matrix3Xd aligned =
+    (T.block<3, 3>(0, 0) * src).colwise() + T.block<3, 1>(0, 3);
+  rmse = std::sqrt((aligned - dst).colwise().squaredNorm().mean());
+  scale = T.block<3, 3>(0, 0).col(0).norm();
+  return est.size();
+}
+
+// user + system CPU seconds of every thread in this process, by tid
+static std::map<int, double> thread_cpu_times()
+{
+  std::map<int, double> times;
+  const double ticks = sysconf(_SC_CLK_TCK);
+  for (const auto &entry : fs::directory_iterator("/proc/self/task")) {
+    std::ifstream file(entry.path() / "stat");
+    std::string stat;
+    std::getline(file, stat);
+    std::size_t end = stat.rfind(')');
+    if (end == std::string::npos) {
+      continue;
+    }
+    // fields after the command name start at field 3 (state); utime and
+    // stime are fields 14 and 15
+    std::stringstream ss(stat.substr(end + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && ss >> field; i++) {
+      if (i == 14) {
+        utime = std::stoul(field);
+      } else if (i == 15) {
+        stime = std::stoul(field);
+      }
+    }
+    times[std::stoi(entry.path().filename().string())] =
+      (utime + stime) / ticks;
+  }
+  return times;
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  std::size_t index = std::min(
+    sorted.size() - 1, static_cast<std::size_t>(p / 100.0 * sorted.size()));
+  return sorted[index];
+}
+
+static void usage()
+{
+  std::cerr << "usage: slam_replay_bench <bag or dataset folder> "
+               "[--format bag|euroc|tumvi] [--sensor monocular|imu-monocular] "
+               "[--settings <yaml>] [--vocabulary <file>] [--speed <factor>] "
+               "[--image-topic <topic>] [--imu-topic <topic>] "
+               "[--groundtruth <file>] [--trajectory <file>] [--viewer]"
+            << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  fs::path input = argv[1];
+  std::map<std::string, std::string> options = {
+    {"sensor", "imu-monocular"},
+    {"vocabulary",
+     std::string(PROJECT_PATH) + "/ORB_SLAM3/Vocabulary/ORBvoc.txt"},
+    {"speed", "0"},
+    {"image-topic", "/camera/infra1/image_rect_raw"},
+    {"imu-topic", "/camera/imu"},
+  };
+  bool viewer = false;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--viewer") {
+      viewer = true;
+    } else if (arg.rfind("--", 0) == 0 && i + 1 < argc) {
+      options[arg.substr(2)] = argv[++i];
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  // guess the input type from the folder layout
+  std::string format = options["format"];
+  if (format.empty()) {
+    if (fs::exists(input / "metadata.yaml")) {
+      format = "bag";
+    } else if (fs::exists(input / "mav0" / "mocap0")) {
+      format = "tumvi";
+    } else if (fs::exists(input / "mav0")) {
+      format = "euroc";
+    } else {
+      std::cerr << "Cannot tell what " << input << " is, pass --format"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  ORB_SLAM3::System::eSensor sensor_type;
+  std::string settings_dir;
+  if (options["sensor"] == "monocular") {
+    sensor_type = ORB_SLAM3::System::MONOCULAR;
+    settings_dir = "/config/Monocular/";
+  } else if (options["sensor"] == "imu-monocular") {
+    sensor_type = ORB_SLAM3::System::IMU_MONOCULAR;
+    settings_dir = "/config/Monocular-Inertial/";
+  } else {
+    std::cerr << "Sensor type not recognized" << std::endl;
+    return 1;
+  }
+  bool use_imu = sensor_type == ORB_SLAM3::System::IMU_MONOCULAR;
+
+  std::unique_ptr<ReplaySource> source;
+  std::string settings = options["settings"];
+  std::string groundtruth = options["groundtruth"];
+  if (format == "bag") {
+    source = std::make_unique<BagSource>(
+      input.string(), options["image-topic"], options["imu-topic"], use_imu);
+    if (settings.empty()) {
+      settings =
+        std::string(PROJECT_PATH) + settings_dir + "RealSense_D435i.yaml";
+    }
+  } else if (format == "euroc" || format == "tumvi") {
+    source = std::make_unique<AslDatasetSource>(input);
+    if (settings.empty()) {
+      settings = std::string(PROJECT_PATH) + settings_dir +
+                 (format == "euroc" ? "EuRoC.yaml" : "TUM-VI.yaml");
+    }
+    if (groundtruth.empty()) {
+      fs::path gt = input / "mav0" /
+                    (format == "euroc" ? "state_groundtruth_estimate0"
+                                       : "mocap0") /
+                    "data.csv";
+      if (fs::exists(gt)) {
+        groundtruth = gt.string();
+      }
+    }
+  } else {
+    std::cerr << "Unknown format " << format << std::endl;
+    return 1;
+  }
+  const double speed = std::stod(options["speed"]);
+
+  ORB_SLAM3::System SLAM(options["vocabulary"], settings, sensor_type, viewer,
+                         0);
+  const float imageScale = SLAM.GetImageScale();
+
+  orb_slam3_ros2::ImuRingBuffer imu(4000);
+  std::vector<ORB_SLAM3::IMU::Point> vImuMeas;
+  vImuMeas.reserve(256);
+  std::vector<double> latencies_ms;
+  std::vector<StampedPosition> estimate;
+  std::size_t frames = 0, skipped = 0, lost = 0;
+
+  const std::map<int, double> cpu_before = thread_cpu_times();
+  const int tracking_tid = gettid();
+  const auto wall_start = std::chrono::steady_clock::now();
+  double first_stamp = -1.0;
+
+  ReplayFrame frame;
+  while (source->next(frame, imu)) {
+    vImuMeas.clear();
+    imu.slice(frame.stamp, [&vImuMeas](double t, float ax, float ay, float az,
+                                       float gx, float gy, float gz) {
+      vImuMeas.emplace_back(ax, ay, az, gx, gy, gz, t);
+    });
+    if (use_imu && vImuMeas.size() <= 1) {
+      skipped++;
+      continue;
+    }
+
+    if (first_stamp < 0) {
+      first_stamp = frame.stamp;
+    }
+    if (speed > 0) {
+      auto offset = std::chrono::duration<double>(
+        (frame.stamp - first_stamp) / speed);
+      std::this_thread::sleep_until(
+        wall_start +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          offset));
+    }
+
+    if (imageScale != 1.f) {
+      cv::resize(frame.image, frame.image,
+                 cv::Size(frame.image.cols * imageScale,
+                          frame.image.rows * imageScale));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Sophus::SE3f Tcw =
+      use_imu ? SLAM.TrackMonocular(frame.image, frame.stamp, vImuMeas)
+              : SLAM.TrackMonocular(frame.image, frame.stamp);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    latencies_ms.push_back(
+      std::chrono::duration<double, std::milli>(elapsed).count());
+    frames++;
+
+    if (SLAM.GetTrackingState() == ORB_SLAM3::Tracking::OK) {
+      Sophus::SE3f Twc = Tcw.inverse();
+      estimate.push_back({frame.stamp, Twc.translation().cast<double>(),
+                          Twc.unit_quaternion().cast<double>()});
+    } else {
+      lost++;
+    }
+  }
+
+  const double wall_s = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - wall_start)
+                          .count();
+  const std::map<int, double> cpu_after = thread_cpu_times();
+  SLAM.Shutdown();
+
+  std::sort(latencies_ms.begin(), latencies_ms.end());
+  double mean_ms = 0;
+  for (double ms : latencies_ms) {
+    mean_ms += ms;
+  }
+  mean_ms = frames ? mean_ms / frames : 0.0;
+
+  // YAML, so runs can be diffed and collected by scripts
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "input: " << input.string() << "\n"
+            << "format: " << format << "\n"
+            << "sensor: " << options["sensor"] << "\n"
+            << "settings: " << settings << "\n"
+            << "speed: " << speed << "\n"
+            << "frames: " << frames << "\n"
+            << "frames_skipped: " << skipped << "\n"
+            << "frames_not_tracked: " << lost << "\n"
+            << "wall_time_s: " << wall_s << "\n"
+            << "fps: " << (wall_s > 0 ? frames / wall_s : 0.0) << "\n"
+            << "latency_ms:\n"
+            << "  mean: " << mean_ms << "\n"
+            << "  p50: " << percentile(latencies_ms, 50) << "\n"
+            << "  p90: " << percentile(latencies_ms, 90) << "\n"
+            << "  p99: " << percentile(latencies_ms, 99) << "\n"
+            << "  max: " << (frames ? latencies_ms.back() : 0.0) << "\n";
+
+  std::cout << "thread_cpu_s:\n";
+  double cpu_total = 0;
+  for (const auto &[tid, seconds] : cpu_after) {
+    auto before = cpu_before.find(tid);
+    double used = seconds - (before != cpu_before.end() ? before->second : 0);
+    cpu_total += used;
+    std::cout << "  "
+              << (tid == tracking_tid ? "tracking" : std::to_string(tid))
+              << ": " << used << "\n";
+  }
+  std::cout << "  total: " << cpu_total << "\n";
+
+  if (!groundtruth.empty()) {
+    double rmse = 0, scale = 1;
+    std::size_t pairs =
+      absolute_trajectory_error(estimate, load_trajectory(groundtruth),
+                                !use_imu, rmse, scale);
+    std::cout << "ate:\n"
+              << "  groundtruth: " << groundtruth << "\n"
+              << "  pairs: " << pairs << "\n";
+    if (pairs >= 3) {
+      std::cout << "  rmse_m: " << rmse << "\n"
+                << "  scale: " << scale << "\n";
+    }
+  }
+
+  if (!options["trajectory"].empty()) {
+    std::ofstream out(options["trajectory"]);
+    out << std::fixed << std::setprecision(9);
+    for (const StampedPosition &pose : estimate) {
+      const Eigen::Quaterniond &q = pose.orientation;
+      out << pose.stamp << " " << pose.position.x() << " "
+          << pose.position.y() << " " << pose.position.z() << " " << q.x()
+          << " " << q.y() << " " << q.z() << " " << q.w() << "\n";
+    }
+  }
+
+  return 0;
+}
@@ -1,50 +1,75 @@
+#include <pcl/PCLPointCloud2.h>
 #include <pcl/impl/point_types.hpp>
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_cloud.h>
 #include <pcl_conversions/pcl_conversions.h>
 
+#include <geometry_msgs/msg/point_stamped.hpp>
 #include <sensor_msgs/msg/point_cloud2.hpp>
-#include <visualization_msgs/msg/detail/marker_array__struct.hpp>
-#include <visualization_msgs/msg/marker.hpp>
-#include <visualization_msgs/msg/marker_array.hpp>
+#include <sensor_msgs/point_cloud2_iterator.hpp>
 
 #include <filesystem>
+#include <stdexcept>
 
+#include "orb_slam3_ros2/live_map_cloud.hpp"
+#include "orb_slam3_ros2/octree_lod.hpp"
 #include "rclcpp/rclcpp.hpp"
+#include "rclcpp_components/register_node_macro.hpp"
 
-using namespace std::chrono_literals;
-
-struct Box {
-  float x_min = std::numeric_limits<float>::infinity();
-  float x_max = -std::numeric_limits<float>::infinity();
-  float y_min = std::numeric_limits<float>::infinity();
-  float y_max = -std::numeric_limits<float>::infinity();
-  float z_min = std::numeric_limits<float>::infinity();
-  float z_max = -std::numeric_limits<float>::infinity();
-};
+namespace orb_slam3_ros2 {
 
+// Serves a saved map cloud as a level-of-detail hierarchy. A coarse overview
+// is published once on full_cloud with transient-local durability, so late
+// subscribers get it without the node republishing millions of points every
+// second. Clicking a point in RViz ("Publish Point", /clicked_point) publishes
+// the full-resolution cloud around it on detail_cloud.
+//
+// The hierarchy is cached as a binary map next to the PCD. Later starts mmap
+// that file instead of parsing the PCD, so opening a large session is
+// independent of its size and only the viewed chunks are paged in.
 class Visualize : public rclcpp::Node {
 public:
-  Visualize() : Node("visualize")
+  explicit Visualize(const rclcpp::NodeOptions &options = rclcpp::NodeOptions())
+    : Node("visualize", options)
   {
     // declare parameters
     declare_parameter("output_name", "");
+    declare_parameter("overview_max_points", 200000);
+    declare_parameter("detail_max_points", 1000000);
+    declare_parameter("roi_size", 10.0);
+    declare_parameter("lod_leaf_points", 4096);
+    declare_parameter("map_cache", true);
 
     // get parameters
     get_parameter("output_name", output_name_);
+    overview_max_points_ = get_parameter("overview_max_points").as_int();
+    detail_max_points_ = get_parameter("detail_max_points").as_int();
+    roi_size_ = get_parameter("roi_size").as_double();
+    map_cache_ = get_parameter("map_cache").as_bool();
+    lod_ = OctreeLod(get_parameter("lod_leaf_points").as_int());
 
     if (!load_clouds()) {
-      RCLCPP_ERROR(get_logger(), "Error loading clouds");
-      rclcpp::shutdown();
+      throw std::runtime_error("Error loading clouds");
     }
 
     // define publishers
-    full_cloud_publisher_ =
-      create_publisher<sensor_msgs::msg::PointCloud2>("full_cloud", 10);
+    full_cloud_publisher_ = create_publisher<sensor_msgs::msg::PointCloud2>(
+      "full_cloud", rclcpp::QoS(1).transient_local());
+    detail_cloud_publisher_ = create_publisher<sensor_msgs::msg::PointCloud2>(
+      "detail_cloud", rclcpp::QoS(1).transient_local());
+
+    // define subscribers
+    clicked_point_subscriber_ =
+      create_subscription<geometry_msgs::msg::PointStamped>(
+        "clicked_point", 10,
+        std::bind(&Visualize::clicked_point_callback, this,
+                  std::placeholders::_1));
 
-    // define timer
-    timer_ =
-      create_wall_timer(1000ms, std::bind(&Visualize::timer_callback, this));
+    std::vector<Eigen::Vector3f> overview;
+    lod_.collect(overview, overview_max_points_);
+    full_cloud_publisher_->publish(to_msg(overview));
+    RCLCPP_INFO_STREAM(get_logger(), "Published overview with "
+                                       << overview.size() << " points");
   }
 
 private:
@@ -59,36 +84,119 @@ private:
     }
     std::string cloud_path =
       output_path + "/cloud/" + output_name_ + ".pcd";
-    if (pcl::io::loadPCDFile(cloud_path, full_cloud_) == -1) {
+    std::string map_path = output_path + "/cloud/" + output_name_ + ".lod";
+    if (map_cache_ && map_is_current(map_path, cloud_path)) {
+      if (lod_.map(map_path)) {
+        RCLCPP_INFO_STREAM(get_logger(), "Mapped " << map_path << " with "
+                                                   << lod_.size()
+                                                   << " points");
+        return true;
+      }
+      RCLCPP_WARN_STREAM(get_logger(), "Error mapping " << map_path
+                                                        << ", rebuilding it");
+    }
+
+    pcl::PCLPointCloud2 pcl_cloud;
+    if (pcl::io::loadPCDFile(cloud_path, pcl_cloud) == -1) {
       RCLCPP_ERROR_STREAM(get_logger(), "Error loading file " << cloud_path);
       return false;
     }
+    sensor_msgs::msg::PointCloud2 cloud_msg;
+    pcl_conversions::moveFromPCL(pcl_cloud, cloud_msg);
+
+    std::vector<Eigen::Vector3f> points;
+    points.reserve(cloud_msg.width * cloud_msg.height);
+    sensor_msgs::PointCloud2ConstIterator<float> x(cloud_msg, "x");
+    sensor_msgs::PointCloud2ConstIterator<float> y(cloud_msg, "y");
+    sensor_msgs::PointCloud2ConstIterator<float> z(cloud_msg, "z");
+    for (; x != x.end(); ++x, ++y, ++z) {
+      if (std::isfinite(*x) && std::isfinite(*y) && std::isfinite(*z)) {
+        points.emplace_back(*x, *y, *z);
+      }
+    }
+    lod_.build(std::move(points));
     RCLCPP_INFO_STREAM(get_logger(), "Loaded full cloud with "
-                                       << full_cloud_.size() << " points");
+                                       << lod_.size() << " points into "
+                                       << lod_.node_count() << " nodes");
+    if (!map_cache_) {
+      return true;
+    }
+    // serving from the mapped copy releases the heap copy of the cloud
+    if (!lod_.save(map_path)) {
+      RCLCPP_WARN_STREAM(get_logger(), "Error writing " << map_path);
+    } else if (!lod_.map(map_path)) {
+      RCLCPP_WARN_STREAM(get_logger(), "Error mapping " << map_path);
+    }
     return true;
   }
-  void timer_callback()
+
+  // the map is stale once the PCD has been rewritten, e.g. by
+  // cloud_postprocess
+  static bool map_is_current(const std::string &map_path,
+                             const std::string &cloud_path)
   {
-    sensor_msgs::msg::PointCloud2 full_cloud_msg;
-    pcl::toROSMsg(full_cloud_, full_cloud_msg);
-    full_cloud_msg.header.frame_id = "map";
-    full_cloud_msg.header.stamp = get_clock()->now();
-    full_cloud_publisher_->publish(full_cloud_msg);
+    std::error_code error;
+    auto map_time = std::filesystem::last_write_time(map_path, error);
+    if (error) {
+      return false;
+    }
+    auto cloud_time = std::filesystem::last_write_time(cloud_path, error);
+    return error || map_time >= cloud_time;
+  }
+
+  void clicked_point_callback(
+    const geometry_msgs::msg::PointStamped::SharedPtr msg)
+  {
+    if (!msg->header.frame_id.empty() && msg->header.frame_id != "map") {
+      RCLCPP_WARN_STREAM(get_logger(), "Ignoring point in frame "
+                                         << msg->header.frame_id
+                                         << ", expected map");
+      return;
+    }
+    Eigen::Vector3f center(msg->point.x, msg->point.y, msg->point.z);
+    Eigen::Vector3f half = Eigen::Vector3f::Constant(roi_size_ * 0.5f);
+    Eigen::AlignedBox3f roi(center - half, center + half);
+
+    std::vector<Eigen::Vector3f> detail;
+    lod_.collect(detail, detail_max_points_, &roi);
+    detail_cloud_publisher_->publish(to_msg(detail));
+    RCLCPP_INFO_STREAM(get_logger(), "Published " << detail.size()
+                                                  << " points around ("
+                                                  << center.transpose()
+                                                  << ")");
+  }
+
+  sensor_msgs::msg::PointCloud2
+  to_msg(const std::vector<Eigen::Vector3f> &points) const
+  {
+    sensor_msgs::msg::PointCloud2 msg;
+    msg.header.frame_id = "map";
+    msg.header.stamp = get_clock()->now();
+    layout_.apply(msg, points.size());
+    uint8_t *data = msg.data.data();
+    for (const Eigen::Vector3f &point : points) {
+      layout_.write(data, point.x(), point.y(), point.z(), 0, 0);
+      data += layout_.point_step();
+    }
+    return msg;
   }
 
-  rclcpp::TimerBase::SharedPtr timer_;
   rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr
     full_cloud_publisher_;
+  rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr
+    detail_cloud_publisher_;
+  rclcpp::Subscription<geometry_msgs::msg::PointStamped>::SharedPtr
+    clicked_point_subscriber_;
 
-  pcl::PointCloud<pcl::PointXYZ> full_cloud_;
+  OctreeLod lod_;
+  PointCloud2Layout layout_;
+  std::size_t overview_max_points_;
+  std::size_t detail_max_points_;
+  double roi_size_;
+  bool map_cache_;
   std::string output_name_;
-  std::string cloud_path_;
 };
 
-int main(int argc, char *argv[])
-{
-  rclcpp::init(argc, argv);
-  rclcpp::spin(std::make_shared<Visualize>());
-  rclcpp::shutdown();
-  return 0;
-}
+} // namespace orb_slam3_ros2
+
+RCLCPP_COMPONENTS_REGISTER_NODE(orb_slam3_ros2::Visualize)
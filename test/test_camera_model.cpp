@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "orb_slam3_ros2/camera_model.hpp"
+
+using orb_slam3_ros2::CameraModel;
+
+namespace {
+
+const std::string config_path = std::string(PROJECT_PATH) + "/config/";
+
+} // namespace
+
+TEST(CameraModel, LoadsRectifiedStereoSettings)
+{
+  CameraModel model;
+  ASSERT_TRUE(model.load(config_path + "Stereo/RealSense_D435i.yaml"))
+    << model.error();
+  EXPECT_EQ(model.type(), CameraModel::Type::PinHole);
+  EXPECT_EQ(model.width(), 640);
+  EXPECT_EQ(model.height(), 480);
+  EXPECT_DOUBLE_EQ(model.K().at<double>(0, 0), 382.613);
+  EXPECT_DOUBLE_EQ(model.K().at<double>(1, 2), 236.455);
+  EXPECT_FALSE(model.has_distortion());
+  EXPECT_EQ(model.D().total(), 5u);
+}
+
+TEST(CameraModel, RectifiedCameraIsNotRemapped)
+{
+  CameraModel model;
+  ASSERT_TRUE(model.load(config_path + "Stereo/KITTI00-02.yaml"))
+    << model.error();
+  model.init_rectification(1.0);
+  EXPECT_EQ(cv::norm(model.rectified_K(), model.K(), cv::NORM_INF), 0.0);
+
+  cv::Mat image(model.height(), model.width(), CV_8UC1);
+  cv::randu(image, 0, 256);
+  cv::Mat rectified;
+  ASSERT_TRUE(model.rectify(image, rectified));
+  EXPECT_EQ(cv::norm(image, rectified, cv::NORM_INF), 0.0);
+
+  sensor_msgs::msg::CameraInfo info = model.camera_info(false);
+  EXPECT_EQ(info.distortion_model, "plumb_bob");
+  ASSERT_EQ(info.d.size(), 5u);
+  for (double d : info.d) {
+    EXPECT_EQ(d, 0.0);
+  }
+  EXPECT_DOUBLE_EQ(info.k[0], 718.856);
+  EXPECT_DOUBLE_EQ(info.p[2], 607.1928);
+}
+
+TEST(CameraModel, KeepsRectifiedSettingsAsTheyAre)
+{
+  const std::string settings =
+    config_path + "Stereo-Inertial/RealSense_D435i.yaml";
+  CameraModel model;
+  ASSERT_TRUE(model.load(settings)) << model.error();
+  model.init_rectification();
+
+  const std::string out =
+    (std::filesystem::temp_directory_path() / "test_camera_model.yaml")
+      .string();
+  ASSERT_TRUE(model.write_rectified_settings(settings, out));
+  std::ifstream written(out);
+  std::stringstream text;
+  text << written.rdbuf();
+  std::filesystem::remove(out);
+  EXPECT_NE(text.str().find("Camera.type: \"Rectified\""), std::string::npos);
+  EXPECT_EQ(text.str().find("rectified by orb_slam3_ros2"), std::string::npos);
+}